@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "bench.h"
+
+#define MAX_SAMPLES 1000
+
+static int quick = 0;
+static char **filters = NULL;
+static int num_filters = 0;
+static uint32_t rand_state = 2463534242u;
+
+uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t bench_rand(void) {
+    // xorshift32
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+int bench_selected(const char *group) {
+    if (num_filters == 0) return 1;
+    for (int i = 0; i < num_filters; i++) {
+        if (strcmp(filters[i], group) == 0) return 1;
+    }
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x < y) ? -1 : (x > y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int) (p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+void bench_run(const char *group, const char *name, const char *params, bench_fn_t fn, void *ctx,
+               long ops, int samples) {
+    double ns_per_op[MAX_SAMPLES];
+    uint64_t total_ns = 0;
+
+    if (quick) {
+        ops = (ops >= 10) ? ops / 10 : 1;
+        samples = (samples >= 6) ? samples / 3 : samples;
+    }
+    if (samples > MAX_SAMPLES) samples = MAX_SAMPLES;
+
+    fn(ctx, ops);   // warm up caches, the allocator and the branch predictors
+    for (int s = 0; s < samples; s++) {
+        uint64_t start = bench_now();
+        fn(ctx, ops);
+        uint64_t elapsed = bench_now() - start;
+        total_ns += elapsed;
+        ns_per_op[s] = (double) elapsed / ops;
+    }
+    qsort(ns_per_op, samples, sizeof(double), compare_double);
+
+    printf("%s,%s,%s,%d,%ld,%.2f,%.0f,%.2f,%.2f,%.2f,%.2f\n", group, name, params, samples, ops,
+           (double) total_ns / ((double) ops * samples), (double) ops * samples * 1e9 / total_ns,
+           ns_per_op[0], percentile(ns_per_op, samples, 0.50), percentile(ns_per_op, samples, 0.90),
+           percentile(ns_per_op, samples, 0.99));
+    fflush(stdout);
+}
+
+static void print_help(char *prog) {
+    printf("Use this program as: %s [-q] [group ...]\n", prog);
+    printf("\t%-15s : quick run with fewer operations and samples\n", "-q");
+    printf("\t%-15s : only run these groups: sbuffer dplist datamgr storage log (default all)\n", "group");
+    printf("Results are CSV on stdout, percentiles are over the ns/op of the samples\n");
+}
+
+int main(int argc, char *argv[]) {
+    char workdir[] = "/tmp/sensor_bench.XXXXXX";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qh")) != -1) {
+        switch (opt) {
+            case 'q': quick = 1; break;
+            default: print_help(argv[0]); exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    filters = argv + optind;
+    num_filters = argc - optind;
+
+    // the storage and log benchmarks create data.csv and gateway.log, keep them away from the real ones
+    if (mkdtemp(workdir) == NULL || chdir(workdir) != 0) {
+        perror("bench: can't create a working directory");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("group,benchmark,params,samples,ops_per_sample,ns_per_op,ops_per_s,min_ns,p50_ns,p90_ns,p99_ns\n");
+    if (bench_selected("sbuffer")) bench_sbuffer();
+    if (bench_selected("dplist")) bench_dplist();
+    if (bench_selected("datamgr")) bench_datamgr();
+    if (bench_selected("storage")) bench_storage();
+    if (bench_selected("placement")) bench_placement();
+    if (bench_selected("coro")) bench_coro();
+    if (bench_selected("log")) bench_log();
+
+    // every group removes the files it created, so the directory is empty again
+    if (chdir("/") != 0 || rmdir(workdir) != 0) fprintf(stderr, "bench: couldn't remove %s\n", workdir);
+    return EXIT_SUCCESS;
+}
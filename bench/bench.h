@@ -0,0 +1,45 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+
+/*
+ * Tiny microbenchmark harness.
+ * A benchmark function performs 'ops' operations per call; the harness calls it once to warm up and then
+ * 'samples' times, and reports the ns/op distribution over the samples plus the overall ops/s.
+ * Results are printed as CSV on stdout (one line per benchmark), so runs can be diffed for regressions.
+ */
+
+typedef void (*bench_fn_t)(void *ctx, long ops);
+
+/** Runs and reports one benchmark
+ * \param group the benchmark group, e.g. "sbuffer"
+ * \param name the operation that is measured
+ * \param params free-form parameters of this run, e.g. "producers=4"; must not contain commas
+ * \param fn the function doing 'ops' operations per call
+ * \param ctx passed as is to 'fn'
+ * \param ops operations per sample (scaled down in quick mode)
+ * \param samples number of timed samples
+ */
+void bench_run(const char *group, const char *name, const char *params, bench_fn_t fn, void *ctx,
+               long ops, int samples);
+
+/** Returns true if the benchmarks of 'group' were selected on the command line */
+int bench_selected(const char *group);
+
+/** Returns the current monotonic time in ns */
+uint64_t bench_now(void);
+
+/** Returns a pseudo random number, cheap and repeatable over runs */
+uint32_t bench_rand(void);
+
+/* benchmark groups, one per source file */
+void bench_sbuffer(void);
+void bench_dplist(void);
+void bench_datamgr(void);
+void bench_storage(void);
+void bench_placement(void);
+void bench_coro(void);
+void bench_log(void);
+
+#endif /* _BENCH_H_ */
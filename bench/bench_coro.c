@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "../coro.h"
+
+/* Handing the CPU from one connection handler to another: coroutines on one executor thread against the
+ * thread per connection of the default connmgr. */
+
+typedef struct {
+    int in;
+    int out;
+    long rounds;
+    int starts;                 // sends the first byte
+} pingpong_t;
+
+// one byte over a pipe; a coroutine waits for it in the executor, a thread blocks in read()
+static void receive_byte(int fd) {
+    char byte;
+    while (read(fd, &byte, 1) != 1) {
+        if (coro_wait_fd(fd, POLLIN, -1) < 0) exit(EXIT_FAILURE);
+    }
+}
+
+static void send_byte(int fd) {
+    char byte = 0;
+    while (write(fd, &byte, 1) != 1) {
+        if (coro_wait_fd(fd, POLLOUT, -1) < 0) exit(EXIT_FAILURE);
+    }
+}
+
+static void *pingpong_run(void *arg) {
+    pingpong_t *p = (pingpong_t *) arg;
+    for (long i = 0; i < p->rounds; i++) {
+        if (p->starts) send_byte(p->out);
+        receive_byte(p->in);
+        if (!p->starts) send_byte(p->out);
+    }
+    return NULL;
+}
+
+/* two handlers passing a byte back and forth, 'ops' handoffs */
+static void run_pingpong(void *arg, long ops) {
+    int coroutines = *(int *) arg;
+    int a_to_b[2], b_to_a[2], flags = coroutines ? O_NONBLOCK : 0;
+    pingpong_t a, b;
+    pthread_t threads[2];
+
+    if (pipe2(a_to_b, flags) != 0 || pipe2(b_to_a, flags) != 0) exit(EXIT_FAILURE);
+    a = (pingpong_t) {.in = b_to_a[0], .out = a_to_b[1], .rounds = ops / 2, .starts = 1};
+    b = (pingpong_t) {.in = a_to_b[0], .out = b_to_a[1], .rounds = ops / 2, .starts = 0};
+    if (coroutines) {
+        if (coro_executor_start(1) != 0 || coro_spawn(pingpong_run, &a) != 0 || coro_spawn(pingpong_run, &b) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        coro_executor_stop();
+    } else {
+        pthread_create(&threads[0], NULL, pingpong_run, &a);
+        pthread_create(&threads[1], NULL, pingpong_run, &b);
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+    }
+    close(a_to_b[0]);
+    close(a_to_b[1]);
+    close(b_to_a[0]);
+    close(b_to_a[1]);
+}
+
+static void *yield_run(void *arg) {
+    long rounds = *(long *) arg;
+    for (long i = 0; i < rounds; i++) coro_yield();
+    return NULL;
+}
+
+/* the bare switch without I/O: 'ops' yields of two coroutines, each back to the worker and on to the other */
+static void run_yield(void *arg, long ops) {
+    long rounds = ops / 2;
+
+    (void) arg;
+    if (coro_executor_start(1) != 0 || coro_spawn(yield_run, &rounds) != 0 || coro_spawn(yield_run, &rounds) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    coro_executor_stop();
+}
+
+static void *noop_run(void *arg) {
+    return arg;
+}
+
+/* starting and finishing a handler, as for every new connection */
+static void run_spawn(void *arg, long ops) {
+    int coroutines = *(int *) arg;
+
+    if (coroutines) {
+        if (coro_executor_start(1) != 0) exit(EXIT_FAILURE);
+        for (long i = 0; i < ops; i++) {
+            if (coro_spawn(noop_run, NULL) != 0) exit(EXIT_FAILURE);
+        }
+        coro_executor_stop();
+    } else {
+        for (long i = 0; i < ops; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, noop_run, NULL) != 0) exit(EXIT_FAILURE);
+            pthread_join(thread, NULL);
+        }
+    }
+}
+
+void bench_coro(void) {
+    static int threads = 0, coroutines = 1;
+
+    bench_run("coro", "pipe_handoff", "pthread-per-connection", run_pingpong, &threads, 200000, 6);
+    bench_run("coro", "pipe_handoff", "coroutines executor=1", run_pingpong, &coroutines, 200000, 6);
+    bench_run("coro", "yield", "coroutines executor=1", run_yield, NULL, 1000000, 6);
+    bench_run("coro", "spawn_finish", "pthread-per-connection", run_spawn, &threads, 5000, 6);
+    bench_run("coro", "spawn_finish", "coroutines executor=1", run_spawn, &coroutines, 5000, 6);
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../datamgr.h"
+#include "../rollup.h"
+#include "../state.h"
+
+#define NUM_SENSORS 1024
+
+typedef struct {
+    my_element_t sensors[NUM_SENSORS];
+    double values[NUM_SENSORS];
+    double sink;
+    room_element_t *rooms;
+    rollup_t *rollup;
+    long reading;               // readings given to rollup_add() so far, continues over calls
+} datamgr_ctx_t;
+
+static void running_avg(void *arg, long ops) {
+    datamgr_ctx_t *ctx = (datamgr_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        my_element_t *sensor = &ctx->sensors[i % NUM_SENSORS];
+        update_running_avg(sensor, ctx->values[i % NUM_SENSORS]);
+        ctx->sink += sensor->running_avg;
+    }
+}
+
+/* the same, plus the incremental update of the sensor's room */
+static void running_avg_room(void *arg, long ops) {
+    datamgr_ctx_t *ctx = (datamgr_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        my_element_t *sensor = &ctx->sensors[i % NUM_SENSORS];
+        double old_avg = sensor->running_avg;
+        int old_count = sensor->count;
+        update_running_avg(sensor, ctx->values[i % NUM_SENSORS]);
+        update_room_avg(&ctx->rooms[sensor->room_index], sensor, old_avg, old_count, ctx->values[i % NUM_SENSORS],
+                        1700000000 + i);
+        ctx->sink += ctx->rooms[sensor->room_index].running_avg;
+    }
+}
+
+typedef struct {
+    my_element_t *sensors;
+    int num_sensors;
+    silence_tracker_t tracker;
+    uint64_t now;               // simulated clock, continues over calls
+    long silent;
+} silence_ctx_t;
+
+/* one op is one reading: sensors report round-robin every 'num_sensors' ticks of 1 us, one in 64 rounds a
+ * sensor skips, so entries are refreshed lazily most of the time and some sensors go silent and come back */
+static void silence_reading(void *arg, long ops) {
+    silence_ctx_t *ctx = (silence_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        ctx->now += 1000;
+        long round = (long) (ctx->now / 1000) / ctx->num_sensors;
+        int index = (int) ((ctx->now / 1000) % ctx->num_sensors);
+        if ((round + index) % 64 != 0) silence_seen(&ctx->tracker, &ctx->sensors[index], ctx->now);
+        while (silence_expired(&ctx->tracker, ctx->now) != NULL) ctx->silent++;
+    }
+}
+
+/* every sensor reports once per second, so a minute window closes every 60 * NUM_SENSORS readings */
+static void rollup_add_stream(void *arg, long ops) {
+    datamgr_ctx_t *ctx = (datamgr_ctx_t *) arg;
+    for (long i = 0; i < ops; i++, ctx->reading++) {
+        sensor_data_t data = {.id = ctx->sensors[ctx->reading % NUM_SENSORS].sensor_id,
+                              .value = ctx->values[ctx->reading % NUM_SENSORS],
+                              .ts = 1700000000 + ctx->reading / NUM_SENSORS};
+        sensor_record_t record = record_pack(&data);
+        ctx->sink += rollup_add(ctx->rollup, &record);
+    }
+}
+
+/* the datamgr publishes one entry per reading, readers copy one (uncontended here: the box may have one core) */
+static void state_publish_reading(void *arg, long ops) {
+    state_sensor_t state = {.room_id = 1, .avg_ready = 1};
+    for (long i = 0; i < ops; i++) {
+        state.sensor_id = (sensor_id_t) (i % 1000 + 1);
+        state.last_value = 15.0 + (i % 997) / 100.0;
+        state.last_ts = 1766229929 + i;
+        state.count++;
+        state_publish(&state);
+    }
+}
+
+static void state_get_sensor(void *arg, long ops) {
+    state_sensor_t state;
+    long *sink = (long *) arg;
+    for (long i = 0; i < ops; i++) {
+        if (state_get((sensor_id_t) (i % 1000 + 1), &state)) *sink += state.count;
+    }
+}
+
+void bench_datamgr(void) {
+    datamgr_ctx_t *ctx = calloc(1, sizeof(datamgr_ctx_t));
+    char params[64];
+
+    if (ctx == NULL) exit(EXIT_FAILURE);
+    // 16 sensors per room
+    dparray_t *map = dpa_create(sizeof(my_element_t), NULL, element_compare);
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        ctx->sensors[i].sensor_id = (uint16_t) (i + 1);
+        ctx->sensors[i].room_id = (uint16_t) (i / 16 + 1);
+        ctx->values[i] = 15.0 + (bench_rand() % 1000) / 100.0;
+        dpa_insert_at_index(map, &ctx->sensors[i], i);
+    }
+    dpa_sort(map);
+    int num_rooms;
+    ctx->rooms = datamgr_build_rooms(map, &num_rooms);
+    for (int i = 0; i < NUM_SENSORS; i++) {
+        ctx->sensors[i].room_index = ((my_element_t *) dpa_get_element_at_index(map, i))->room_index;
+    }
+    snprintf(params, sizeof(params), "sensors=%d window=%d", NUM_SENSORS, RUN_AVG_LENGTH);
+    bench_run("datamgr", "update_running_avg", params, running_avg, ctx, 1000000, 10);
+    snprintf(params, sizeof(params), "sensors=%d rooms=%d window=%d", NUM_SENSORS, num_rooms, RUN_AVG_LENGTH);
+    bench_run("datamgr", "update_running_avg_room", params, running_avg_room, ctx, 1000000, 10);
+    free(ctx->rooms);
+
+    // closed windows go to /dev/null, so this is the cost of the aggregation itself
+    FILE *null_out = fopen("/dev/null", "w");
+    ctx->rollup = rollup_create(ROLLUP_LATENESS, map, null_out, null_out);
+    snprintf(params, sizeof(params), "sensors=%d rooms=%d lateness=%d", NUM_SENSORS, NUM_SENSORS / 16,
+             ROLLUP_LATENESS);
+    bench_run("datamgr", "rollup_add", params, rollup_add_stream, ctx, 1000000, 10);
+    rollup_free(&ctx->rollup);
+    dpa_free(&map, true);
+    if (null_out != NULL) fclose(null_out);
+
+    if (ctx->sink == 42) printf("#\n");
+    free(ctx);
+
+    long state_sink = 0;
+    if (state_init() == 0) {
+        bench_run("datamgr", "state_publish", "sensors=1000", state_publish_reading, NULL, 2000000, 10);
+        bench_run("datamgr", "state_get", "sensors=1000", state_get_sensor, &state_sink, 2000000, 10);
+        if (state_sink == 42) printf("#\n");
+        state_stop();
+    }
+
+    static const int silence_sizes[] = {1000, 100000};
+    for (unsigned i = 0; i < sizeof(silence_sizes) / sizeof(silence_sizes[0]); i++) {
+        silence_ctx_t silence = {.num_sensors = silence_sizes[i]};
+        silence.sensors = calloc(silence.num_sensors, sizeof(my_element_t));
+        if (silence.sensors == NULL) exit(EXIT_FAILURE);
+        // silent after missing 1.5 rounds
+        silence_init(&silence.tracker, (uint64_t) silence.num_sensors * 1500);
+        snprintf(params, sizeof(params), "sensors=%d", silence.num_sensors);
+        bench_run("datamgr", "silence_reading", params, silence_reading, &silence, 2000000, 10);
+        if (silence.silent == 42) printf("#\n");
+        silence_free(&silence.tracker);
+        free(silence.sensors);
+    }
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../lib/dplist.h"
+#include "../lib/dparray.h"
+#include "../datamgr.h"
+
+typedef struct {
+    int size;
+    dplist_t *list;
+    dparray_t *dparray;         // the same elements stored inline in the contiguous companion container
+    dparray_t *sorted;          // and once more, bulk built from shuffled input and in sorted mode
+    my_element_t *array;        // the same elements in one contiguous block, sorted by sensor_id
+    uint16_t *keys;             // random lookup keys, all present
+    int num_keys;
+    long cursor;                // position of element_at_index_loop, continues over calls
+    long sink;
+} dplist_ctx_t;
+
+static int compare_sensor_id(const void *x, const void *y) {
+    return element_compare((void *) x, (void *) y);
+}
+
+static void get_index_of_element(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        ctx->sink += dpl_get_index_of_element(ctx->list, &dummy);
+    }
+}
+
+/* datamgr's lookup: find the index, then walk again to fetch the element */
+static void get_index_then_element(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        int index = dpl_get_index_of_element(ctx->list, &dummy);
+        ctx->sink += ((my_element_t *) dpl_get_element_at_index(ctx->list, index))->count;
+    }
+}
+
+/* one op is one element of an index-based loop: for (i...) dpl_get_element_at_index(list, i) */
+static void element_at_index_loop(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    for (long i = 0; i < ops; i++, ctx->cursor++) {
+        ctx->sink += ((my_element_t *) dpl_get_element_at_index(ctx->list, (int) (ctx->cursor % ctx->size)))->count;
+    }
+}
+
+static void dparray_get_index_of_element(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        int index = dpa_get_index_of_element(ctx->dparray, &dummy);
+        ctx->sink += ((my_element_t *) dpa_get_element_at_index(ctx->dparray, index))->count;
+    }
+}
+
+static void dparray_element_at_index_loop(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    for (long i = 0; i < ops; i++, ctx->cursor++) {
+        ctx->sink += ((my_element_t *) dpa_get_element_at_index(ctx->dparray, (int) (ctx->cursor % ctx->size)))->count;
+    }
+}
+
+/* one op is one element visited by the iterator */
+static void dparray_iterator_scan(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    long visited = 0;
+    while (visited < ops) {
+        dpa_iterator_t it = dpa_iterator(ctx->dparray);
+        for (my_element_t *e; visited < ops && (e = dpa_iterator_next(&it)) != NULL; visited++) {
+            ctx->sink += e->count;
+        }
+    }
+}
+
+static void dparray_sorted_get_index_then_element(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        int index = dpa_get_index_of_element(ctx->sorted, &dummy);
+        ctx->sink += ((my_element_t *) dpa_get_element_at_index(ctx->sorted, index))->count;
+    }
+}
+
+/* lookup of keys that are not in the array, lower bound of a key between two sensor ids */
+static void dparray_sorted_lower_bound(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys] + 1;
+        ctx->sink += dpa_lower_bound(ctx->sorted, &dummy);
+    }
+}
+
+/* one op is one element: append all in shuffled order, sort once, free */
+static void dparray_sorted_bulk_build(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    for (long done = 0; done < ops; done += ctx->size) {
+        dparray_t *array = dpa_create(sizeof(my_element_t), NULL, element_compare);
+        dpa_reserve(array, ctx->size);
+        for (int i = 0; i < ctx->size; i++) {
+            dpa_insert_at_index(array, dpa_get_element_at_index(ctx->dparray, (int) ((i * 7919L) % ctx->size)),
+                                ctx->size);
+        }
+        dpa_sort(array);
+        ctx->sink += dpa_size(array);
+        dpa_free(&array, false);
+    }
+}
+
+static void array_linear_scan(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        for (int j = 0; j < ctx->size; j++) {
+            if (element_compare(&ctx->array[j], &dummy) == 0) {
+                ctx->sink += j;
+                break;
+            }
+        }
+    }
+}
+
+static void array_bsearch(void *arg, long ops) {
+    dplist_ctx_t *ctx = (dplist_ctx_t *) arg;
+    my_element_t dummy;
+    for (long i = 0; i < ops; i++) {
+        dummy.sensor_id = ctx->keys[i % ctx->num_keys];
+        my_element_t *found = bsearch(&dummy, ctx->array, ctx->size, sizeof(my_element_t), compare_sensor_id);
+        ctx->sink += found - ctx->array;
+    }
+}
+
+/* one op is one element: insert 'ops' copies at the head, then free the list with its elements */
+static void build_teardown_heap(void *arg, long ops) {
+    my_element_t element = {.sensor_id = 1};
+    dplist_t *list = dpl_create(element_copy, element_free, element_compare);
+    for (long i = 0; i < ops; i++) dpl_insert_at_index(list, &element, 0, true);
+    dpl_free(&list, true);
+}
+
+static void build_teardown_arena(void *arg, long ops) {
+    my_element_t element = {.sensor_id = 1};
+    dplist_t *list = dpl_create_arena(element_copy, element_free, element_compare, sizeof(my_element_t));
+    for (long i = 0; i < ops; i++) dpl_insert_at_index(list, &element, 0, true);
+    dpl_free(&list, true);
+}
+
+/* the same list built and cleared over and over, so the arena blocks are already there */
+static void build_clear_arena(void *arg, long ops) {
+    dplist_t *list = (dplist_t *) arg;
+    my_element_t element = {.sensor_id = 1};
+    for (long i = 0; i < ops; i++) dpl_insert_at_index(list, &element, 0, true);
+    dpl_clear(list, true);
+}
+
+void bench_dplist(void) {
+    static const int sizes[] = {8, 64, 512, 4096};
+    char params[64];
+
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        dplist_ctx_t ctx = {.size = sizes[s], .num_keys = 1024};
+        long ops = 4000000 / ctx.size;
+
+        ctx.list = dpl_create(element_copy, element_free, element_compare);
+        ctx.dparray = dpa_create(sizeof(my_element_t), NULL, element_compare);
+        ctx.sorted = dpa_create(sizeof(my_element_t), NULL, element_compare);
+        ctx.array = calloc(ctx.size, sizeof(my_element_t));
+        ctx.keys = malloc(ctx.num_keys * sizeof(uint16_t));
+        for (int i = 0; i < ctx.size; i++) {
+            ctx.array[i].sensor_id = (uint16_t) (i * 3 + 1);
+            // insert at the head: appending walks the whole list every time
+            dpl_insert_at_index(ctx.list, &ctx.array[i], 0, true);
+            dpa_insert_at_index(ctx.dparray, &ctx.array[i], ctx.size);
+        }
+        // 7919 is prime, so this visits every index once in a scattered order
+        for (int i = 0; i < ctx.size; i++) {
+            dpa_insert_at_index(ctx.sorted, &ctx.array[(i * 7919L) % ctx.size], ctx.size);
+        }
+        dpa_sort(ctx.sorted);
+        for (int i = 0; i < ctx.num_keys; i++) ctx.keys[i] = ctx.array[bench_rand() % ctx.size].sensor_id;
+
+        snprintf(params, sizeof(params), "size=%d", ctx.size);
+        bench_run("dplist", "get_index_of_element", params, get_index_of_element, &ctx, ops, 10);
+        bench_run("dplist", "get_index_then_element", params, get_index_then_element, &ctx, ops, 10);
+        // one sample must cover the whole list, otherwise only the cheap first indexes are measured
+        bench_run("dplist", "element_at_index_loop", params, element_at_index_loop, &ctx,
+                  ops < ctx.size * 10 ? ctx.size * 10 : ops, 10);
+        bench_run("dplist", "dparray_get_index_then_element", params, dparray_get_index_of_element, &ctx, ops, 10);
+        bench_run("dplist", "dparray_element_at_index_loop", params, dparray_element_at_index_loop, &ctx,
+                  ops < ctx.size * 10 ? ctx.size * 10 : ops, 10);
+        bench_run("dplist", "dparray_iterator_scan", params, dparray_iterator_scan, &ctx,
+                  ops < ctx.size * 10 ? ctx.size * 10 : ops, 10);
+        bench_run("dplist", "dparray_sorted_get_index_then_element", params, dparray_sorted_get_index_then_element,
+                  &ctx, ops, 10);
+        bench_run("dplist", "dparray_sorted_lower_bound", params, dparray_sorted_lower_bound, &ctx, ops, 10);
+        bench_run("dplist", "dparray_sorted_bulk_build", params, dparray_sorted_bulk_build, &ctx,
+                  ops < ctx.size * 10 ? ctx.size * 10 : ops, 10);
+        bench_run("dplist", "array_linear_scan", params, array_linear_scan, &ctx, ops, 10);
+        bench_run("dplist", "array_bsearch", params, array_bsearch, &ctx, ops, 10);
+
+        if (ctx.sink == 42) printf("#\n");     // keep the results alive
+        dpl_free(&ctx.list, true);
+        dpa_free(&ctx.dparray, true);
+        dpa_free(&ctx.sorted, true);
+        free(ctx.array);
+        free(ctx.keys);
+    }
+
+    dplist_t *reused = dpl_create_arena(element_copy, element_free, element_compare, sizeof(my_element_t));
+    bench_run("dplist", "build_teardown_heap", "size=1000000", build_teardown_heap, NULL, 1000000, 5);
+    bench_run("dplist", "build_teardown_arena", "size=1000000", build_teardown_arena, NULL, 1000000, 5);
+    bench_run("dplist", "build_clear_arena", "size=1000000", build_clear_arena, reused, 1000000, 5);
+    dpl_free(&reused, true);
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "../config.h"
+
+static void write_log(void *arg, long ops) {
+    char *msg = (char *) arg;
+    for (long i = 0; i < ops; i++) write_to_log_process(msg);
+}
+
+void bench_log(void) {
+    char msg[] = "Data insertion from sensor 15 succeeded";
+
+    if (create_log_process() != 0) {
+        fprintf(stderr, "bench log: can't start the log process\n");
+        return;
+    }
+    // the pipe fills up after a few hundred messages, so this measures the sustained rate of the logger
+    bench_run("log", "write_to_log_process", "-", write_log, msg, 100000, 10);
+    end_log_process();
+    remove("gateway.log");
+}
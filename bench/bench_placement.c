@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "../sbuffer.h"
+#include "../placement.h"
+
+#define PRODUCERS 4
+#define BATCH_SIZE 64
+
+/* Where the threads of the pipeline run: an index into the CPUs this process may use, -1 = unpinned. The
+ * datamgr and storage roles are readers 0 and 1, the other readers stay unpinned like in the gateway. */
+typedef struct {
+    const char *name;
+    int io;
+    int datamgr;
+    int storage;
+    const char *io_node;        // or pin to NUMA nodes instead
+    const char *reader_node;
+} layout_t;
+
+static const layout_t layouts[] = {
+        {"unpinned", -1, -1, -1, NULL, NULL},
+        {"one-cpu", 0, 0, 0, NULL, NULL},
+        {"readers-apart", 0, 1, 1, NULL, NULL},     // producers on one CPU, datamgr and storage on another
+        {"all-apart", 0, 1, 2, NULL, NULL},
+        {"same-node", -1, -1, -1, "node0", "node0"},
+        {"cross-node", -1, -1, -1, "node0", "node1"},
+};
+
+typedef struct {
+    sbuffer_t *buffer;
+    long records;
+    int first_id;
+    int reader_id;
+} pipeline_thread_t;
+
+static void *producer_run(void *arg) {
+    pipeline_thread_t *t = (pipeline_thread_t *) arg;
+    sensor_record_t batch[BATCH_SIZE];
+    sbuffer_queue_t *queue = sbuffer_queue_open(t->buffer);
+
+    for (long i = 0; i < t->records;) {
+        int n = (t->records - i >= BATCH_SIZE) ? BATCH_SIZE : (int) (t->records - i);
+        for (int k = 0; k < n; k++, i++) {
+            sensor_data_t data = {.id = (sensor_id_t) (t->first_id + i % 8), .value = 20.0, .ts = (sensor_ts_t) i};
+            batch[k] = record_pack(&data);
+        }
+        if (queue != NULL) sbuffer_queue_insert_batch(queue, batch, n);
+        else sbuffer_insert_batch(t->buffer, batch, n);
+    }
+    sbuffer_queue_close(queue);
+    return NULL;
+}
+
+static void *reader_run(void *arg) {
+    pipeline_thread_t *t = (pipeline_thread_t *) arg;
+    sensor_record_t data;
+    while (sbuffer_remove(t->buffer, &data, t->reader_id) == SBUFFER_SUCCESS) t->records++;
+    return NULL;
+}
+
+/* the batched, queued sbuffer pipeline of the gateway, with its threads created the way the gateway does */
+static void run_placed(void *arg, long ops) {
+    pthread_t producers[PRODUCERS], readers[SBUFFER_NUM_READERS];
+    pipeline_thread_t p_args[PRODUCERS], r_args[SBUFFER_NUM_READERS];
+    sensor_record_t end_marker = {.id = 0};
+    sbuffer_t *buffer;
+    int i;
+
+    (void) arg;
+    if (sbuffer_init_queues(&buffer, PRODUCERS) != SBUFFER_SUCCESS) exit(EXIT_FAILURE);
+    for (i = 0; i < SBUFFER_NUM_READERS; i++) {
+        r_args[i] = (pipeline_thread_t) {.buffer = buffer, .reader_id = i};
+        if (i == READER_DATAMGR) placement_create(&readers[i], PLACEMENT_DATAMGR, reader_run, &r_args[i]);
+        else if (i == READER_STORAGEMGR) placement_create(&readers[i], PLACEMENT_STORAGE, reader_run, &r_args[i]);
+        else pthread_create(&readers[i], NULL, reader_run, &r_args[i]);
+    }
+    for (i = 0; i < PRODUCERS; i++) {
+        p_args[i] = (pipeline_thread_t) {.buffer = buffer, .first_id = 1 + 8 * i,
+                                         .records = ops / PRODUCERS + (i < ops % PRODUCERS)};
+        placement_create(&producers[i], PLACEMENT_IO, producer_run, &p_args[i]);
+    }
+    for (i = 0; i < PRODUCERS; i++) pthread_join(producers[i], NULL);
+    sbuffer_insert(buffer, &end_marker);
+    for (i = 0; i < SBUFFER_NUM_READERS; i++) {
+        pthread_join(readers[i], NULL);
+        if (r_args[i].records != ops) {
+            fprintf(stderr, "bench placement: reader %d saw %ld of %ld records\n", i, r_args[i].records, ops);
+            exit(EXIT_FAILURE);
+        }
+    }
+    sbuffer_free(&buffer);
+}
+
+static void *thread_noop(void *arg) {
+    return arg;
+}
+
+/* creating and joining a connection handler thread, with the stack of --stack-kb io=<kb> */
+static void spawn_join(void *arg, long ops) {
+    (void) arg;
+    for (long i = 0; i < ops; i++) {
+        pthread_t thread;
+        if (placement_create(&thread, PLACEMENT_IO, thread_noop, NULL) != 0) exit(EXIT_FAILURE);
+        pthread_join(thread, NULL);
+    }
+}
+
+static int pin(const char *role, int index, const int *cpus, const char *node) {
+    char spec[64];
+
+    if (node != NULL) snprintf(spec, sizeof(spec), "%s=%s", role, node);
+    else if (index >= 0) snprintf(spec, sizeof(spec), "%s=%d", role, cpus[index]);
+    else return 0;
+    return placement_pin(spec);
+}
+
+void bench_placement(void) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], num_cpus = 0;
+    char params[128];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) cpus[num_cpus++] = cpu;
+    }
+
+    for (unsigned l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        const layout_t *layout = &layouts[l];
+        int needed = 1 + ((layout->io > layout->datamgr) ? layout->io : layout->datamgr);
+        if (layout->storage + 1 > needed) needed = layout->storage + 1;
+
+        placement_reset();
+        if (needed > num_cpus ||
+            pin("io", layout->io, cpus, layout->io_node) != 0 ||
+            pin("datamgr", layout->datamgr, cpus, layout->reader_node) != 0 ||
+            pin("storage", layout->storage, cpus, layout->reader_node) != 0) {
+            fprintf(stderr, "bench placement: skipping %s, this machine doesn't have the CPUs or nodes\n",
+                    layout->name);
+            continue;
+        }
+        snprintf(params, sizeof(params), "layout=%s producers=%d cpus=%d", layout->name, PRODUCERS, num_cpus);
+        bench_run("placement", "pipeline_batch", params, run_placed, NULL, 400000, 6);
+    }
+
+    static const char *stacks[] = {"io=0", "io=256", "io=64"};   // 0: the system default, 8 MB mostly
+    for (unsigned s = 0; s < sizeof(stacks) / sizeof(stacks[0]); s++) {
+        placement_reset();
+        placement_stack(stacks[s]);
+        placement_describe(PLACEMENT_IO, params, sizeof(params));
+        bench_run("placement", "spawn_join", params, spawn_join, NULL, 2000, 6);
+    }
+    placement_reset();
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bench.h"
+#include "../sbuffer.h"
+#include "../dedup.h"
+#include "../validate.h"
+
+#define BATCH_SIZE 64
+
+typedef struct {
+    int producers;
+    int batched;
+    int queues;                 // every producer gets its own sbuffer queue
+} sbuffer_ctx_t;
+
+typedef struct {
+    sbuffer_t *buffer;
+    long records;
+    int batched;
+    int queued;
+    int reader_id;
+    int first_id;
+} sbuffer_thread_t;
+
+static void *producer_run(void *arg) {
+    sbuffer_thread_t *t = (sbuffer_thread_t *) arg;
+    sensor_record_t batch[BATCH_SIZE];
+    sbuffer_queue_t *queue = t->queued ? sbuffer_queue_open(t->buffer) : NULL;
+    long i = 0;
+
+    while (i < t->records) {
+        int n = (t->batched && t->records - i >= BATCH_SIZE) ? BATCH_SIZE : 1;
+        for (int k = 0; k < n; k++, i++) {
+            sensor_data_t data = {.id = (sensor_id_t) (t->first_id + i % 8), .value = 20.0, .ts = (sensor_ts_t) i};
+            batch[k] = record_pack(&data);
+        }
+        if (queue != NULL) sbuffer_queue_insert_batch(queue, batch, n);
+        else if (n == 1) sbuffer_insert(t->buffer, batch);
+        else sbuffer_insert_batch(t->buffer, batch, n);
+    }
+    sbuffer_queue_close(queue);
+    return NULL;
+}
+
+static void *reader_run(void *arg) {
+    sbuffer_thread_t *t = (sbuffer_thread_t *) arg;
+    sensor_record_t data;
+    while (sbuffer_remove(t->buffer, &data, t->reader_id) == SBUFFER_SUCCESS) t->records++;
+    return NULL;
+}
+
+/* one full pipeline run: 'ops' records from all producers, every record seen by every reader */
+static void run_pipeline(void *arg, long ops) {
+    sbuffer_ctx_t *ctx = (sbuffer_ctx_t *) arg;
+    pthread_t producers[64], readers[SBUFFER_NUM_READERS];
+    sbuffer_thread_t p_args[64], r_args[SBUFFER_NUM_READERS];
+    sensor_record_t end_marker = {.id = 0};
+    sbuffer_t *buffer;
+    int i;
+
+    if (sbuffer_init_queues(&buffer, ctx->queues ? ctx->producers : 0) != SBUFFER_SUCCESS) exit(EXIT_FAILURE);
+    for (i = 0; i < SBUFFER_NUM_READERS; i++) {
+        r_args[i] = (sbuffer_thread_t) {.buffer = buffer, .reader_id = i};
+        pthread_create(&readers[i], NULL, reader_run, &r_args[i]);
+    }
+    for (i = 0; i < ctx->producers; i++) {
+        p_args[i] = (sbuffer_thread_t) {.buffer = buffer, .batched = ctx->batched, .queued = ctx->queues,
+                                        .first_id = 1 + 8 * i,
+                                        .records = ops / ctx->producers + (i < ops % ctx->producers)};
+        pthread_create(&producers[i], NULL, producer_run, &p_args[i]);
+    }
+    for (i = 0; i < ctx->producers; i++) pthread_join(producers[i], NULL);
+    sbuffer_insert(buffer, &end_marker);
+    for (i = 0; i < SBUFFER_NUM_READERS; i++) {
+        pthread_join(readers[i], NULL);
+        if (r_args[i].records != ops) {
+            fprintf(stderr, "bench sbuffer: reader %d saw %ld of %ld records\n", i, r_args[i].records, ops);
+            exit(EXIT_FAILURE);
+        }
+    }
+    sbuffer_free(&buffer);
+}
+
+/* the check in front of every insert with --dedup: 1000 sensors reporting once a second, every 8th reading is
+ * one sent again a few seconds late, as after a reconnect */
+static void dedup_reading(void *arg, long ops) {
+    long *reading = (long *) arg;
+    sensor_record_t record = {.value = 150000};
+    for (long i = 0; i < ops; i++, (*reading)++) {
+        long n = (*reading % 8 == 7) ? *reading - 3000 : *reading;
+        record.id = (sensor_id_t) (n % 1000 + 1);
+        record.ts = 1766229929 + (uint32_t) (n / 1000);
+        record.value = 150000 + (int32_t) (n % 997);
+        dedup_filter(&record, 1);
+    }
+}
+
+#define VALIDATE_BENCH_BATCH 512     // INGEST_BATCH
+
+/* validate_batch() in tag mode over ingest-sized batches of 1000 sensors, one reading in 1024 out of range */
+static void validate_readings(void *arg, long ops) {
+    sensor_record_t *batch = (sensor_record_t *) arg;
+    for (long done = 0; done < ops; done += VALIDATE_BENCH_BATCH) {
+        validate_batch(batch, VALIDATE_BENCH_BATCH);
+    }
+}
+
+static void bench_validate(void) {
+    static const char *kernels[] = {"scalar", "sse2", "avx2"};
+    static const double steps[] = {0, VALIDATE_MAX_STEP};
+    sensor_record_t batch[VALIDATE_BENCH_BATCH];
+    uint32_t now = (uint32_t) (time(NULL) - RECORD_EPOCH_BASE);
+    char params[64];
+
+    for (int i = 0; i < VALIDATE_BENCH_BATCH; i++) {
+        batch[i] = (sensor_record_t) {.id = (sensor_id_t) (i % 1000 + 1), .ts = now - (uint32_t) (i % 60)};
+#if RECORD_VALUE_SCALE > 0
+        batch[i].value = (i % 1024 == 1023) ? INT32_MAX : (15 * RECORD_VALUE_SCALE + i % 997);
+#else
+        batch[i].value = (i % 1024 == 1023) ? 1e30f : 15 + (i % 997) / 1000.0f;
+#endif
+    }
+    for (unsigned s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        if (validate_init(VALIDATE_TAG, steps[s]) != 0) return;
+        for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (validate_use_kernel(kernels[k]) != 0) continue;
+            snprintf(params, sizeof(params), "kernel=%s max_step=%g batch=%d", kernels[k], steps[s],
+                     VALIDATE_BENCH_BATCH);
+            bench_run("sbuffer", "validate_batch", params, validate_readings, batch, 2000000, 10);
+        }
+        validate_free();
+    }
+}
+
+void bench_sbuffer(void) {
+    static const int producer_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    char params[64];
+
+    static const char *names[2][2] = {{"insert_remove", "insert_batch_remove"},
+                                      {"queue_insert_remove", "queue_insert_batch_remove"}};
+
+    for (int queues = 0; queues <= 1; queues++) {
+        for (int batched = 0; batched <= 1; batched++) {
+            for (unsigned i = 0; i < sizeof(producer_counts) / sizeof(producer_counts[0]); i++) {
+                sbuffer_ctx_t ctx = {.producers = producer_counts[i], .batched = batched, .queues = queues};
+                snprintf(params, sizeof(params), "producers=%d readers=%d", ctx.producers, SBUFFER_NUM_READERS);
+                bench_run("sbuffer", names[queues][batched], params, run_pipeline, &ctx, 200000, 6);
+            }
+        }
+    }
+
+    long reading = 0;
+    if (dedup_init() == 0) {
+        bench_run("sbuffer", "dedup_check", "sensors=1000 resent=1/8", dedup_reading, &reading, 2000000, 10);
+        dedup_free();
+    }
+    bench_validate();
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../sensor_db.h"
+#include "../journal.h"
+#include "../store.h"
+
+#define CSV_FILE "data.csv"
+#define JOURNAL_DIR "journal"
+#define STORE_DIR "store"
+
+typedef struct {
+    FILE *fp;
+    char line[STORAGE_CSV_LINE_SIZE];
+    long sink;
+} storage_ctx_t;
+
+static sensor_record_t record(long i) {
+    sensor_data_t data = {.id = (sensor_id_t) (i % 1000 + 1), .value = 15.0 + (i % 997) / 100.0,
+                          .ts = 1766229929 + i};
+    return record_pack(&data);
+}
+
+static void format_csv(void *arg, long ops) {
+    storage_ctx_t *ctx = (storage_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        sensor_record_t data = record(i);
+        ctx->sink += storage_format_csv(ctx->line, sizeof(ctx->line), &data);
+    }
+}
+
+/* what storage_mgr_run does per record: format, write and flush */
+static void write_flush(void *arg, long ops) {
+    storage_ctx_t *ctx = (storage_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        sensor_record_t data = record(i);
+        storage_format_csv(ctx->line, sizeof(ctx->line), &data);
+        fputs(ctx->line, ctx->fp);
+        fflush(ctx->fp);
+    }
+}
+
+static void write_buffered(void *arg, long ops) {
+    storage_ctx_t *ctx = (storage_ctx_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        sensor_record_t data = record(i);
+        storage_format_csv(ctx->line, sizeof(ctx->line), &data);
+        fputs(ctx->line, ctx->fp);
+    }
+    fflush(ctx->fp);
+}
+
+/* one op is one record through the journal: appended in batches of 'batch' (the connmgr appends 1, ingest
+ * INGEST_BATCH), then released by the storage side, which retires the segments as they fill up */
+static void journal_append_release(void *arg, long ops, int batch) {
+    sensor_record_t records[64];
+    for (long i = 0; i < ops; i += batch) {
+        for (int j = 0; j < batch; j++) records[j] = record(i + j);
+        journal_append(records, batch);
+        for (int j = 0; j < batch; j++) {
+            if (journal_release(&records[j])) journal_retire();
+        }
+    }
+}
+
+static void journal_append_1(void *arg, long ops) {
+    journal_append_release(arg, ops, 1);
+}
+
+static void journal_append_64(void *arg, long ops) {
+    journal_append_release(arg, ops, 64);
+}
+
+/* what storage_mgr_run does per record with --storage-dir: buffer it with its sensor, blocks are written as
+ * sensors fill them (1000 sensors, so one block of STORE_BLOCK_RECORDS every STORE_BLOCK_RECORDS records) */
+static void store_append_record(void *arg, long ops) {
+    store_t *store = (store_t *) arg;
+    for (long i = 0; i < ops; i++) {
+        sensor_record_t data = record(i);
+        store_append(store, &data);
+    }
+}
+
+static void remove_store(void) {
+    char path[64];
+    for (unsigned seq = 0;; seq++) {
+        snprintf(path, sizeof(path), STORE_DIR "/segment-%08u.dat", seq);
+        if (remove(path) != 0) break;
+        snprintf(path, sizeof(path), STORE_DIR "/segment-%08u.idx", seq);
+        remove(path);
+    }
+    rmdir(STORE_DIR);
+}
+
+void bench_storage(void) {
+    store_t *store;
+    storage_ctx_t ctx = {0};
+
+    bench_run("storage", "format_csv", "-", format_csv, &ctx, 1000000, 10);
+
+    ctx.fp = fopen(CSV_FILE, "w");
+    if (ctx.fp == NULL) {
+        perror("bench storage: " CSV_FILE);
+        return;
+    }
+    bench_run("storage", "write_flush_per_record", "-", write_flush, &ctx, 100000, 10);
+    rewind(ctx.fp);
+    bench_run("storage", "write_buffered", "-", write_buffered, &ctx, 1000000, 10);
+    fclose(ctx.fp);
+    remove(CSV_FILE);
+
+    // the flusher syncs every 100 ms meanwhile, as in the gateway
+    if (journal_open(JOURNAL_DIR, JOURNAL_SYNC_INTERVAL) == 0) {
+        bench_run("storage", "journal_append_release", "batch=1", journal_append_1, &ctx, 1000000, 10);
+        bench_run("storage", "journal_append_release", "batch=64", journal_append_64, &ctx, 1000000, 10);
+        journal_close();
+        rmdir(JOURNAL_DIR);
+    } else {
+        perror("bench storage: " JOURNAL_DIR);
+    }
+    if ((store = store_open(STORE_DIR, STORE_SEGMENT_SIZE, 0)) != NULL) {
+        bench_run("storage", "store_append", "sensors=1000", store_append_record, store, 1000000, 10);
+        store_close(&store);
+        remove_store();
+    } else {
+        perror("bench storage: " STORE_DIR);
+    }
+    if (ctx.sink == 42) printf("#\n");
+}
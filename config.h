@@ -17,6 +17,12 @@ typedef struct {
     sensor_ts_t ts;
 } sensor_data_t;
 
+/* The log process writes every message as "<sequence number> <timestamp> <message>" to gateway.log */
+int create_log_process(void);
+int end_log_process(void);
 int write_to_log_process(char *msg);
 
+/* Returns the number of bytes written to the log process that it has not read yet, or 0 if unknown */
+int log_process_queue_depth(void);
+
 #endif /* _CONFIG_H_ */
@@ -6,84 +6,198 @@
 #include <sys/time.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "connmgr.h"
 #include "lib/tcpsock.h"
 #include "config.h"
+#include "record.h"
+#include "latency.h"
+#include "metrics.h"
+#include "journal.h"
+#include "forward.h"
+#include "dedup.h"
+#include "validate.h"
+#include "placement.h"
+#include "coro.h"
 
 #ifndef TIMEOUT
 #define TIMEOUT 5
 #endif
 
+#ifndef CONNMGR_RECEIVE_CHUNK
+#define CONNMGR_RECEIVE_CHUNK 64    // readings taken from the socket at most at once, validated as one batch
+#endif
+
+// one reading on the wire: <sensor_id><value><timestamp>, packed like sensor_node sends it
+#define WIRE_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
 typedef struct {
     tcpsock_t *socket;
     sbuffer_t *buffer;
 } thread_args_t;
 
+// in a coroutine the socket is non-blocking: EAGAIN waits for it without holding up the other coroutines
+static int wait_for_socket(tcpsock_t *client, int result, int events) {
+    int sd;
+    return result == TCP_SOCKOP_ERROR && (errno == EAGAIN || errno == EWOULDBLOCK) && coro_current() != NULL &&
+           tcp_get_sd(client, &sd) == TCP_NO_ERROR && coro_wait_fd(sd, events, TIMEOUT * 1000) == 1;
+}
+
+int connmgr_receive_all(tcpsock_t *client, void *buf, int size) {
+    int bytes, result;
+    for (char *p = buf; p < (char *) buf + size; p += bytes) {
+        bytes = (char *) buf + size - p;
+        result = tcp_receive(client, p, &bytes);
+        if (wait_for_socket(client, result, POLLIN)) {
+            bytes = 0;
+            continue;
+        }
+        if (result != TCP_NO_ERROR) return result;
+        if (bytes == 0) return TCP_CONNECTION_CLOSED;
+    }
+    return TCP_NO_ERROR;
+}
+
+// receives what the socket has, at least 'min' and at most 'max' bytes; '*received' gets the number
+static int receive_some(tcpsock_t *client, char *buf, int min, int max, int *received) {
+    int bytes, result;
+    for (*received = 0; *received < min; *received += bytes) {
+        bytes = max - *received;
+        result = tcp_receive(client, buf + *received, &bytes);
+        if (wait_for_socket(client, result, POLLIN)) {
+            bytes = 0;
+            continue;
+        }
+        if (result != TCP_NO_ERROR) return result;
+        if (bytes == 0) return TCP_CONNECTION_CLOSED;
+    }
+    return TCP_NO_ERROR;
+}
+
+int connmgr_send_all(tcpsock_t *client, void *buf, int size) {
+    int bytes, result;
+    for (char *p = buf; p < (char *) buf + size; p += bytes) {
+        bytes = (char *) buf + size - p;
+        result = tcp_send(client, p, &bytes);
+        if (wait_for_socket(client, result, POLLOUT)) {
+            bytes = 0;
+            continue;
+        }
+        if (result != TCP_NO_ERROR) return result;
+    }
+    return TCP_NO_ERROR;
+}
+
 void *client_handler(void *arg) {
     thread_args_t *args = (thread_args_t *)arg;
     tcpsock_t *client = args->socket;
     sbuffer_t *buffer = args->buffer;
     free(args);
+    // NULL if the gateway runs with the shared buffer only (or all queues are taken): insert in the shared list
+    sbuffer_queue_t *queue = sbuffer_queue_open(buffer);
 
-    int sd, result;
-    sensor_data_t data;
-    int bytes;
+    int sd, result, have = 0, received, count, kept;
+    char wire[CONNMGR_RECEIVE_CHUNK * WIRE_SIZE];
+    sensor_record_t records[CONNMGR_RECEIVE_CHUNK];
     char log_msg[256];
-    bool first_packet = true;
+    bool forwarder = false;
     sensor_id_t sensor_id = 0;
+    long duplicates = 0;
+
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
 
     if (tcp_get_sd(client, &sd) == TCP_NO_ERROR) {
         struct timeval tv;
         tv.tv_sec = TIMEOUT;
         tv.tv_usec = 0;
-        if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        if (coro_current() != NULL) {
+            // connmgr_receive_all() waits at most TIMEOUT for the socket then
+            fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+        } else if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
             perror("setsockopt failed");
         }
     }
 
-    while (1) {
-        bytes = sizeof(data.id);
-        result = tcp_receive(client, (void *)&data.id, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-
-        bytes = sizeof(data.value);
-        result = tcp_receive(client, (void *)&data.value, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-        bytes = sizeof(data.ts);
-        result = tcp_receive(client, (void *)&data.ts, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-        if (first_packet) {
-            sensor_id = data.id;
+    if (connmgr_receive_all(client, wire, sizeof(sensor_id_t)) == TCP_NO_ERROR) {
+        memcpy(&sensor_id, wire, sizeof(sensor_id_t));
+        if (sensor_id == 0) {
+            // no sensor node sends id 0: this is another gateway forwarding its readings (forward.h)
+            forwarder = true;
+            forward_receive(client, buffer, queue);
+        } else {
             snprintf(log_msg, sizeof(log_msg), "Sensor node %d has opened a new connection", sensor_id);
             write_to_log_process(log_msg);
-            first_packet = false;
+            have = sizeof(sensor_id_t);
         }
+    }
 
-        sbuffer_insert(buffer, &data);
+    // takes whatever readings arrived, up to a chunk, and checks and inserts them as one batch
+    while (sensor_id != 0) {
+        result = receive_some(client, wire + have, WIRE_SIZE - have, sizeof(wire) - have, &received);
+        if (result != TCP_NO_ERROR) break;
+        uint64_t receive_ns = latency_now();
+
+        have += received;
+        count = have / WIRE_SIZE;
+        for (int i = 0; i < count; i++) {
+            const char *p = wire + i * WIRE_SIZE;
+            sensor_data_t data;
+            memcpy(&data.id, p, sizeof(data.id));
+            memcpy(&data.value, p + sizeof(data.id), sizeof(data.value));
+            memcpy(&data.ts, p + sizeof(data.id) + sizeof(data.value), sizeof(data.ts));
+            records[i] = record_pack(&data);
+        }
+        // the start of the next reading, if it is split across two receives
+        have -= count * WIRE_SIZE;
+        memmove(wire, wire + count * WIRE_SIZE, have);
+
+        metrics_add(METRIC_RECORDS_RECEIVED, count);
+        metrics_add(METRIC_BYTES_RECEIVED, count * WIRE_SIZE);
+        kept = validate_batch(records, count);
+        count = dedup_filter(records, kept);
+        // sent again after a reconnect
+        duplicates += kept - count;
+        if (count == 0) continue;
+        journal_append(records, count);
+        if (queue != NULL) sbuffer_queue_insert_batch(queue, records, count);
+        else sbuffer_insert_batch(buffer, records, count);
+        latency_record(LATENCY_RECEIVE_TO_ENQUEUE, receive_ns);
     }
 
-    if (sensor_id != 0) {
+    if (forwarder) {
+        // forward_receive() has logged the connection
+    } else if (sensor_id != 0 && duplicates > 0) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %d has closed the connection, %ld duplicate readings dropped",
+                 sensor_id, duplicates);
+        write_to_log_process(log_msg);
+    } else if (sensor_id != 0) {
         snprintf(log_msg, sizeof(log_msg), "Sensor node %d has closed the connection", sensor_id);
         write_to_log_process(log_msg);
     } else {
         write_to_log_process("A sensor node closed connection before sending data");
     }
 
+    sbuffer_queue_close(queue);
     tcp_close(&client);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
     return NULL;
 }
 
-void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer) {
+void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer, int coro_threads) {
     tcpsock_t *server_socket, *client_socket;
-    pthread_t *threads = malloc(sizeof(pthread_t) * max_connections);
+    pthread_t *threads = NULL;
     int conn_counter = 0;
+    int coroutines = 0, result;
 
+    if (coro_threads > 0) {
+        coroutines = (coro_executor_start(coro_threads) == 0);
+        if (!coroutines) write_to_log_process("Error: Failed to start the coroutines, using a thread per connection");
+    }
+    if (!coroutines) threads = malloc(sizeof(pthread_t) * max_connections);
     if (tcp_passive_open(&server_socket, port_number) != TCP_NO_ERROR) {
         write_to_log_process("Error: Failed to open server socket");
+        if (coroutines) coro_executor_stop();
         free(threads);
         return;
     }
@@ -100,7 +214,9 @@ void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer) {
             args->socket = client_socket;
             args->buffer = buffer;
 
-            if (pthread_create(&threads[conn_counter], NULL, client_handler, args) != 0) {
+            if (coroutines) result = coro_spawn(client_handler, args);
+            else result = placement_create(&threads[conn_counter], PLACEMENT_IO, client_handler, args);
+            if (result != 0) {
                 write_to_log_process("Error: Failed to create thread");
                 free(args);
                 tcp_close(&client_socket);
@@ -114,7 +230,8 @@ void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer) {
 
     tcp_close(&server_socket);
 
-    for (int i = 0; i < conn_counter; i++) {
+    if (coroutines) coro_executor_stop();
+    for (int i = 0; threads != NULL && i < conn_counter; i++) {
         pthread_join(threads[i], NULL);
     }
 
@@ -2,8 +2,18 @@
 #define _CONNMGR_H_
 
 #include "sbuffer.h"
+#include "lib/tcpsock.h"
 
-void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer);
+/* Accepts 'max_connections' connections and returns when all of them are closed. Each connection gets a
+ * thread, or with 'coro_threads' > 0 a coroutine on that many executor threads (coro.h). */
+void connmgr_listen(int port_number, int max_connections, sbuffer_t *buffer, int coro_threads);
+
+/* Receives exactly 'size' bytes: nodes send whole batches, so a field may arrive split over two recv() calls.
+ * Returns TCP_NO_ERROR when all bytes arrived, the tcp_receive() error otherwise. */
+int connmgr_receive_all(tcpsock_t *client, void *buf, int size);
+
+/* Sends all 'size' bytes, the counterpart of connmgr_receive_all(). */
+int connmgr_send_all(tcpsock_t *client, void *buf, int size);
 
 void connmgr_free();
 
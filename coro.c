@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+#include "placement.h"
+#include "latency.h"
+
+#define MAX_EVENTS 64
+
+#if defined(__x86_64__) && !defined(CORO_UCONTEXT)
+
+/* Only the callee-saved registers are live across a call, so switching pushes those on the old stack, swaps the
+ * stack pointer and pops them from the new one. The SysV ABI also has the control bits of MXCSR and the x87
+ * control word (rounding, exception masks) preserved across calls: they go in one more slot below the registers.
+ * swapcontext() also saves the signal mask, a system call. */
+typedef struct {
+    void *sp;
+} context_t;
+
+void coro_switch_stack(void **save_sp, void *sp) __attribute__((visibility("hidden")));
+
+__asm__(".text\n"
+        ".globl coro_switch_stack\n"
+        ".hidden coro_switch_stack\n"
+        ".type coro_switch_stack, @function\n"
+        "coro_switch_stack:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch_stack, .-coro_switch_stack\n");
+
+static void context_switch(context_t *from, context_t *to) {
+    coro_switch_stack(&from->sp, to->sp);
+}
+
+// lays out the stack as if 'entry' had been called and then switched away from before its first instruction
+static void context_make(context_t *context, char *stack, size_t size, void (*entry)(void)) {
+    uintptr_t *top = (uintptr_t *) ((uintptr_t) (stack + size) & ~(uintptr_t) 15);
+
+    *--top = 0;                             // return address of 'entry', which never returns
+    *--top = (uintptr_t) entry;             // popped by the ret of the first switch
+    for (int i = 0; i < 6; i++) *--top = 0; // rbp, rbx, r12-r15
+    *--top = (uintptr_t) 0x037f << 32 | 0x1f80;   // the x87 control word and MXCSR a new thread starts with
+    context->sp = top;
+}
+
+#else
+
+typedef ucontext_t context_t;
+
+static void context_switch(context_t *from, context_t *to) {
+    swapcontext(from, to);
+}
+
+static void context_make(context_t *context, char *stack, size_t size, void (*entry)(void)) {
+    getcontext(context);
+    context->uc_stack.ss_sp = stack;
+    context->uc_stack.ss_size = size;
+    context->uc_link = NULL;
+    makecontext(context, entry, 0);
+}
+
+#endif
+
+typedef struct worker worker_t;
+
+typedef struct coro {
+    context_t context;
+    void *(*start)(void *);
+    void *arg;
+    char *stack;                // CORO_STACK bytes above a guard page
+    size_t mapped;
+    worker_t *worker;
+    struct coro *next;          // in the incoming or the ready list
+    struct coro *timed_prev;    // in the list of coroutines waiting with a timeout
+    struct coro *timed_next;
+    uint64_t deadline;          // latency_now() at which the wait or the sleep ends, 0 = not in the list
+    int fd;                     // fd registered with the worker's epoll set for this coroutine, -1 = none
+    int waiting;                // EPOLL* events coro_wait_fd() waits for on 'fd', 0 = not waiting
+    int ready;                  // what coro_wait_fd() returns
+    int done;
+} coro_t;
+
+struct worker {
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;               // wakes the worker for new coroutines and to stop
+    context_t scheduler;
+    pthread_mutex_t lock;       // protects 'incoming' and 'stopping'
+    coro_t *incoming;           // spawned, not started yet, newest first
+    int stopping;
+    coro_t *ready_head;         // the rest is only touched by the worker thread itself
+    coro_t *ready_tail;
+    coro_t *timed;
+    uint64_t next_check;        // latency_now() at which 'timed' is checked next
+    coro_t **owners;            // by fd: the coroutine it is registered for, NULL = none
+    int num_owners;
+    long alive;
+};
+
+static worker_t *workers = NULL;
+static int num_workers = 0;
+static atomic_uint next_worker = 0;
+static _Thread_local coro_t *current = NULL;
+
+static void push_ready(worker_t *w, coro_t *c) {
+    c->next = NULL;
+    if (w->ready_tail != NULL) w->ready_tail->next = c;
+    else w->ready_head = c;
+    w->ready_tail = c;
+}
+
+static void link_timed(worker_t *w, coro_t *c, uint64_t timeout_ns) {
+    c->deadline = latency_now() + timeout_ns;
+    if (c->deadline < w->next_check) w->next_check = c->deadline;
+    c->timed_prev = NULL;
+    c->timed_next = w->timed;
+    if (w->timed != NULL) w->timed->timed_prev = c;
+    w->timed = c;
+}
+
+static void unlink_timed(worker_t *w, coro_t *c) {
+    if (c->deadline == 0) return;
+    if (c->timed_prev != NULL) c->timed_prev->timed_next = c->timed_next;
+    else w->timed = c->timed_next;
+    if (c->timed_next != NULL) c->timed_next->timed_prev = c->timed_prev;
+    c->deadline = 0;
+}
+
+/* Drops the registration of the coroutine's fd. If that fd was closed, the kernel already removed it from the
+ * set and its number may be in use again: then either another coroutine of this worker owns it now, or it isn't
+ * in the set and the delete fails harmlessly. */
+static void unregister_fd(worker_t *w, coro_t *c) {
+    if (c->fd < 0) return;
+    if (w->owners[c->fd] == c) {
+        w->owners[c->fd] = NULL;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    c->fd = -1;
+}
+
+/* Registers 'fd' edge-triggered for every event, once: later waits on it need no system call. An edge that
+ * comes while the coroutine isn't waiting is dropped, which is safe because it only waits after a call that
+ * found the fd not ready, and the next change of that state is a new edge. */
+static int register_fd(worker_t *w, coro_t *c, int fd) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.u64 = (uint64_t) fd + 1};
+
+    if (fd >= w->num_owners) {
+        int size = (w->num_owners > 0) ? w->num_owners : 64;
+        coro_t **owners;
+        while (size <= fd) size *= 2;
+        owners = realloc(w->owners, size * sizeof(coro_t *));
+        if (owners == NULL) return -1;
+        memset(owners + w->num_owners, 0, (size - w->num_owners) * sizeof(coro_t *));
+        w->owners = owners;
+        w->num_owners = size;
+    }
+    unregister_fd(w, c);
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0 &&
+        (errno != EEXIST || epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0)) {
+        return -1;
+    }
+    w->owners[fd] = c;
+    c->fd = fd;
+    return 0;
+}
+
+// entered by the first switch to a coroutine, switches back to the worker for good when it returns
+static void trampoline(void) {
+    coro_t *c = current;
+    c->start(c->arg);
+    c->done = 1;
+    context_switch(&c->context, &c->worker->scheduler);
+}
+
+static void run(worker_t *w, coro_t *c) {
+    current = c;
+    context_switch(&w->scheduler, &c->context);
+    current = NULL;
+    if (c->done) {
+        unregister_fd(w, c);
+        munmap(c->stack - (c->mapped - CORO_STACK), c->mapped);
+        free(c);
+        w->alive--;
+    }
+}
+
+static void wake(worker_t *w, coro_t *c, int ready) {
+    unlink_timed(w, c);
+    c->waiting = 0;
+    c->ready = ready;
+    push_ready(w, c);
+}
+
+// wakes the coroutines whose deadline passed; the next check is at the earliest deadline left, a tick at most
+static void expire_timeouts(worker_t *w, uint64_t now) {
+    coro_t *c = w->timed, *next;
+
+    w->next_check = now + CORO_TICK * 1000000ULL;
+    for (; c != NULL; c = next) {
+        next = c->timed_next;
+        if (c->deadline <= now) wake(w, c, 0);
+        else if (c->deadline < w->next_check) w->next_check = c->deadline;
+    }
+}
+
+static void *worker_run(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t now, value;
+    coro_t *c, *round, *incoming, *reversed;
+    int stopping, n, fd, timeout;
+
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        incoming = w->incoming;
+        w->incoming = NULL;
+        stopping = w->stopping;
+        pthread_mutex_unlock(&w->lock);
+        for (reversed = NULL; incoming != NULL; incoming = c) {
+            c = incoming->next;
+            incoming->next = reversed;
+            reversed = incoming;
+        }
+        for (; reversed != NULL; reversed = c) {
+            c = reversed->next;
+            push_ready(w, reversed);
+            w->alive++;
+        }
+
+        // one round over what is ready now: a coroutine that yields comes back in the next one, after the poll
+        round = w->ready_head;
+        w->ready_head = w->ready_tail = NULL;
+        for (; round != NULL; round = c) {
+            c = round->next;
+            run(w, round);
+        }
+        if (stopping && w->alive == 0) break;
+
+        timeout = -1;
+        if (w->ready_head != NULL) {
+            timeout = 0;
+        } else if (w->timed != NULL) {
+            now = latency_now();
+            timeout = (w->next_check <= now) ? 0 : (int) ((w->next_check - now + 999999) / 1000000);
+        }
+        n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == 0) {
+                if (read(w->event_fd, &value, sizeof(value)) < 0) {
+                    // EAGAIN: another wakeup took it already
+                }
+                continue;
+            }
+            fd = (int) (events[i].data.u64 - 1);
+            c = w->owners[fd];
+            // errors and hangups end any wait, they are never reported as edges again
+            if (c != NULL && c->fd == fd && c->waiting != 0 &&
+                (events[i].events & (c->waiting | EPOLLERR | EPOLLHUP)) != 0) {
+                wake(w, c, 1);
+            }
+        }
+        if (w->timed != NULL && (now = latency_now()) >= w->next_check) expire_timeouts(w, now);
+    }
+    return NULL;
+}
+
+int coro_executor_start(int num_threads) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = 0};
+
+    workers = calloc(num_threads, sizeof(worker_t));
+    if (workers == NULL) return -1;
+    for (num_workers = 0; num_workers < num_threads; num_workers++) {
+        worker_t *w = &workers[num_workers];
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&w->lock, NULL);
+        if (w->epoll_fd < 0 || w->event_fd < 0 || epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev) != 0 ||
+            placement_create(&w->thread, PLACEMENT_IO, worker_run, w) != 0) {
+            if (w->epoll_fd >= 0) close(w->epoll_fd);
+            if (w->event_fd >= 0) close(w->event_fd);
+            pthread_mutex_destroy(&w->lock);
+            break;
+        }
+    }
+    if (num_workers == 0) {
+        free(workers);
+        workers = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int coro_spawn(void *(*start)(void *), void *arg) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t one = 1;
+    worker_t *w;
+    coro_t *c;
+    char *map;
+
+    if (workers == NULL || (c = calloc(1, sizeof(coro_t))) == NULL) return -1;
+    c->mapped = CORO_STACK + page;
+    map = mmap(NULL, c->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED) {
+        free(c);
+        return -1;
+    }
+    mprotect(map, page, PROT_NONE);     // an overflow faults instead of corrupting the next stack
+    c->stack = map + page;
+    c->start = start;
+    c->arg = arg;
+    c->fd = -1;
+    w = &workers[atomic_fetch_add(&next_worker, 1) % num_workers];
+    c->worker = w;
+    context_make(&c->context, c->stack, CORO_STACK, trampoline);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->stopping) {
+        pthread_mutex_unlock(&w->lock);
+        munmap(map, c->mapped);
+        free(c);
+        return -1;
+    }
+    c->next = w->incoming;
+    w->incoming = c;
+    pthread_mutex_unlock(&w->lock);
+    if (write(w->event_fd, &one, sizeof(one)) < 0) {
+        // EAGAIN: the counter is full, the worker is woken anyway
+    }
+    return 0;
+}
+
+void coro_executor_stop(void) {
+    uint64_t one = 1;
+
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stopping = 1;
+        pthread_mutex_unlock(&w->lock);
+        if (write(w->event_fd, &one, sizeof(one)) < 0) {
+            // idem
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        close(w->epoll_fd);
+        close(w->event_fd);
+        pthread_mutex_destroy(&w->lock);
+        free(w->owners);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+void *coro_current(void) {
+    return current;
+}
+
+int coro_wait_fd(int fd, int events, int timeout_ms) {
+    coro_t *c = current;
+    worker_t *w;
+
+    if (c == NULL) return -1;
+    w = c->worker;
+    if (c->fd != fd && register_fd(w, c, fd) != 0) return -1;
+    c->waiting = ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    if (c->waiting == 0) return -1;
+    if (timeout_ms >= 0) link_timed(w, c, (uint64_t) timeout_ms * 1000000ULL);
+
+    context_switch(&c->context, &w->scheduler);
+    return c->ready;
+}
+
+void coro_yield(void) {
+    coro_t *c = current;
+
+    if (c == NULL) return;
+    push_ready(c->worker, c);
+    context_switch(&c->context, &c->worker->scheduler);
+}
+
+void coro_sleep(long timeout_us) {
+    coro_t *c = current;
+
+    if (c == NULL) return;
+    link_timed(c->worker, c, (uint64_t) timeout_us * 1000ULL);
+    context_switch(&c->context, &c->worker->scheduler);
+}
@@ -0,0 +1,59 @@
+#ifndef _CORO_H_
+#define _CORO_H_
+
+#include <poll.h>
+
+/*
+ * A small executor of coroutines, so connection handlers can stay sequential code (read the id, read the
+ * value, ...) while thousands of connections share a few threads (--coro-threads).
+ * - Every coroutine has its own stack of CORO_STACK bytes (mmap'ed with a guard page, so only the pages it
+ *   touches take memory) and runs on one worker thread for its whole life, so thread-locals like errno and
+ *   the current coroutine stay valid. On x86-64 a switch only saves the callee-saved registers and the FPU
+ *   control words, elsewhere it is swapcontext() (ucontext.h, or build with -DCORO_UCONTEXT), which also saves
+ *   the signal mask.
+ * - Where a blocking call would wait for a socket, the coroutine calls coro_wait_fd(): the first wait on an fd
+ *   registers it edge-triggered with its worker's epoll set, then it switches back to the worker, which runs
+ *   the next ready coroutine and resumes this one when the fd is ready or its timeout expired (checked at the
+ *   earliest deadline, every CORO_TICK ms at least). A coroutine that closes its fd must not wait on a new one with the same
+ *   number, that one wouldn't be registered; a connection handler only ever waits on its own socket.
+ * - Scheduling is cooperative: a producer queue of the sbuffer that is full yields and then sleeps with
+ *   coro_sleep(), but a coroutine that blocks in any other call (the journal starting a segment, the log pipe)
+ *   blocks every coroutine of its worker until it returns.
+ * Code that may run either way checks coro_current(): outside the executor it keeps blocking as before.
+ */
+
+#ifndef CORO_STACK
+#define CORO_STACK (64 * 1024)      // bytes of stack per coroutine
+#endif
+
+#define CORO_TICK 100               // ms between two checks of the timeouts
+
+/** Starts 'num_threads' worker threads, created as I/O threads (placement.h)
+ * \return 0 on success, -1 if not a single worker could be started
+ */
+int coro_executor_start(int num_threads);
+
+/** Runs start(arg) as a coroutine on the next worker, round-robin; callable from any thread
+ * \return 0 on success, -1 if the executor isn't running or out of memory
+ */
+int coro_spawn(void *(*start)(void *), void *arg);
+
+/** Waits until every coroutine has returned, then stops the workers */
+void coro_executor_stop(void);
+
+/** \return an opaque handle of the coroutine running on this thread, NULL outside the executor */
+void *coro_current(void);
+
+/** From a coroutine: waits until 'fd' has one of 'events' (POLLIN, POLLOUT) or 'timeout_ms' passed (-1 = never)
+ * \return 1 if the fd is ready (or has an error or hangup), 0 on timeout, -1 if it can't be waited for
+ */
+int coro_wait_fd(int fd, int events, int timeout_ms);
+
+/** From a coroutine: lets the other ready coroutines of this worker run first */
+void coro_yield(void);
+
+/** From a coroutine: lets the other coroutines of this worker run for 'timeout_us' at least (the worker waits in
+ * whole ms), like nanosleep() for a thread */
+void coro_sleep(long timeout_us);
+
+#endif /* _CORO_H_ */
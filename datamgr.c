@@ -6,8 +6,11 @@
 #include <time.h>
 
 #include "datamgr.h"
-#include "lib/dplist.h"
+#include "lib/dparray.h"
 #include "config.h"
+#include "latency.h"
+#include "metrics.h"
+#include "state.h"
 
 #ifndef SET_MIN_TEMP
 #define SET_MIN_TEMP 10
@@ -17,21 +20,7 @@
 #define SET_MAX_TEMP 20
 #endif
 
-#ifndef RUN_AVG_LENGTH
-#define RUN_AVG_LENGTH 5
-#endif
-
-typedef struct {
-    uint16_t sensor_id;
-    uint16_t room_id;
-    double running_avg;
-    time_t last_modified;
-    double readings[RUN_AVG_LENGTH];
-    int read_index;
-    int count;
-} my_element_t;
-
-// --- Dplist Callback Functions ---
+// --- Dparray Callback Functions ---
 void *element_copy(void *element) {
     my_element_t *copy = malloc(sizeof(my_element_t));
     *copy = *(my_element_t *)element; // 浅拷贝即可，因为没有指针成员
@@ -64,56 +53,278 @@ void update_running_avg(my_element_t *sensor, double new_value) {
     sensor->running_avg = sum / sensor->count;
 }
 
+dparray_t *datamgr_load_map(const char *path) {
+    FILE *map_file = fopen(path, "r");
+    uint16_t room_id, sensor_id;
+
+    if (map_file == NULL) return NULL;
+    dparray_t *sensor_list = dpa_create(sizeof(my_element_t), NULL, element_compare);
+    while (fscanf(map_file, "%hu %hu", &room_id, &sensor_id) == 2) {
+        my_element_t new_sensor;
+        new_sensor.sensor_id = sensor_id;
+        new_sensor.room_id = room_id;
+        new_sensor.room_index = 0;
+        new_sensor.running_avg = 0;
+        new_sensor.last_modified = 0;
+        new_sensor.read_index = 0;
+        new_sensor.count = 0;
+        new_sensor.last_seen_ns = 0;
+        new_sensor.silent = 0;
+        new_sensor.tracked = 0;
+        // 插入列表
+        dpa_insert_at_index(sensor_list, &new_sensor, dpa_size(sensor_list)); // Insert copy
+    }
+    fclose(map_file);
+    // the map is in any order: sort once, from then on every lookup is a binary search
+    dpa_sort(sensor_list);
+    return sensor_list;
+}
+
+static int compare_room_id(const void *x, const void *y) {
+    return (int) *(const uint16_t *) x - (int) *(const uint16_t *) y;
+}
+
+room_element_t *datamgr_build_rooms(dparray_t *sensor_list, int *num_rooms) {
+    int num_sensors = dpa_size(sensor_list), n = 0;
+    uint16_t *ids = malloc((num_sensors > 0 ? num_sensors : 1) * sizeof(uint16_t));
+    room_element_t *rooms;
+
+    if (ids == NULL) return NULL;
+    for (int i = 0; i < num_sensors; i++) ids[i] = ((my_element_t *) dpa_get_element_at_index(sensor_list, i))->room_id;
+    qsort(ids, num_sensors, sizeof(uint16_t), compare_room_id);
+    for (int i = 0; i < num_sensors; i++) {
+        if (n == 0 || ids[n - 1] != ids[i]) ids[n++] = ids[i];
+    }
+
+    rooms = aligned_alloc(_Alignof(room_element_t), (n > 0 ? n : 1) * sizeof(room_element_t));
+    if (rooms == NULL) {
+        free(ids);
+        return NULL;
+    }
+    memset(rooms, 0, (n > 0 ? n : 1) * sizeof(room_element_t));
+    for (int r = 0; r < n; r++) rooms[r].room_id = ids[r];
+    for (int i = 0; i < num_sensors; i++) {
+        my_element_t *sensor = dpa_get_element_at_index(sensor_list, i);
+        uint16_t *id = bsearch(&sensor->room_id, ids, n, sizeof(uint16_t), compare_room_id);
+        sensor->room_index = (uint16_t) (id - ids);
+        rooms[sensor->room_index].num_sensors++;
+    }
+    free(ids);
+    *num_rooms = n;
+    return rooms;
+}
+
+void update_room_avg(room_element_t *room, my_element_t *sensor, double old_avg, int old_count, double value,
+                     time_t ts) {
+    // only sensors with a full window count, like for the per-sensor alerts
+    if (old_count >= RUN_AVG_LENGTH) {
+        room->avg_sum += sensor->running_avg - old_avg;
+    } else if (sensor->count >= RUN_AVG_LENGTH) {
+        room->avg_sum += sensor->running_avg;
+        room->ready++;
+    }
+    if (room->ready > 0) room->running_avg = room->avg_sum / room->ready;
+    if (room->readings == 0 || value < room->min) room->min = value;
+    if (room->readings == 0 || value > room->max) room->max = value;
+    room->readings++;
+    room->last_modified = ts;
+}
+
+// logs a room alert when the room crosses a limit, not for every reading while it stays there
+static void check_room_alert(room_element_t *room) {
+    char log_msg[256];
+    int8_t alert = 0;
+
+    if (room->ready == 0) return;
+    if (room->running_avg < SET_MIN_TEMP) alert = -1;
+    else if (room->running_avg > SET_MAX_TEMP) alert = 1;
+    if (alert == room->alert) return;
+    room->alert = alert;
+    if (alert == 0) {
+        snprintf(log_msg, sizeof(log_msg), "Room %d is back within limits (avg temp = %.2f over %d sensors)",
+                 room->room_id, room->running_avg, room->ready);
+    } else {
+        snprintf(log_msg, sizeof(log_msg), "Room %d reports it's too %s (avg temp = %.2f over %d sensors)",
+                 room->room_id, alert < 0 ? "cold" : "hot", room->running_avg, room->ready);
+    }
+    write_to_log_process(log_msg);
+}
+
+// --- Silence Tracker ---
+void silence_init(silence_tracker_t *tracker, uint64_t timeout_ns) {
+    tracker->entries = NULL;
+    tracker->size = 0;
+    tracker->capacity = 0;
+    tracker->timeout_ns = timeout_ns;
+}
+
+static void heap_sift_up(silence_tracker_t *tracker, int i) {
+    silence_entry_t entry = tracker->entries[i];
+    while (i > 0 && tracker->entries[(i - 1) / 2].deadline > entry.deadline) {
+        tracker->entries[i] = tracker->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    tracker->entries[i] = entry;
+}
+
+static void heap_sift_down(silence_tracker_t *tracker, int i) {
+    silence_entry_t entry = tracker->entries[i];
+    while (2 * i + 1 < tracker->size) {
+        int child = 2 * i + 1;
+        if (child + 1 < tracker->size && tracker->entries[child + 1].deadline < tracker->entries[child].deadline) {
+            child++;
+        }
+        if (entry.deadline <= tracker->entries[child].deadline) break;
+        tracker->entries[i] = tracker->entries[child];
+        i = child;
+    }
+    tracker->entries[i] = entry;
+}
+
+uint64_t silence_seen(silence_tracker_t *tracker, my_element_t *sensor, uint64_t now) {
+    uint64_t silent_for = 0;
+
+    if (sensor->silent) {
+        silent_for = now - sensor->last_seen_ns;
+        sensor->silent = 0;
+    }
+    sensor->last_seen_ns = now;
+    if (sensor->tracked) return silent_for;     // the common case: the heap entry is refreshed lazily
+
+    if (tracker->size == tracker->capacity) {
+        int capacity = tracker->capacity ? tracker->capacity * 2 : 64;
+        silence_entry_t *entries = realloc(tracker->entries, capacity * sizeof(silence_entry_t));
+        if (entries == NULL) return silent_for;
+        tracker->entries = entries;
+        tracker->capacity = capacity;
+    }
+    tracker->entries[tracker->size].deadline = now + tracker->timeout_ns;
+    tracker->entries[tracker->size].sensor = sensor;
+    heap_sift_up(tracker, tracker->size++);
+    sensor->tracked = 1;
+    return silent_for;
+}
+
+uint64_t silence_next_deadline(silence_tracker_t *tracker) {
+    return (tracker->size > 0) ? tracker->entries[0].deadline : 0;
+}
+
+my_element_t *silence_expired(silence_tracker_t *tracker, uint64_t now) {
+    while (tracker->size > 0 && tracker->entries[0].deadline <= now) {
+        my_element_t *sensor = tracker->entries[0].sensor;
+        uint64_t due = sensor->last_seen_ns + tracker->timeout_ns;
+
+        if (due > now) {
+            // it reported since the entry was keyed: move it to its real deadline
+            tracker->entries[0].deadline = due;
+            heap_sift_down(tracker, 0);
+            continue;
+        }
+        tracker->entries[0] = tracker->entries[--tracker->size];
+        if (tracker->size > 0) heap_sift_down(tracker, 0);
+        sensor->tracked = 0;
+        sensor->silent = 1;
+        return sensor;
+    }
+    return NULL;
+}
+
+void silence_free(silence_tracker_t *tracker) {
+    free(tracker->entries);
+    tracker->entries = NULL;
+    tracker->size = tracker->capacity = 0;
+}
+
+// makes the latest reading and average of 'sensor' visible to state_get() and the state socket
+static void publish_state(my_element_t *sensor, double value) {
+    state_sensor_t state = {.sensor_id = sensor->sensor_id, .room_id = sensor->room_id,
+                            .count = sensor->readings_total, .last_value = value, .last_ts = sensor->last_modified,
+                            .running_avg = sensor->running_avg, .avg_ready = sensor->count >= RUN_AVG_LENGTH,
+                            .silent = 0};
+    state_publish(&state);
+}
+
+static void publish_silent(my_element_t *sensor) {
+    state_sensor_t state;
+    if (!state_get(sensor->sensor_id, &state)) return;
+    state.silent = 1;
+    state_publish(&state);
+}
+
 // --- Main Thread Function ---
 void *datamgr_run(void *arg) {
     sbuffer_t *buffer = (sbuffer_t *)arg;
-    dplist_t *sensor_list = NULL;
-    FILE *map_file;
-    sensor_data_t data;
+    dparray_t *sensor_list = NULL;
+    room_element_t *rooms;
+    int num_rooms = 0;
+    silence_tracker_t silence;
+    my_element_t *silent;
+    uint64_t now;
+    sensor_record_t data;
     char log_msg[256];
     int result;
+    uint64_t enqueue_ns;
 
-    sensor_list = dpl_create(element_copy, element_free, element_compare);
-
-    map_file = fopen("room_sensor.map", "r");
-    if (map_file == NULL) {
+    sensor_list = datamgr_load_map("room_sensor.map");
+    if (sensor_list == NULL) {
         write_to_log_process("Error: Could not open room_sensor.map");
-    } else {
-        uint16_t room_id, sensor_id;
-        while (fscanf(map_file, "%hu %hu", &room_id, &sensor_id) == 2) {
-            my_element_t new_sensor;
-            new_sensor.sensor_id = sensor_id;
-            new_sensor.room_id = room_id;
-            new_sensor.running_avg = 0;
-            new_sensor.last_modified = 0;
-            new_sensor.read_index = 0;
-            new_sensor.count = 0;
-            // 插入列表
-            dpl_insert_at_index(sensor_list, &new_sensor, dpl_size(sensor_list), true); // Insert copy
-        }
-        fclose(map_file);
+        sensor_list = dpa_create(sizeof(my_element_t), NULL, element_compare);
     }
+    rooms = datamgr_build_rooms(sensor_list, &num_rooms);
+    silence_init(&silence, (uint64_t) SILENT_TIMEOUT * 1000000000ULL);
 
     while (1) {
-        result = sbuffer_remove(buffer, &data, READER_DATAMGR);
+        // wakes up without data as well when the next sensor may have gone silent
+        result = sbuffer_remove_timed(buffer, &data, READER_DATAMGR, &enqueue_ns, silence_next_deadline(&silence));
 
         if (result == SBUFFER_NO_DATA) {
             break;
         }
+        now = latency_now();
+        while ((silent = silence_expired(&silence, now)) != NULL) {
+            snprintf(log_msg, sizeof(log_msg), "Sensor node %d silent for %llu s", silent->sensor_id,
+                     (unsigned long long) ((now - silent->last_seen_ns) / 1000000000ULL));
+            write_to_log_process(log_msg);
+            metrics_add(METRIC_SENSORS_SILENT, 1);
+            publish_silent(silent);
+        }
+        if (result != SBUFFER_SUCCESS) continue;
+        if (data.flags & RECORD_FLAG_INVALID) {
+            // tagged by the validation (validate.h): stored, but kept out of the averages and the state
+            latency_record(LATENCY_ENQUEUE_TO_DATAMGR, enqueue_ns);
+            continue;
+        }
 
         my_element_t search_dummy;
         search_dummy.sensor_id = data.id;
-        int index = dpl_get_index_of_element(sensor_list, &search_dummy);
+        int index = dpa_get_index_of_element(sensor_list, &search_dummy);
 
         if (index == -1) {
             snprintf(log_msg, sizeof(log_msg), "Received sensor data with invalid sensor node ID %d", data.id);
             write_to_log_process(log_msg);
         } else {
-            my_element_t *sensor = (my_element_t *)dpl_get_element_at_index(sensor_list, index);
+            my_element_t *sensor = (my_element_t *)dpa_get_element_at_index(sensor_list, index);
+
+            double old_avg = sensor->running_avg;
+            int old_count = sensor->count;
 
-            sensor->last_modified = data.ts;
+            sensor->last_modified = record_ts(&data);
 
-            update_running_avg(sensor, data.value);
+            uint64_t silent_for = silence_seen(&silence, sensor, now);
+            if (silent_for > 0) {
+                snprintf(log_msg, sizeof(log_msg), "Sensor node %d reports again after %llu s of silence",
+                         sensor->sensor_id, (unsigned long long) (silent_for / 1000000000ULL));
+                write_to_log_process(log_msg);
+            }
+
+            update_running_avg(sensor, record_value(&data));
+            sensor->readings_total++;
+            publish_state(sensor, record_value(&data));
+            if (rooms != NULL) {
+                room_element_t *room = &rooms[sensor->room_index];
+                update_room_avg(room, sensor, old_avg, old_count, record_value(&data), sensor->last_modified);
+                check_room_alert(room);
+            }
 
             if (sensor->count >= RUN_AVG_LENGTH) {
                 if (sensor->running_avg < SET_MIN_TEMP) {
@@ -125,8 +336,11 @@ void *datamgr_run(void *arg) {
                 }
             }
         }
+        latency_record(LATENCY_ENQUEUE_TO_DATAMGR, enqueue_ns);
     }
-    dpl_free(&sensor_list, true);
+    dpa_free(&sensor_list, true);
+    free(rooms);
+    silence_free(&silence);
     return NULL;
 }
 
@@ -5,8 +5,103 @@
 #include <stdio.h>
 #include "config.h"
 #include "sbuffer.h"
+#include "lib/dparray.h"
+
+#ifndef RUN_AVG_LENGTH
+#define RUN_AVG_LENGTH 5
+#endif
+
+typedef struct {
+    uint16_t sensor_id;
+    uint16_t room_id;
+    uint16_t room_index;        // index of the room in the array of datamgr_build_rooms()
+    double running_avg;
+    time_t last_modified;
+    double readings[RUN_AVG_LENGTH];
+    int read_index;
+    int count;
+    uint32_t readings_total;    // readings since the gateway started, for the state table
+    uint64_t last_seen_ns;      // latency_now() of the last reading, for the silence tracker
+    int8_t silent;              // reported silent and not in the silence tracker until it reports again
+    int8_t tracked;             // in the silence tracker
+} my_element_t;
+
+/* Aggregate of all sensors of one room, updated with every reading of one of them.
+ * Rooms are kept in a dense array indexed by a compacted room id (my_element_t.room_index), one cache line each. */
+typedef struct {
+    _Alignas(64) uint16_t room_id;
+    uint16_t num_sensors;       // sensors of the room in room_sensor.map
+    uint16_t ready;             // sensors with a full running average window
+    int8_t alert;               // -1 too cold, 0 fine, 1 too hot; room alerts are only logged when this changes
+    double avg_sum;             // sum of the running averages of the 'ready' sensors
+    double running_avg;         // avg_sum / ready: the room average, valid if ready > 0
+    double min, max;            // lowest and highest reading of the room so far
+    time_t last_modified;
+    uint64_t readings;
+} room_element_t;
+
+#ifndef SILENT_TIMEOUT
+#define SILENT_TIMEOUT 30       // seconds without a reading before a sensor is reported silent
+#endif
+
+/* Finds sensors that stopped reporting (e.g. while their connection stays open) without scanning them all.
+ * A min-heap holds one entry per reporting sensor, keyed by the time it is due to be reported silent. A reading
+ * only stamps the sensor: its entry is refreshed lazily, when it reaches the top of the heap. So a reading costs
+ * O(1) and each sensor costs at most one O(log n) sift per timeout period. */
+typedef struct {
+    uint64_t deadline;          // latency_now() time at which the entry is checked
+    my_element_t *sensor;
+} silence_entry_t;
+
+typedef struct {
+    silence_entry_t *entries;
+    int size;
+    int capacity;
+    uint64_t timeout_ns;
+} silence_tracker_t;
 
 void *datamgr_run(void *buffer);
+
+/* Reads a room_sensor.map ("<room_id> <sensor_id>" per line) into a sorted dparray of my_element_t
+ * \return the array, or NULL if the file can't be opened */
+dparray_t *datamgr_load_map(const char *path);
+
+// dplist callbacks for my_element_t, elements are compared by sensor_id
+void *element_copy(void *element);
+void element_free(void **element);
+int element_compare(void *x, void *y);
+
+void update_running_avg(my_element_t *sensor, double new_value);
+
+/** Assigns every sensor of 'sensor_list' a compacted room index and creates the zeroed room array
+ * \param num_rooms set to the number of distinct rooms
+ * \return the rooms sorted by room_id, free() them when done; NULL if out of memory
+ */
+room_element_t *datamgr_build_rooms(dparray_t *sensor_list, int *num_rooms);
+
+/** Folds a new reading of 'sensor' into its room; call it right after update_running_avg()
+ * \param old_avg, old_count the running_avg and count of the sensor before update_running_avg()
+ */
+void update_room_avg(room_element_t *room, my_element_t *sensor, double old_avg, int old_count, double value,
+                     time_t ts);
+/** Initializes an empty tracker that reports sensors after 'timeout_ns' without a reading */
+void silence_init(silence_tracker_t *tracker, uint64_t timeout_ns);
+
+/** Records a reading of 'sensor' at 'now'; starts tracking it if it wasn't (again)
+ * \return how long the sensor had been silent in ns if it was reported silent before, 0 otherwise
+ */
+uint64_t silence_seen(silence_tracker_t *tracker, my_element_t *sensor, uint64_t now);
+
+/** Returns the time of the next check (0 if no sensor is tracked); nothing is due before then */
+uint64_t silence_next_deadline(silence_tracker_t *tracker);
+
+/** Takes the next sensor that has been silent for the timeout at 'now' out of the tracker and marks it silent
+ * \return the sensor, or NULL if none is due
+ */
+my_element_t *silence_expired(silence_tracker_t *tracker, uint64_t now);
+
+void silence_free(silence_tracker_t *tracker);
+
 void datamgr_free();
 
 #endif // DATAMGR_H
\ No newline at end of file
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "dedup.h"
+#include "metrics.h"
+
+_Static_assert(DEDUP_WINDOW <= 64, "the window is a 64-bit bitmap");
+
+typedef struct {
+    uint32_t ts;
+    uint32_t value;             // packed
+} dedup_key_t;
+
+typedef struct {
+    atomic_flag lock;
+    uint8_t next;               // slot of 'recent' the next accepted reading goes to
+    uint8_t count;              // slots of 'recent' in use
+    uint32_t ts;                // high-water mark
+    uint64_t seen;              // bit i: a reading of second ts - i was accepted; 0 if the sensor has no mark yet
+    dedup_key_t recent[DEDUP_HISTORY];     // ring of the last accepted readings
+} dedup_entry_t;
+
+static dedup_entry_t *table = NULL;
+
+int dedup_init(void) {
+    // a zeroed atomic_flag is clear
+    table = calloc(NUM_SENSOR_IDS, sizeof(dedup_entry_t));
+    return (table == NULL) ? -1 : 0;
+}
+
+static void remember(dedup_entry_t *entry, uint32_t ts, uint32_t value) {
+    entry->recent[entry->next] = (dedup_key_t) {.ts = ts, .value = value};
+    entry->next = (entry->next + 1) % DEDUP_HISTORY;
+    if (entry->count < DEDUP_HISTORY) entry->count++;
+}
+
+static int remembered(const dedup_entry_t *entry, uint32_t ts, uint32_t value) {
+    for (int i = 0; i < entry->count; i++) {
+        if (entry->recent[i].ts == ts && entry->recent[i].value == value) return 1;
+    }
+    return 0;
+}
+
+static int is_new(dedup_entry_t *entry, const sensor_record_t *record) {
+    uint32_t value, age;
+
+    memcpy(&value, &record->value, sizeof(value));
+    if (entry->seen == 0 || record->ts > entry->ts) {
+        age = record->ts - entry->ts;
+        entry->seen = (entry->seen == 0 || age >= DEDUP_WINDOW) ? 1 : (entry->seen << age) | 1;
+        entry->ts = record->ts;
+        remember(entry, record->ts, value);
+        return 1;
+    }
+    age = entry->ts - record->ts;
+    if (age >= DEDUP_WINDOW) return 1;
+    // only a second that already has a reading needs the exact comparison
+    if ((entry->seen & (1ull << age)) && remembered(entry, record->ts, value)) return 0;
+    entry->seen |= 1ull << age;
+    remember(entry, record->ts, value);
+    return 1;
+}
+
+static int check(const sensor_record_t *record) {
+    dedup_entry_t *entry = &table[record->id];
+    int result;
+
+    while (atomic_flag_test_and_set_explicit(&entry->lock, memory_order_acquire)) sched_yield();
+    result = is_new(entry, record);
+    atomic_flag_clear_explicit(&entry->lock, memory_order_release);
+    return result;
+}
+
+int dedup_check(const sensor_record_t *record) {
+    if (table == NULL || check(record)) return 1;
+    metrics_add(METRIC_RECORDS_DUPLICATE, 1);
+    return 0;
+}
+
+int dedup_filter(sensor_record_t *records, int count) {
+    int kept = 0;
+
+    if (table == NULL) return count;
+    for (int i = 0; i < count; i++) {
+        if (check(&records[i])) records[kept++] = records[i];
+    }
+    if (kept < count) metrics_add(METRIC_RECORDS_DUPLICATE, count - kept);
+    return kept;
+}
+
+void dedup_free(void) {
+    free(table);
+    table = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "record.h"
+
+/*
+ * Optional duplicate suppression at the receiving edge (--dedup), so readings a sensor sends again after a
+ * reconnect, or a forwarder after a broken link, reach the sbuffer only once.
+ * - Every sensor keeps a high-water mark: the newest timestamp accepted, a bitmap of the DEDUP_WINDOW seconds
+ *   up to it with a bit for every second a reading was accepted in, and the timestamp and value of its last
+ *   DEDUP_HISTORY accepted readings.
+ * - A reading newer than the mark is new and moves the mark. A reading in a second without a bit fills a gap
+ *   and is accepted without looking further. In a marked second it is a duplicate only if the same timestamp
+ *   and value are among the remembered readings, so a sensor sending several readings per second keeps a late
+ *   one. Readings older than the window, or whose second is older than what is remembered, can't be checked
+ *   and are accepted. Values are compared in their packed form (record.h).
+ * - Each check takes the entry's spinlock: a sensor normally has one connection, so it is never contended.
+ * Without dedup_init() every reading is accepted.
+ */
+
+#define DEDUP_WINDOW 64     // seconds up to the high-water mark that are checked, one bit each
+#define DEDUP_HISTORY 32    // readings per sensor whose timestamp and value are remembered
+
+/** Allocates the per-sensor table; from then on dedup_check() and dedup_filter() drop duplicates
+ * \return 0 on success, -1 if out of memory
+ */
+int dedup_init(void);
+
+/** Checks one reading and remembers it if it is new
+ * \return 1 if it is new, 0 if it is a duplicate; duplicates are counted in METRIC_RECORDS_DUPLICATE
+ */
+int dedup_check(const sensor_record_t *record);
+
+/** Removes the duplicates from 'records', keeping the order of the others
+ * \return the number of records left
+ */
+int dedup_filter(sensor_record_t *records, int count);
+
+/** Frees the table, after which every reading is accepted again */
+void dedup_free(void);
+
+#endif /* _DEDUP_H_ */
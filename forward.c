@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "forward.h"
+#include "connmgr.h"
+#include "record.h"
+#include "latency.h"
+#include "metrics.h"
+#include "journal.h"
+#include "dedup.h"
+#include "validate.h"
+
+#define MAX_FRAME_LENGTH (FORWARD_BATCH * (3 + 5 + 5))  // varints: id delta <= 16 bits, zigzag'ed deltas <= 33 bits
+#define MAX_FRAME_SIZE (sizeof(forward_header_t) + MAX_FRAME_LENGTH)
+#define IO_TIMEOUT 1                // s a send or an acknowledgement may take before the link counts as broken
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+
+_Static_assert(sizeof(forward_header_t) == 24, "forward_header_t is sent as is");
+
+typedef struct {
+    char *data;                 // copy of a frame sent directly, NULL if it came from the spool or is a heartbeat
+    uint32_t size;              // header included, 0 for a heartbeat
+    uint32_t count;
+} inflight_t;
+
+typedef struct {
+    char host[64];
+    int port;
+    pthread_t connector;
+    _Atomic(tcpsock_t *) link;  // set by the connector, cleared by the forward thread when the link breaks
+    tcpsock_t *socket;          // the link the forward thread uses, NULL while disconnected
+    int sd;
+    uint32_t frames_sent, frames_acked;    // on the current link
+    char ack[sizeof(uint32_t)];
+    int ack_len;
+    uint64_t last_send_ns;
+    uint64_t last_ack_ns;       // last acknowledgement, or when a frame went out with none outstanding
+
+    inflight_t inflight[FORWARD_WINDOW];   // oldest first
+    int inflight_head, inflight_count;
+
+    int spool_fd;
+    char spool_path[PATH_MAX];
+    off_t spool_end;            // frames [spool_acked, spool_end) wait for the upstream
+    off_t spool_sent;           // frames before this were sent on the current link
+    off_t spool_acked;
+
+    int count;
+    sensor_record_t batch[FORWARD_BATCH];
+    sensor_record_t sorted[FORWARD_BATCH];
+    char frame[MAX_FRAME_SIZE];
+} forwarder_t;
+
+static inline int64_t value_bits(const sensor_record_t *record) {
+#if RECORD_VALUE_SCALE > 0
+    return record->value;
+#else
+    int32_t bits;
+    memcpy(&bits, &record->value, sizeof(bits));
+    return bits;
+#endif
+}
+
+static inline void set_value_bits(sensor_record_t *record, int64_t bits) {
+#if RECORD_VALUE_SCALE > 0
+    record->value = (int32_t) bits;
+#else
+    int32_t value = (int32_t) bits;
+    memcpy(&record->value, &value, sizeof(value));
+#endif
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline char *put_varint(char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    return p;
+}
+
+// NULL if the varint runs past 'end'
+static inline const char *get_varint(const char *p, const char *end, uint64_t *v) {
+    uint64_t result = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = (uint8_t) *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// stable LSD radix sort of the batch by sensor id, two passes of one byte; the readings of a sensor keep their order
+static void sort_batch(forwarder_t *fw) {
+    sensor_record_t *from = fw->batch, *to = fw->sorted, *swap;
+
+    for (int shift = 0; shift < 16; shift += 8) {
+        int offsets[256] = {0};
+        for (int i = 0; i < fw->count; i++) offsets[(from[i].id >> shift) & 0xff]++;
+        for (int b = 0, sum = 0; b < 256; b++) {
+            int n = offsets[b];
+            offsets[b] = sum;
+            sum += n;
+        }
+        for (int i = 0; i < fw->count; i++) to[offsets[(from[i].id >> shift) & 0xff]++] = from[i];
+        swap = from;
+        from = to;
+        to = swap;
+    }
+}
+
+// encodes the batch into fw->frame and empties it; returns the frame size
+static uint32_t encode_frame(forwarder_t *fw) {
+    forward_header_t header = {.marker = 0, .magic = {'F', 'W'}, .count = fw->count,
+                               .value_scale = RECORD_VALUE_SCALE, .epoch_base = RECORD_EPOCH_BASE};
+    char *p = fw->frame + sizeof(header);
+    int64_t ts = 0, value = 0;
+    sensor_id_t id = 0;
+
+    sort_batch(fw);
+    for (int i = 0; i < fw->count; i++) {
+        sensor_record_t *record = &fw->batch[i];
+        p = put_varint(p, record->id - id);
+        p = put_varint(p, zigzag((int64_t) record->ts - ts));
+        p = put_varint(p, zigzag(value_bits(record) - value));
+        id = record->id;
+        ts = record->ts;
+        value = value_bits(record);
+    }
+    header.length = p - (fw->frame + sizeof(header));
+    memcpy(fw->frame, &header, sizeof(header));
+    fw->count = 0;
+    return sizeof(header) + header.length;
+}
+
+static int decode_frame(const char *p, uint32_t length, sensor_record_t *records, uint32_t count) {
+    const char *end = p + length;
+    uint64_t id_delta, ts_delta, value_delta;
+    int64_t id = 0, ts = 0, value = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if ((p = get_varint(p, end, &id_delta)) == NULL || (p = get_varint(p, end, &ts_delta)) == NULL ||
+            (p = get_varint(p, end, &value_delta)) == NULL) return -1;
+        id += id_delta;
+        ts += unzigzag(ts_delta);
+        value += unzigzag(value_delta);
+        if (id > UINT16_MAX || ts < 0 || ts > UINT32_MAX || value < INT32_MIN || value > INT32_MAX) return -1;
+        records[i] = (sensor_record_t) {.id = (sensor_id_t) id, .flags = 0, .ts = (uint32_t) ts};
+        set_value_bits(&records[i], value);
+    }
+    return (p == end) ? 0 : -1;
+}
+
+static int valid_header(const forward_header_t *header) {
+    return header->marker == 0 && memcmp(header->magic, "FW", 2) == 0 && header->count <= FORWARD_BATCH &&
+           header->length <= MAX_FRAME_LENGTH;
+}
+
+/* ---------------------------------------------------------------- sending side */
+
+static void *connect_run(void *arg) {
+    forwarder_t *fw = (forwarder_t *) arg;
+    struct timespec retry = {.tv_sec = FORWARD_RETRY_INTERVAL / 1000,
+                             .tv_nsec = (FORWARD_RETRY_INTERVAL % 1000) * NSEC_PER_MSEC};
+    tcpsock_t *socket;
+
+    while (1) {     // until forward_run cancels it
+        if (atomic_load(&fw->link) == NULL && tcp_active_open(&socket, fw->port, fw->host) == TCP_NO_ERROR) {
+            atomic_store(&fw->link, socket);
+        }
+        nanosleep(&retry, NULL);
+    }
+    return NULL;
+}
+
+static int send_all(forwarder_t *fw, char *data, uint32_t size) {
+    for (uint32_t sent = 0; sent < size;) {
+        int bytes = size - sent;
+        if (tcp_send(fw->socket, data + sent, &bytes) != TCP_NO_ERROR || bytes <= 0) return -1;
+        sent += bytes;
+    }
+    metrics_add(METRIC_FORWARD_BYTES, size);
+    fw->last_send_ns = latency_now();
+    return 0;
+}
+
+static int spool_write(forwarder_t *fw, const char *data, uint32_t size, uint32_t count) {
+    for (uint32_t written = 0; written < size;) {
+        ssize_t bytes = write(fw->spool_fd, data + written, size - written);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            // the frame is lost, a partial one is cut off again so the spool stays readable
+            if (written > 0 && ftruncate(fw->spool_fd, fw->spool_end) != 0) perror("spool_write");
+            write_to_log_process("Error: Could not write to the forward spool, readings lost");
+            return -1;
+        }
+        written += bytes;
+    }
+    // a spooled frame is what the upstream will get after a crash or a power loss, so it is synced whole
+    if (fdatasync(fw->spool_fd) != 0) write_to_log_process("Error: Could not sync the forward spool");
+    fw->spool_end += size;
+    metrics_add(METRIC_FORWARD_SPOOLED, count);
+    return 0;
+}
+
+static void push_inflight(forwarder_t *fw, char *data, uint32_t size, uint32_t count) {
+    if (fw->inflight_count == 0) fw->last_ack_ns = latency_now();
+    fw->inflight[(fw->inflight_head + fw->inflight_count++) % FORWARD_WINDOW] =
+            (inflight_t) {.data = data, .size = size, .count = count};
+    fw->frames_sent++;
+}
+
+static void pop_inflight(forwarder_t *fw) {
+    inflight_t *frame = &fw->inflight[fw->inflight_head];
+    if (frame->data != NULL) free(frame->data);
+    else fw->spool_acked += frame->size;
+    metrics_add(METRIC_FORWARD_RECORDS, frame->count);
+    fw->inflight_head = (fw->inflight_head + 1) % FORWARD_WINDOW;
+    fw->inflight_count--;
+    fw->frames_acked++;
+}
+
+static void link_up(forwarder_t *fw) {
+    struct timeval tv = {.tv_sec = IO_TIMEOUT, .tv_usec = 0};
+    char log_msg[160];
+
+    tcp_get_sd(fw->socket, &fw->sd);
+    // a stalled upstream breaks the link instead of the reader: its frames go to the spool
+    setsockopt(fw->sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    fw->frames_sent = fw->frames_acked = 0;
+    fw->ack_len = 0;
+    fw->spool_sent = fw->spool_acked;
+    fw->last_send_ns = latency_now();
+    snprintf(log_msg, sizeof(log_msg), "Forwarder connected to the upstream gateway %s:%d, %lld bytes spooled",
+             fw->host, fw->port, (long long) (fw->spool_end - fw->spool_acked));
+    write_to_log_process(log_msg);
+}
+
+// closes the link; frames sent directly and not acknowledged go to the spool, in front of anything newer
+static void link_down(forwarder_t *fw, const char *reason) {
+    char log_msg[160];
+
+    snprintf(log_msg, sizeof(log_msg), "Forwarder lost the upstream gateway %s:%d (%s), spooling", fw->host,
+             fw->port, reason);
+    write_to_log_process(log_msg);
+    tcp_close(&fw->socket);
+    atomic_store(&fw->link, NULL);
+    while (fw->inflight_count > 0) {
+        inflight_t *frame = &fw->inflight[fw->inflight_head];
+        if (frame->data != NULL) {
+            spool_write(fw, frame->data, frame->size, frame->count);
+            free(frame->data);
+        }
+        fw->inflight_head = (fw->inflight_head + 1) % FORWARD_WINDOW;
+        fw->inflight_count--;
+    }
+    fw->spool_sent = fw->spool_acked;
+}
+
+/* Reads the acknowledgements that arrived without waiting for more
+ * Returns -1 if the link is broken. */
+static int read_acks(forwarder_t *fw) {
+    while (1) {
+        ssize_t got = recv(fw->sd, fw->ack + fw->ack_len, sizeof(fw->ack) - fw->ack_len, MSG_DONTWAIT);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (got <= 0) return -1;
+        fw->ack_len += got;
+        if (fw->ack_len < (int) sizeof(fw->ack)) continue;
+
+        uint32_t acked;
+        memcpy(&acked, fw->ack, sizeof(acked));
+        fw->ack_len = 0;
+        if (acked - fw->frames_acked > (uint32_t) fw->inflight_count) return -1;   // not a frame we sent
+        while (fw->frames_acked != acked) pop_inflight(fw);
+        fw->last_ack_ns = latency_now();
+    }
+}
+
+static void check_drained(forwarder_t *fw) {
+    if (fw->spool_end == 0 || fw->spool_acked < fw->spool_end) return;
+    if (ftruncate(fw->spool_fd, 0) != 0) return;
+    fw->spool_end = fw->spool_sent = fw->spool_acked = 0;
+    write_to_log_process("Forwarder drained its spool");
+}
+
+// sends spooled frames while the window has room
+static void replay_spool(forwarder_t *fw) {
+    forward_header_t header;
+
+    while (fw->socket != NULL && fw->inflight_count < FORWARD_WINDOW && fw->spool_sent < fw->spool_end) {
+        if (pread(fw->spool_fd, &header, sizeof(header), fw->spool_sent) != sizeof(header) || !valid_header(&header) ||
+            pread(fw->spool_fd, fw->frame, sizeof(header) + header.length, fw->spool_sent) !=
+            (ssize_t) (sizeof(header) + header.length)) {
+            write_to_log_process("Error: Could not read the forward spool, the rest of it is dropped");
+            fw->spool_end = fw->spool_sent;
+            return;
+        }
+        if (send_all(fw, fw->frame, sizeof(header) + header.length) != 0) {
+            link_down(fw, "send failed");
+            return;
+        }
+        push_inflight(fw, NULL, sizeof(header) + header.length, header.count);
+        fw->spool_sent += sizeof(header) + header.length;
+    }
+}
+
+/* Sends the batch as a frame if the link is up, nothing is spooled and the window has room, spools it otherwise.
+ * Acknowledgements are only polled: waiting for them would stall this reader, and through the bounded sbuffer
+ * queues every producer with it. */
+static void emit_frame(forwarder_t *fw) {
+    uint32_t count = fw->count, size = encode_frame(fw);
+    char *copy;
+
+    if (fw->socket != NULL && fw->inflight_count == FORWARD_WINDOW && read_acks(fw) != 0) {
+        link_down(fw, "connection closed");
+    }
+    if (fw->socket != NULL && fw->spool_end == 0 && fw->inflight_count < FORWARD_WINDOW &&
+        (copy = malloc(size)) != NULL) {
+        memcpy(copy, fw->frame, size);
+        if (send_all(fw, fw->frame, size) == 0) {
+            push_inflight(fw, copy, size, count);
+            return;
+        }
+        free(copy);
+        link_down(fw, "send failed");
+    }
+    spool_write(fw, fw->frame, size, count);
+}
+
+// runs every FORWARD_FLUSH_INTERVAL: sends the batch so far, takes a new link, reads acknowledgements, replays
+static void service(forwarder_t *fw, uint64_t now) {
+    if (fw->socket == NULL && (fw->socket = atomic_load(&fw->link)) != NULL) link_up(fw);
+    if (fw->count > 0) emit_frame(fw);
+    if (fw->socket == NULL) return;
+    if (read_acks(fw) != 0) {
+        link_down(fw, "connection closed");
+        return;
+    }
+    if (fw->inflight_count > 0 && now >= fw->last_ack_ns + IO_TIMEOUT * NSEC_PER_SEC) {
+        link_down(fw, "no acknowledgement");
+        return;
+    }
+    check_drained(fw);
+    replay_spool(fw);
+    if (fw->socket != NULL && fw->inflight_count < FORWARD_WINDOW &&
+        now - fw->last_send_ns >= FORWARD_HEARTBEAT_INTERVAL * NSEC_PER_MSEC) {
+        // keeps the receiving connmgr, which gives up after TIMEOUT s of silence, from closing an idle link
+        encode_frame(fw);
+        if (send_all(fw, fw->frame, sizeof(forward_header_t)) == 0) push_inflight(fw, NULL, 0, 0);
+        else link_down(fw, "send failed");
+    }
+}
+
+// keeps the frames the upstream hasn't acknowledged for the next run: [spool_acked, spool_end) moves to the front
+static void close_spool(forwarder_t *fw) {
+    char tmp_path[PATH_MAX + 4], chunk[65536];
+    ssize_t bytes;
+    int out;
+
+    if (fw->spool_acked > 0 && fw->spool_acked < fw->spool_end) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", fw->spool_path);
+        out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (off_t offset = fw->spool_acked; out >= 0 && offset < fw->spool_end; offset += bytes) {
+            if ((bytes = pread(fw->spool_fd, chunk, sizeof(chunk), offset)) <= 0 || write(out, chunk, bytes) != bytes) {
+                close(out);
+                out = -1;
+            }
+        }
+        if (out < 0 || fsync(out) != 0 || close(out) != 0 || rename(tmp_path, fw->spool_path) != 0) {
+            // the whole spool is replayed then, the upstream gets the acknowledged part twice
+            write_to_log_process("Error: Could not compact the forward spool");
+            unlink(tmp_path);
+        }
+    } else if (fw->spool_acked == fw->spool_end) {
+        unlink(fw->spool_path);
+    }
+    close(fw->spool_fd);
+}
+
+// opens the spool and finds the frames a previous run left; a torn last frame is cut off
+static int open_spool(forwarder_t *fw, const char *dir) {
+    forward_header_t header;
+    struct stat st;
+    char log_msg[PATH_MAX + 64];
+
+    fw->spool_fd = -1;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+    snprintf(fw->spool_path, sizeof(fw->spool_path), "%s/%s", dir, FORWARD_SPOOL_FILE);
+    fw->spool_fd = open(fw->spool_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fw->spool_fd < 0 || fstat(fw->spool_fd, &st) != 0) return -1;
+    while (pread(fw->spool_fd, &header, sizeof(header), fw->spool_end) == sizeof(header) && valid_header(&header) &&
+           fw->spool_end + (off_t) (sizeof(header) + header.length) <= st.st_size) {
+        fw->spool_end += sizeof(header) + header.length;
+    }
+    if (fw->spool_end < st.st_size && ftruncate(fw->spool_fd, fw->spool_end) != 0) return -1;
+    if (fw->spool_end > 0) {
+        snprintf(log_msg, sizeof(log_msg), "Forwarder replays %lld bytes spooled in %s by a previous run",
+                 (long long) fw->spool_end, fw->spool_path);
+        write_to_log_process(log_msg);
+    }
+    return 0;
+}
+
+static forwarder_t *forwarder_create(const char *upstream, const char *spool_dir) {
+    forwarder_t *fw = calloc(1, sizeof(forwarder_t));
+    const char *colon = strrchr(upstream, ':');
+
+    if (fw == NULL) return NULL;
+    if (colon == NULL || colon - upstream >= (long) sizeof(fw->host) || (fw->port = atoi(colon + 1)) <= 0) {
+        write_to_log_process("Error: --forward-to takes <ip>:<port>, not forwarding");
+        free(fw);
+        return NULL;
+    }
+    memcpy(fw->host, upstream, colon - upstream);
+    atomic_init(&fw->link, NULL);
+    if (open_spool(fw, spool_dir) != 0) {
+        write_to_log_process("Error: Could not open the forward spool, not forwarding");
+        if (fw->spool_fd >= 0) close(fw->spool_fd);
+        free(fw);
+        return NULL;
+    }
+    if (pthread_create(&fw->connector, NULL, connect_run, fw) != 0) {
+        close(fw->spool_fd);
+        free(fw);
+        return NULL;
+    }
+    return fw;
+}
+
+// end of the stream: sends what is left and waits for its acknowledgements, the rest stays spooled
+static void forwarder_finish(forwarder_t *fw) {
+    if (fw->count > 0) emit_frame(fw);
+    pthread_cancel(fw->connector);
+    pthread_join(fw->connector, NULL);
+    if (fw->socket == NULL && (fw->socket = atomic_load(&fw->link)) != NULL) link_up(fw);
+    while (fw->socket != NULL) {
+        replay_spool(fw);
+        if (fw->socket == NULL || (fw->inflight_count == 0 && fw->spool_sent == fw->spool_end)) break;
+        // the stream is over, waiting here holds up no producer
+        struct pollfd pfd = {.fd = fw->sd, .events = POLLIN};
+        if (poll(&pfd, 1, IO_TIMEOUT * 1000) <= 0 || read_acks(fw) != 0) link_down(fw, "no acknowledgement");
+    }
+    check_drained(fw);
+    if (fw->socket != NULL) tcp_close(&fw->socket);
+    close_spool(fw);
+    free(fw);
+}
+
+void *forward_run(void *arg) {
+    forward_args_t *args = (forward_args_t *) arg;
+    forwarder_t *fw = NULL;
+    sensor_record_t data;
+    uint64_t next_service = latency_now(), now;
+    int result;
+
+    if (args->upstream != NULL) {
+        fw = forwarder_create(args->upstream, (args->spool_dir != NULL) ? args->spool_dir : FORWARD_SPOOL_DIR);
+    }
+
+    while (1) {
+        result = sbuffer_remove_timed(args->buffer, &data, READER_FORWARD, NULL, (fw != NULL) ? next_service : 0);
+        if (result == SBUFFER_NO_DATA) break;
+        if (fw == NULL) continue;
+        // a frame has no room for the validation tag either, so the upstream only gets valid readings
+        if (result == SBUFFER_SUCCESS && !(data.flags & RECORD_FLAG_INVALID)) {
+            // the journal flags are local to this gateway
+            data.flags = 0;
+            fw->batch[fw->count++] = data;
+            if (fw->count == FORWARD_BATCH) emit_frame(fw);
+        }
+        now = latency_now();
+        if (now >= next_service) {
+            service(fw, now);
+            next_service = now + FORWARD_FLUSH_INTERVAL * NSEC_PER_MSEC;
+        }
+    }
+
+    if (fw != NULL) forwarder_finish(fw);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------- receiving side */
+
+long forward_receive(tcpsock_t *client, sbuffer_t *buffer, sbuffer_queue_t *queue) {
+    forward_header_t header = {.marker = 0};
+    char *payload = malloc(MAX_FRAME_LENGTH);
+    sensor_record_t *records = malloc(FORWARD_BATCH * sizeof(sensor_record_t));
+    uint32_t frames = 0;
+    long received = 0;
+    char log_msg[128];
+    int result, count;
+
+    write_to_log_process("A gateway forwarder has opened a new connection");
+    // the connmgr has read the marker already
+    result = (payload != NULL && records != NULL) ?
+             connmgr_receive_all(client, (char *) &header + sizeof(header.marker),
+                                 sizeof(header) - sizeof(header.marker)) : TCP_MEMORY_ERROR;
+    while (result == TCP_NO_ERROR) {
+        uint64_t receive_ns = latency_now();
+        if (!valid_header(&header) || header.value_scale != RECORD_VALUE_SCALE ||
+            header.epoch_base != RECORD_EPOCH_BASE) {
+            write_to_log_process("Error: Invalid frame from a gateway forwarder, or it uses another record format");
+            break;
+        }
+        if (connmgr_receive_all(client, payload, header.length) != TCP_NO_ERROR) break;
+        if (decode_frame(payload, header.length, records, header.count) != 0) {
+            write_to_log_process("Error: Invalid frame from a gateway forwarder");
+            break;
+        }
+        metrics_add(METRIC_RECORDS_RECEIVED, header.count);
+        // a frame sent again after a broken link holds readings that were inserted already
+        count = validate_batch(records, header.count);
+        count = dedup_filter(records, count);
+        if (count > 0) {
+            journal_append(records, count);
+            if (queue != NULL) sbuffer_queue_insert_batch(queue, records, count);
+            else sbuffer_insert_batch(buffer, records, count);
+            latency_record(LATENCY_RECEIVE_TO_ENQUEUE, receive_ns);
+        }
+        metrics_add(METRIC_BYTES_RECEIVED, sizeof(header) + header.length);
+        received += header.count;
+        frames++;
+        if (connmgr_send_all(client, &frames, sizeof(frames)) != TCP_NO_ERROR) break;
+        result = connmgr_receive_all(client, &header, sizeof(header));
+    }
+
+    snprintf(log_msg, sizeof(log_msg), "A gateway forwarder has closed the connection after %ld readings", received);
+    write_to_log_process(log_msg);
+    free(payload);
+    free(records);
+    return received;
+}
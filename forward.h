@@ -0,0 +1,77 @@
+#ifndef _FORWARD_H_
+#define _FORWARD_H_
+
+#include <stdint.h>
+#include "config.h"
+#include "sbuffer.h"
+#include "lib/tcpsock.h"
+
+/*
+ * Gateway-to-gateway forwarding: the forward thread is the fifth reader of the sbuffer and sends every reading
+ * to an upstream gateway (--forward-to <ip:port>), which takes the connection on its normal sensor port.
+ * - Readings are sent in frames of up to FORWARD_BATCH readings, or what arrived in FORWARD_FLUSH_INTERVAL.
+ *   A frame is a forward_header_t and the readings stably sorted by sensor id, each one as LEB128 varints of
+ *   the id delta and the zigzag'ed timestamp and value deltas to the previous reading: 3-5 bytes instead of 18.
+ * - The upstream acknowledges every frame it has inserted in its sbuffer. Up to FORWARD_WINDOW frames may be
+ *   unacknowledged; when the link breaks they are sent again, so a reading arrives at least once. The reader
+ *   only polls for acknowledgements; a link without one for a second counts as broken.
+ * - While the upstream is unreachable or the window is full, frames are appended to a spool file in
+ *   --forward-spool <dir> and fdatasync()'ed one by one, so a spooled frame survives a power loss. Once there is
+ *   room the spool is replayed first, in order, and new frames go behind it until it is drained. A spool left
+ *   by a previous run is replayed as well.
+ * - Connecting happens in a helper thread, so an upstream that doesn't answer never stalls the reader.
+ * Without --forward-to the thread isn't started and its reader isn't registered with the sbuffer.
+ */
+
+#ifndef FORWARD_BATCH
+#define FORWARD_BATCH 4096          // readings per frame at most
+#endif
+
+#ifndef FORWARD_FLUSH_INTERVAL
+#define FORWARD_FLUSH_INTERVAL 100  // ms a reading waits for its frame to fill at most
+#endif
+
+#ifndef FORWARD_WINDOW
+#define FORWARD_WINDOW 64           // frames sent and not yet acknowledged
+#endif
+
+#ifndef FORWARD_RETRY_INTERVAL
+#define FORWARD_RETRY_INTERVAL 1000 // ms between two connection attempts
+#endif
+
+#define FORWARD_HEARTBEAT_INTERVAL 1000     // ms after which an idle link gets an empty frame, below TIMEOUT
+#define FORWARD_SPOOL_DIR "forward_spool"
+#define FORWARD_SPOOL_FILE "forward.spool"
+
+/* Leads every frame; 'marker' takes the place of the sensor id a sensor node starts with. No node sends id 0,
+ * so the connmgr knows a forwarder by its first two bytes. */
+typedef struct {
+    sensor_id_t marker;         // always 0
+    char magic[2];              // "FW"
+    uint32_t count;             // readings in the frame, 0 for a heartbeat
+    uint32_t length;            // bytes of encoded readings after the header
+    int32_t value_scale;        // RECORD_VALUE_SCALE of the sender, the receiver must use the same
+    int64_t epoch_base;         // RECORD_EPOCH_BASE of the sender, idem
+} forward_header_t;
+
+typedef struct {
+    sbuffer_t *buffer;
+    const char *upstream;       // "<ip>:<port>" of the upstream gateway, NULL = don't forward
+    const char *spool_dir;      // where frames wait while the upstream is unreachable
+} forward_args_t;
+
+/** Thread function: forwards every reading of the buffer until the end-of-stream marker
+ * - At the end it waits a moment for the outstanding acknowledgements; what the upstream didn't acknowledge
+ *   stays in the spool for the next run.
+ * \param args a forward_args_t, must stay valid until the thread exits
+ */
+void *forward_run(void *args);
+
+/** Receiving side, called by the connmgr for a connection whose first two bytes (already read) are 0
+ * - Inserts the readings of every frame in 'queue', or in the shared list of 'buffer' if 'queue' is NULL,
+ *   then acknowledges the frame with the number of frames taken on this connection so far (uint32_t).
+ * \return the number of readings received
+ */
+long forward_receive(tcpsock_t *client, sbuffer_t *buffer, sbuffer_queue_t *queue);
+
+#endif /* _FORWARD_H_ */
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ingest.h"
+#include "config.h"
+#include "record.h"
+#include "metrics.h"
+#include "journal.h"
+#include "dedup.h"
+#include "validate.h"
+#include "placement.h"
+
+#define RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int num_threads;
+    const char *records;
+    long num_records;
+    sbuffer_t *buffer;
+    long inserted;
+    int threaded;
+} ingest_producer_t;
+
+// into the producer's own queue if it got one, the shared list otherwise; returns the number of records inserted
+static int insert_batch(sbuffer_t *buffer, sbuffer_queue_t *queue, sensor_record_t *batch, int count) {
+    int result;
+
+    count = validate_batch(batch, count);
+    count = dedup_filter(batch, count);
+    journal_append(batch, count);
+    if (queue != NULL) result = sbuffer_queue_insert_batch(queue, batch, count);
+    else result = sbuffer_insert_batch(buffer, batch, count);
+    return (result == SBUFFER_SUCCESS) ? count : 0;
+}
+
+static void *producer_run(void *arg) {
+    ingest_producer_t *p = (ingest_producer_t *) arg;
+    sensor_record_t batch[INGEST_BATCH];
+    sbuffer_queue_t *queue = sbuffer_queue_open(p->buffer);
+    int count = 0;
+
+    for (long i = 0; i < p->num_records; i++) {
+        const char *record = p->records + i * RECORD_SIZE;
+        sensor_data_t data;
+        memcpy(&data.id, record, sizeof(data.id));
+        if (data.id == 0 || data.id % p->num_threads != p->index) continue;
+        memcpy(&data.value, record + sizeof(data.id), sizeof(data.value));
+        memcpy(&data.ts, record + sizeof(data.id) + sizeof(data.value), sizeof(data.ts));
+        batch[count] = record_pack(&data);
+        if (++count == INGEST_BATCH) {
+            p->inserted += insert_batch(p->buffer, queue, batch, count);
+            count = 0;
+        }
+    }
+    if (count > 0) p->inserted += insert_batch(p->buffer, queue, batch, count);
+    sbuffer_queue_close(queue);
+    metrics_add(METRIC_RECORDS_RECEIVED, p->inserted);
+    metrics_add(METRIC_BYTES_RECEIVED, p->inserted * RECORD_SIZE);
+    return NULL;
+}
+
+long ingest_file(const char *path, int num_threads, sbuffer_t *buffer) {
+    ingest_producer_t *producers;
+    struct stat st;
+    const char *records;
+    long inserted = 0;
+    int fd, i;
+    char log_msg[256];
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t) RECORD_SIZE) {
+        close(fd);
+        return 0;
+    }
+    records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (records == MAP_FAILED) return -1;
+    madvise((void *) records, st.st_size, MADV_SEQUENTIAL);
+
+    if (num_threads < 1) num_threads = 1;
+    producers = calloc(num_threads, sizeof(ingest_producer_t));
+    if (producers == NULL) {
+        munmap((void *) records, st.st_size);
+        return -1;
+    }
+
+    snprintf(log_msg, sizeof(log_msg), "Ingesting %ld records from %s with %d producers",
+             (long) (st.st_size / RECORD_SIZE), path, num_threads);
+    write_to_log_process(log_msg);
+
+    for (i = 0; i < num_threads; i++) {
+        ingest_producer_t *p = &producers[i];
+        p->index = i;
+        p->num_threads = num_threads;
+        p->records = records;
+        p->num_records = st.st_size / RECORD_SIZE;
+        p->buffer = buffer;
+        p->threaded = (placement_create(&p->thread, PLACEMENT_IO, producer_run, p) == 0);
+        if (!p->threaded) {
+            // don't lose the sensors of this producer: do its share in the calling thread
+            write_to_log_process("Error: Failed to create ingest thread");
+            producer_run(p);
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        if (producers[i].threaded) pthread_join(producers[i].thread, NULL);
+        inserted += producers[i].inserted;
+    }
+
+    free(producers);
+    munmap((void *) records, st.st_size);
+    return inserted;
+}
@@ -0,0 +1,31 @@
+#ifndef _INGEST_H_
+#define _INGEST_H_
+
+#include "sbuffer.h"
+
+/*
+ * Offline bulk ingest: feeds a sensor_data file (<sensor_id><temperature><timestamp> records, packed, as
+ * written by file_creator; concatenated files work as well) into the sbuffer without any socket.
+ */
+
+#ifndef INGEST_THREADS
+#define INGEST_THREADS 4
+#endif
+
+#ifndef INGEST_BATCH
+#define INGEST_BATCH 512    // records per sbuffer_insert_batch()
+#endif
+
+/** Pushes all records of the file at 'path' into 'buffer' from 'num_threads' producer threads
+ * - The file is mmap'ed; every producer owns the sensor ids with id % num_threads equal to its index,
+ *   so the readings of one sensor keep their file order, as they would over a single connection.
+ * - Records with sensor id 0 are skipped, since id 0 is the end-of-stream marker.
+ * - Once validate_init() was called, invalid readings (validate.h) are tagged or dropped, and once dedup_init()
+ *   was called, duplicates (dedup.h) are dropped; dropped readings are not counted as inserted.
+ * - Every producer inserts in its own sbuffer queue if 'buffer' has one free, in the shared list otherwise.
+ * - The end-of-stream marker itself is not inserted.
+ * \return the number of records inserted, or -1 if the file can't be read
+ */
+long ingest_file(const char *path, int num_threads, sbuffer_t *buffer);
+
+#endif /* _INGEST_H_ */
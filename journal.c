@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "config.h"
+#include "metrics.h"
+#include "latency.h"
+
+#define JOURNAL_MAGIC "SGWJRNL1"
+#define REPLAY_BATCH 512
+
+_Static_assert(JOURNAL_SEGMENT_RECORDS % JOURNAL_BLOCKS == 0, "a segment must split into whole blocks");
+
+/* On disk a segment is a header followed by JOURNAL_SEGMENT_RECORDS slots. The file is created at full size,
+ * so unwritten slots read as zeros; a slot only counts if its check matches, which also skips a slot that was
+ * being written during a crash. */
+typedef struct {
+    char magic[8];
+    uint64_t seq;
+    uint32_t slots;
+    uint16_t released;          // bit b: every reading of block b is in data.csv or the store, skip it on replay
+    char reserved[42];
+} journal_header_t;
+
+typedef struct {
+    sensor_record_t record;
+    uint32_t check;
+} journal_slot_t;
+
+typedef struct {
+    char *map;                  // NULL if the table entry is free
+    int fd;
+    uint64_t seq;
+    _Atomic int used;           // slots written; not a prefix, producers fill the slots they reserved in any order
+    int synced;                 // slots msync'ed, written with 'mutex' held
+    _Atomic int released;       // slots released by the storage reader
+    _Atomic int sealed;         // no more slots are reserved here, the next segment took over
+    int block_released[JOURNAL_BLOCKS];     // only the storage reader touches these two
+    int complete;               // bit b: block b is fully released, the header gets it with the next mark
+} journal_segment_t;
+
+static char journal_dir[PATH_MAX];
+static int journal_open_flag = 0;
+static journal_segment_t segments[JOURNAL_MAX_SEGMENTS];
+static journal_segment_t *_Atomic current = NULL;     // newest segment, producers read it without 'mutex'
+static uint64_t next_seq = 0;
+static uint64_t first_seq = 0;          // segment of the first slot of this run
+static _Atomic uint64_t reserved = 0;   // slots handed out to producers, slot p lives in segment first_seq + p / size
+static uint64_t *old_seqs = NULL;       // segments of the previous run, for journal_replay()
+static int num_old = 0;
+
+// 'mutex' guards starting segments and the segment table, producers only take it when their slots are in a segment
+// that doesn't exist yet; 'sync_mutex' is held while a segment may be msync'ed or unmapped, so the flusher never
+// syncs a segment that journal_retire() is removing, and producers never wait for an msync
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segment_free = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flusher_thread;
+static int flusher_running = 0;
+static int flusher_interval;
+static int flusher_stop = 0;
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+static int unmarked_blocks = 0;         // completed since the last mark, only touched by the storage reader
+static uint64_t last_mark_ns = 0;
+
+static uint32_t slot_check(const sensor_record_t *record, uint64_t seq) {
+    // FNV-1a over the record and the segment number, so stale slots of an older segment don't match
+    const unsigned char *p = (const unsigned char *) record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(sensor_record_t); i++) hash = (hash ^ p[i]) * 16777619u;
+    for (int i = 0; i < 8; i++) hash = (hash ^ (unsigned char) (seq >> (8 * i))) * 16777619u;
+    return hash ? hash : 1;
+}
+
+static size_t segment_size(void) {
+    return sizeof(journal_header_t) + (size_t) JOURNAL_SEGMENT_RECORDS * sizeof(journal_slot_t);
+}
+
+static void segment_path(char *buf, size_t size, uint64_t seq) {
+    snprintf(buf, size, "%s/segment-%016llu.wal", journal_dir, (unsigned long long) seq);
+}
+
+static journal_slot_t *segment_slots(journal_segment_t *segment) {
+    return (journal_slot_t *) (segment->map + sizeof(journal_header_t));
+}
+
+// creates the next segment file and makes it current; called with 'mutex' held
+static int start_segment(void) {
+    journal_segment_t *segment = NULL;
+    char path[PATH_MAX + 32];
+
+    while (segment == NULL) {
+        for (int i = 0; i < JOURNAL_MAX_SEGMENTS && segment == NULL; i++) {
+            if (segments[i].map == NULL) segment = &segments[i];
+        }
+        // every tag is taken: the storage reader is far behind, wait for it to release a segment
+        if (segment == NULL) pthread_cond_wait(&segment_free, &mutex);
+    }
+
+    segment_path(path, sizeof(path), next_seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, segment_size()) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    char *map = mmap(NULL, segment_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    journal_header_t *header = (journal_header_t *) map;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->seq = next_seq;
+    header->slots = JOURNAL_SEGMENT_RECORDS;
+    header->released = 0;
+
+    if (current != NULL) atomic_store_explicit(&current->sealed, 1, memory_order_release);
+    segment->map = map;
+    segment->fd = fd;
+    segment->seq = next_seq++;
+    atomic_store(&segment->used, 0);
+    segment->synced = 0;
+    atomic_store(&segment->released, 0);
+    atomic_store(&segment->sealed, 0);
+    memset(segment->block_released, 0, sizeof(segment->block_released));
+    segment->complete = 0;
+    atomic_store_explicit(&current, segment, memory_order_release);
+    return 0;
+}
+
+/* Returns the segment holding slot 'pos', starting the segments up to it if needed, or NULL if one of them can't
+ * be created. Slots are reserved before their segment is looked up, so a producer may find its segment sealed
+ * already; it can't be retired before the producer's readings were written and released. */
+static journal_segment_t *segment_of(uint64_t pos) {
+    uint64_t seq = first_seq + pos / JOURNAL_SEGMENT_RECORDS;
+    journal_segment_t *segment = atomic_load_explicit(&current, memory_order_acquire);
+
+    if (segment != NULL && segment->seq == seq) return segment;
+    pthread_mutex_lock(&mutex);
+    while ((current == NULL || current->seq < seq) && start_segment() == 0);
+    segment = current;
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS && segment != NULL && segment->seq > seq; i++) {
+        if (segments[i].map != NULL && segments[i].seq == seq) segment = &segments[i];
+    }
+    if (segment != NULL && segment->seq != seq) segment = NULL;
+    pthread_mutex_unlock(&mutex);
+    return segment;
+}
+
+// slots of 'segment' handed out so far
+static int segment_reserved(journal_segment_t *segment) {
+    uint64_t start = (segment->seq - first_seq) * JOURNAL_SEGMENT_RECORDS;
+    uint64_t pos = atomic_load(&reserved);
+
+    if (pos <= start) return 0;
+    return (pos - start < JOURNAL_SEGMENT_RECORDS) ? (int) (pos - start) : JOURNAL_SEGMENT_RECORDS;
+}
+
+static int compare_seq(const void *x, const void *y) {
+    uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+    return (a < b) ? -1 : (a > b);
+}
+
+// finds the segments of a previous run and sets 'next_seq' past them
+static int scan_old_segments(void) {
+    DIR *dir = opendir(journal_dir);
+    struct dirent *entry;
+    unsigned long long seq;
+    int capacity = 0;
+    char tail;
+
+    if (dir == NULL) return -1;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "segment-%llu.wa%c", &seq, &tail) != 2 || tail != 'l') continue;
+        if (num_old == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *seqs = realloc(old_seqs, capacity * sizeof(uint64_t));
+            if (seqs == NULL) break;
+            old_seqs = seqs;
+        }
+        old_seqs[num_old++] = seq;
+        if (seq >= next_seq) next_seq = seq + 1;
+    }
+    closedir(dir);
+    qsort(old_seqs, num_old, sizeof(uint64_t), compare_seq);
+    return 0;
+}
+
+/* msyncs everything appended so far. Producers keep appending meanwhile: the ranges are taken with 'mutex',
+ * synced without it. A range only counts as synced once every slot reserved in it was written, until then it is
+ * synced again the next time. */
+static void sync_segments(void) {
+    int from[JOURNAL_MAX_SEGMENTS], to[JOURNAL_MAX_SEGMENTS], written[JOURNAL_MAX_SEGMENTS], synced = 0;
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&sync_mutex);
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        from[i] = segments[i].synced;
+        to[i] = written[i] = 0;
+        if (segments[i].map == NULL) continue;
+        // 'used' before the reservations: if they match, no slot below 'to' was still being written
+        written[i] = atomic_load(&segments[i].used);
+        to[i] = segment_reserved(&segments[i]);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        if (to[i] <= from[i]) continue;
+        size_t start = sizeof(journal_header_t) + (size_t) from[i] * sizeof(journal_slot_t);
+        size_t end = sizeof(journal_header_t) + (size_t) to[i] * sizeof(journal_slot_t);
+        start -= (from[i] == 0) ? start : start % page;     // the first sync includes the header
+        msync(segments[i].map + start, end - start, MS_SYNC);
+        synced = 1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        if (to[i] > from[i] && written[i] == to[i]) segments[i].synced = to[i];
+    }
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&sync_mutex);
+    if (synced) metrics_add(METRIC_JOURNAL_SYNCS, 1);
+}
+
+static void *flusher_run(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&flusher_mutex);
+    while (!flusher_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) flusher_interval * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!flusher_stop && pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &deadline) != ETIMEDOUT);
+        if (flusher_stop) break;
+        pthread_mutex_unlock(&flusher_mutex);
+        sync_segments();
+        pthread_mutex_lock(&flusher_mutex);
+    }
+    pthread_mutex_unlock(&flusher_mutex);
+    return NULL;
+}
+
+int journal_open(const char *dir, int sync_interval_ms) {
+    if (journal_open_flag) return -1;
+    snprintf(journal_dir, sizeof(journal_dir), "%s", dir);
+    if (mkdir(journal_dir, 0755) != 0 && errno != EEXIST) return -1;
+    if (scan_old_segments() != 0) return -1;
+
+    pthread_mutex_lock(&mutex);
+    first_seq = next_seq;
+    atomic_store(&reserved, 0);
+    int result = start_segment();
+    pthread_mutex_unlock(&mutex);
+    if (result != 0) return -1;
+
+    flusher_interval = (sync_interval_ms > 0) ? sync_interval_ms : 1;
+    flusher_stop = 0;
+    flusher_running = (pthread_create(&flusher_thread, NULL, flusher_run, NULL) == 0);
+    journal_open_flag = 1;
+    return 0;
+}
+
+int journal_active(void) {
+    return journal_open_flag;
+}
+
+void journal_append(sensor_record_t *records, int count) {
+    journal_segment_t *segment = NULL;
+    uint64_t pos;
+    int n = 0, written = 0;
+
+    if (!journal_open_flag) return;
+    for (int i = 0; i < count; i++) n += (records[i].id != 0);
+    // one atomic add reserves the slots of the whole batch, producers only meet on 'mutex' to start a segment
+    pos = atomic_fetch_add(&reserved, n);
+    for (int i = 0; i < count; i++) {
+        if (records[i].id == 0) continue;
+        int used = (int) (pos % JOURNAL_SEGMENT_RECORDS);
+        if (segment == NULL || used == 0) {
+            if (written > 0) atomic_fetch_add_explicit(&segment->used, written, memory_order_release);
+            written = 0;
+            segment = segment_of(pos);
+        }
+        pos++;
+        if (segment == NULL) {
+            // the reading still goes through the pipeline, it just isn't journaled
+            write_to_log_process("Error: Could not create a journal segment");
+            records[i].flags &= ~RECORD_JOURNAL_BITS;
+            continue;
+        }
+        journal_slot_t *slot = &segment_slots(segment)[used];
+        records[i].flags = (uint16_t) ((records[i].flags & ~RECORD_JOURNAL_BITS) | RECORD_FLAG_JOURNALED |
+                                       ((used / JOURNAL_BLOCK_RECORDS) << RECORD_JOURNAL_BLOCK_SHIFT) |
+                                       ((segment - segments) << RECORD_JOURNAL_TAG_SHIFT));
+        slot->record = records[i];
+        slot->check = slot_check(&records[i], segment->seq);
+        written++;
+    }
+    if (written > 0) atomic_fetch_add_explicit(&segment->used, written, memory_order_release);
+}
+
+/* Notes block 'b' of 'segment' as complete once every reading of it was released
+ * \return 1 if the whole segment is released */
+static int check_released(journal_segment_t *segment, int b) {
+    // 'sealed' first: once it is set no slot is reserved here anymore. All slots of a sealed segment were
+    // reserved, and each is released only after it was written, so a full count means nothing is in flight.
+    int sealed = atomic_load_explicit(&segment->sealed, memory_order_acquire);
+
+    if (segment->map == NULL) return 0;
+    if (segment->block_released[b] == JOURNAL_BLOCK_RECORDS && !(segment->complete & (1 << b))) {
+        segment->complete |= 1 << b;
+        unmarked_blocks++;
+    }
+    return sealed && atomic_load(&segment->released) == JOURNAL_SEGMENT_RECORDS;
+}
+
+int journal_release(const sensor_record_t *record) {
+    static int last_tag = -1, last_block = -1;     // only the storage reader releases
+    if (!journal_open_flag || !(record->flags & RECORD_FLAG_JOURNALED)) return 0;
+
+    int tag = record->flags >> RECORD_JOURNAL_TAG_SHIFT;
+    int block = (record->flags >> RECORD_JOURNAL_BLOCK_SHIFT) & (JOURNAL_BLOCKS - 1);
+    journal_segment_t *segment = &segments[tag];
+    int retire = 0;
+
+    atomic_fetch_add(&segment->released, 1);
+    if (++segment->block_released[block] == JOURNAL_BLOCK_RECORDS) {
+        retire = check_released(segment, block);
+    }
+    // the last reading of a segment may be released before the segment is sealed: check again when the readings
+    // of the next block come in
+    if (tag != last_tag || block != last_block) {
+        if (last_tag != -1 && check_released(&segments[last_tag], last_block)) retire = 1;
+        last_tag = tag;
+        last_block = block;
+        // marking costs a sync of data.csv, so completed blocks wait for the sync interval
+        if (unmarked_blocks > 0 && latency_now() - last_mark_ns >= (uint64_t) flusher_interval * 1000000ULL) {
+            retire = 1;
+        }
+    }
+    return retire;
+}
+
+// writes the completed blocks into the segment headers; what they hold must be durable already
+static void mark_blocks(void) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&sync_mutex);
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        journal_segment_t *segment = &segments[i];
+        if (segment->map == NULL) continue;
+        journal_header_t *header = (journal_header_t *) segment->map;
+        uint16_t complete = (uint16_t) segment->complete;
+        if (header->released == complete) continue;
+        header->released = complete;
+        msync(segment->map, page, MS_SYNC);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    unmarked_blocks = 0;
+    last_mark_ns = latency_now();
+}
+
+// removes the fully released segments; with 'all' the current one as well (at close)
+static void retire_segments(int all) {
+    char *maps[JOURNAL_MAX_SEGMENTS];
+    int fds[JOURNAL_MAX_SEGMENTS], n = 0;
+    uint64_t seqs[JOURNAL_MAX_SEGMENTS];
+    char path[PATH_MAX + 32];
+
+    pthread_mutex_lock(&sync_mutex);
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        journal_segment_t *segment = &segments[i];
+        if (segment->map == NULL || (segment == current && !all)) continue;
+        // at close no producer is left, so every reserved slot is written and 'used' is final
+        if (!all && !(atomic_load_explicit(&segment->sealed, memory_order_acquire) &&
+                      atomic_load(&segment->released) == JOURNAL_SEGMENT_RECORDS)) continue;
+        if (all && atomic_load(&segment->released) != atomic_load(&segment->used)) continue;
+        maps[n] = segment->map;
+        fds[n] = segment->fd;
+        seqs[n++] = segment->seq;
+        segment->map = NULL;
+        if (segment == current) current = NULL;
+    }
+    if (n > 0) pthread_cond_broadcast(&segment_free);
+    pthread_mutex_unlock(&mutex);
+
+    for (int i = 0; i < n; i++) {
+        munmap(maps[i], segment_size());
+        close(fds[i]);
+        segment_path(path, sizeof(path), seqs[i]);
+        unlink(path);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+void journal_retire(void) {
+    if (!journal_open_flag) return;
+    mark_blocks();
+    retire_segments(0);
+}
+
+long journal_replay(sbuffer_t *buffer) {
+    sensor_record_t batch[REPLAY_BATCH];
+    char path[PATH_MAX + 32], log_msg[PATH_MAX + 128];
+    long replayed = 0, stored = 0;
+    int count = 0;
+
+    if (!journal_open_flag) return 0;
+    for (int s = 0; s < num_old; s++) {
+        struct stat st;
+        segment_path(path, sizeof(path), old_seqs[s]);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(journal_header_t)) {
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) continue;
+
+        journal_header_t *header = (journal_header_t *) map;
+        size_t slots = (st.st_size - sizeof(journal_header_t)) / sizeof(journal_slot_t);
+        if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0 && header->seq == old_seqs[s]) {
+            journal_slot_t *slot = (journal_slot_t *) (map + sizeof(journal_header_t));
+            size_t per_block = (header->slots >= JOURNAL_BLOCKS) ? header->slots / JOURNAL_BLOCKS : 1;
+            if (header->slots < slots) slots = header->slots;
+            for (size_t i = 0; i < slots; i++) {
+                if (slot[i].record.id == 0 || slot[i].check != slot_check(&slot[i].record, header->seq)) continue;
+                if (i / per_block < JOURNAL_BLOCKS && (header->released >> (i / per_block)) & 1) {
+                    stored++;       // the previous run wrote it out already
+                    continue;
+                }
+                batch[count++] = slot[i].record;
+                if (count == REPLAY_BATCH) {
+                    journal_append(batch, count);
+                    sbuffer_insert_batch(buffer, batch, count);
+                    replayed += count;
+                    count = 0;
+                }
+            }
+        }
+        munmap(map, st.st_size);
+    }
+    if (count > 0) {
+        journal_append(batch, count);
+        sbuffer_insert_batch(buffer, batch, count);
+        replayed += count;
+    }
+
+    // the readings are in the new segments now; only drop the old ones once those are on disk
+    sync_segments();
+    for (int s = 0; s < num_old; s++) {
+        segment_path(path, sizeof(path), old_seqs[s]);
+        unlink(path);
+    }
+    if (num_old > 0) {
+        snprintf(log_msg, sizeof(log_msg), "Replayed %ld readings from %d journal segments in %s, skipped %ld stored",
+                 replayed, num_old, journal_dir, stored);
+        write_to_log_process(log_msg);
+    }
+    metrics_add(METRIC_JOURNAL_REPLAYED, replayed);
+    free(old_seqs);
+    old_seqs = NULL;
+    num_old = 0;
+    return replayed;
+}
+
+void journal_close(void) {
+    if (!journal_open_flag) return;
+    if (flusher_running) {
+        pthread_mutex_lock(&flusher_mutex);
+        flusher_stop = 1;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&flusher_mutex);
+        pthread_join(flusher_thread, NULL);
+        flusher_running = 0;
+    }
+    sync_segments();
+    mark_blocks();
+    retire_segments(1);
+
+    // what is left was never written to data.csv: keep the files for the next start
+    for (int i = 0; i < JOURNAL_MAX_SEGMENTS; i++) {
+        if (segments[i].map == NULL) continue;
+        munmap(segments[i].map, segment_size());
+        close(segments[i].fd);
+        segments[i].map = NULL;
+    }
+    current = NULL;
+    free(old_seqs);
+    old_seqs = NULL;
+    num_old = 0;
+    journal_open_flag = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "record.h"
+#include "sbuffer.h"
+
+/*
+ * Optional write-ahead journal of the readings in the sbuffer, so a crash doesn't lose what storage_mgr_run
+ * has not written to data.csv yet.
+ * - Producers append every reading before inserting it in the sbuffer. The journal is a directory of
+ *   mmap'ed segment files of JOURNAL_SEGMENT_RECORDS readings each. A batch reserves its slots with one atomic
+ *   add and is copied in without a lock; producers only take the journal mutex to start the next segment.
+ * - A flusher thread msync()s what was appended every 'sync_interval_ms' (group commit): after a process crash
+ *   nothing is lost, after a power loss at most the last interval.
+ * - The storage reader releases every reading it has written. A segment is made of JOURNAL_BLOCKS blocks; the
+ *   blocks of which every reading was released are marked in the segment header once data.csv (or the segment
+ *   store, store.h) was synced, at most every sync interval, and a fully released segment file is deleted.
+ * - At startup, the readings of the segments left behind are inserted in the pipeline again, except for the
+ *   marked blocks. After a crash data.csv may hold a reading twice if its block was only partly released, or
+ *   completed within the last sync interval: a few blocks of JOURNAL_SEGMENT_RECORDS / JOURNAL_BLOCKS.
+ * Without journal_open() all functions do nothing.
+ */
+
+#ifndef JOURNAL_SEGMENT_RECORDS
+#define JOURNAL_SEGMENT_RECORDS (1 << 16)  // readings per segment file (16 bytes each on disk)
+#endif
+
+#define JOURNAL_BLOCKS 16                   // per segment, the block is 4 bits of the flags
+#define JOURNAL_BLOCK_RECORDS (JOURNAL_SEGMENT_RECORDS / JOURNAL_BLOCKS)
+
+#ifndef JOURNAL_SYNC_INTERVAL
+#define JOURNAL_SYNC_INTERVAL 100           // default ms between two group syncs
+#endif
+
+#define JOURNAL_MAX_SEGMENTS 256            // segments alive at once, the segment tag is one byte of the flags
+
+/** Opens the journal in directory 'dir' (created if needed) and starts the flusher thread
+ * - Segments left by a previous run are kept for journal_replay().
+ * \return 0 on success, -1 if the directory or the first segment can't be set up
+ */
+int journal_open(const char *dir, int sync_interval_ms);
+
+/** Returns 1 if the journal is open, 0 otherwise */
+int journal_active(void);
+
+/** Appends the readings of a previous run to the journal again and inserts them in 'buffer', then deletes the
+ * old segments; call it after the readers are started and before the producers
+ * \return the number of readings replayed
+ */
+long journal_replay(sbuffer_t *buffer);
+
+/** Appends 'count' readings; sets their journal flag and segment tag, which the readers must keep
+ * - Readings with id 0 are skipped, like sbuffer_insert_batch() does.
+ * - Blocks while JOURNAL_MAX_SEGMENTS segments wait for the storage reader.
+ */
+void journal_append(sensor_record_t *records, int count);
+
+/** Tells the journal that the storage reader has written 'record'
+ * \return 1 if a segment became fully released or released blocks are due to be marked: make data.csv
+ *         durable, then call journal_retire()
+ */
+int journal_release(const sensor_record_t *record);
+
+/** Marks the released blocks in their segment headers and deletes the segments of which every reading was
+ * released; everything released must be durable in data.csv or the store by now */
+void journal_retire(void);
+
+/** Stops the flusher with a last sync and closes the journal; fully released segments are deleted, the others
+ * stay for the next start with their released blocks marked. Call it after the readers are done. */
+void journal_close(void);
+
+#endif /* _JOURNAL_H_ */
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "latency.h"
+#include "config.h"
+
+/*
+ * Bucket layout: values below 2*SUB_BUCKETS ns get an exact bucket, above that every power of two is split in
+ * SUB_BUCKETS linear sub-buckets, so the relative error stays below 1/SUB_BUCKETS at any magnitude.
+ */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS     (1 << SUB_BUCKET_BITS)
+#define MAX_MSB         40      // 2^41 ns is about 36 minutes; larger values end up in the last bucket
+#define NUM_BUCKETS     ((MAX_MSB - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+typedef struct latency_hist {
+    struct latency_hist *next;  // registry link, protected by registry_mutex
+    latency_stage_t stage;
+    // only the owning thread writes, so relaxed load + store is enough; readers may see a slightly old view
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[NUM_BUCKETS];
+} latency_hist_t;
+
+typedef struct {
+    latency_hist_t *hist[LATENCY_NUM_STAGES];
+} latency_thread_t;
+
+static const char *stage_names[LATENCY_NUM_STAGES] = {
+        "receive->enqueue", "enqueue->datamgr", "enqueue->disk"
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static latency_hist_t *registry = NULL;
+// histograms of threads that already exited
+static uint64_t retired_max[LATENCY_NUM_STAGES];
+static uint64_t retired_buckets[LATENCY_NUM_STAGES][NUM_BUCKETS];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local latency_thread_t *local = NULL;
+
+static pthread_t reporter_thread;
+static int reporter_running = 0;
+static int reporter_interval;
+static int reporter_stop = 0;
+static pthread_mutex_t reporter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_cond = PTHREAD_COND_INITIALIZER;
+
+static int bucket_of(uint64_t value) {
+    int msb;
+    if (value < 2 * SUB_BUCKETS) return (int) value;
+    msb = 63 - __builtin_clzll(value);
+    if (msb > MAX_MSB) return NUM_BUCKETS - 1;
+    return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (int) ((value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_lower_bound(int bucket) {
+    int shift;
+    if (bucket < 2 * SUB_BUCKETS) return (uint64_t) bucket;
+    shift = bucket / SUB_BUCKETS - 1;
+    return (uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+// pthread key destructor: fold the histograms of an exiting thread into the retired totals
+static void thread_exit(void *arg) {
+    latency_thread_t *t = (latency_thread_t *) arg;
+    pthread_mutex_lock(&registry_mutex);
+    for (int s = 0; s < LATENCY_NUM_STAGES; s++) {
+        latency_hist_t *h = t->hist[s], **pp;
+        if (h == NULL) continue;
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        if (max > retired_max[s]) retired_max[s] = max;
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            retired_buckets[s][b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+        for (pp = &registry; *pp != h; pp = &(*pp)->next);
+        *pp = h->next;
+        free(h);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(t);
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+static latency_hist_t *register_hist(latency_stage_t stage) {
+    latency_hist_t *h;
+    if (local == NULL) {
+        pthread_once(&key_once, make_key);
+        local = calloc(1, sizeof(latency_thread_t));
+        if (local == NULL) return NULL;
+        pthread_setspecific(thread_key, local);
+    }
+    h = calloc(1, sizeof(latency_hist_t));
+    if (h == NULL) return NULL;
+    h->stage = stage;
+    pthread_mutex_lock(&registry_mutex);
+    h->next = registry;
+    registry = h;
+    pthread_mutex_unlock(&registry_mutex);
+    local->hist[stage] = h;
+    return h;
+}
+
+uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_record(latency_stage_t stage, uint64_t start_ns) {
+    uint64_t now = latency_now();
+    uint64_t value = (now > start_ns) ? now - start_ns : 0;
+    latency_hist_t *h = (local != NULL) ? local->hist[stage] : NULL;
+
+    if (h == NULL && (h = register_hist(stage)) == NULL) return;
+
+    _Atomic uint64_t *bucket = &h->buckets[bucket_of(value)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double p) {
+    uint64_t rank = (uint64_t) (p * count), seen = 0;
+    if (rank >= count) rank = count - 1;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) return bucket_lower_bound(b);
+    }
+    return bucket_lower_bound(NUM_BUCKETS - 1);
+}
+
+void latency_dump(void) {
+    static uint64_t buckets[NUM_BUCKETS];   // only used with registry_mutex held
+    char log_msg[256];
+
+    pthread_mutex_lock(&registry_mutex);
+    for (int s = 0; s < LATENCY_NUM_STAGES; s++) {
+        uint64_t count = 0, max = retired_max[s];
+        for (int b = 0; b < NUM_BUCKETS; b++) buckets[b] = retired_buckets[s][b];
+        for (latency_hist_t *h = registry; h != NULL; h = h->next) {
+            if (h->stage != s) continue;
+            uint64_t hmax = atomic_load_explicit(&h->max, memory_order_relaxed);
+            if (hmax > max) max = hmax;
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+            }
+        }
+        for (int b = 0; b < NUM_BUCKETS; b++) count += buckets[b];
+        if (count == 0) {
+            snprintf(log_msg, sizeof(log_msg), "Latency %s: no samples", stage_names[s]);
+        } else {
+            snprintf(log_msg, sizeof(log_msg),
+                     "Latency %s: n=%llu p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus",
+                     stage_names[s], (unsigned long long) count,
+                     percentile(buckets, count, 0.50) / 1e3, percentile(buckets, count, 0.90) / 1e3,
+                     percentile(buckets, count, 0.99) / 1e3, percentile(buckets, count, 0.999) / 1e3,
+                     max / 1e3);
+        }
+        write_to_log_process(log_msg);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+static void *reporter_run(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&reporter_mutex);
+    while (!reporter_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += reporter_interval;
+        while (!reporter_stop && pthread_cond_timedwait(&reporter_cond, &reporter_mutex, &deadline) != ETIMEDOUT);
+        if (reporter_stop) break;
+        pthread_mutex_unlock(&reporter_mutex);
+        latency_dump();
+        pthread_mutex_lock(&reporter_mutex);
+    }
+    pthread_mutex_unlock(&reporter_mutex);
+    return NULL;
+}
+
+int latency_start_reporter(int interval) {
+    reporter_interval = interval;
+    reporter_stop = 0;
+    if (pthread_create(&reporter_thread, NULL, reporter_run, NULL) != 0) return -1;
+    reporter_running = 1;
+    return 0;
+}
+
+void latency_stop_reporter(void) {
+    if (reporter_running) {
+        pthread_mutex_lock(&reporter_mutex);
+        reporter_stop = 1;
+        pthread_cond_signal(&reporter_cond);
+        pthread_mutex_unlock(&reporter_mutex);
+        pthread_join(reporter_thread, NULL);
+        reporter_running = 0;
+    }
+    latency_dump();
+}
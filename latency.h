@@ -0,0 +1,47 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+
+/*
+ * End-to-end latency histograms of the gateway pipeline.
+ * Every thread records into its own log-bucketed (HDR-style) histograms, so recording takes no lock and
+ * touches no shared cache line. Histograms are only summed when they are dumped to the log.
+ */
+
+#ifndef LATENCY_DUMP_INTERVAL
+#define LATENCY_DUMP_INTERVAL 10    // seconds between two periodic dumps
+#endif
+
+typedef enum {
+    LATENCY_RECEIVE_TO_ENQUEUE,     // reading arrived in client_handler -> inserted in the sbuffer
+    LATENCY_ENQUEUE_TO_DATAMGR,     // inserted in the sbuffer -> processed by datamgr_run
+    LATENCY_ENQUEUE_TO_DISK,        // inserted in the sbuffer -> written to data.csv by storage_mgr_run
+    LATENCY_NUM_STAGES
+} latency_stage_t;
+
+/** Returns the current monotonic time in ns, the unit of all stamps passed to latency_record() */
+uint64_t latency_now(void);
+
+/** Records the time between 'start_ns' and now for 'stage' in the histogram of the calling thread
+ * - The first call of a thread for a stage allocates and registers its histogram, later calls are lock-free.
+ * - When the thread exits, its histograms are folded into the totals automatically.
+ * \param stage the pipeline stage the latency belongs to
+ * \param start_ns a stamp taken earlier with latency_now()
+ */
+void latency_record(latency_stage_t stage, uint64_t start_ns);
+
+/** Writes one summary line per stage (count, p50, p90, p99, p99.9, max) to the log process
+ * - Values are cumulative since the gateway started.
+ */
+void latency_dump(void);
+
+/** Starts a thread that calls latency_dump() every 'interval' seconds
+ * \return 0 on success, -1 if the thread could not be started
+ */
+int latency_start_reporter(int interval);
+
+/** Stops the reporter thread (if started) and writes a final dump */
+void latency_stop_reporter(void);
+
+#endif /* _LATENCY_H_ */
@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dparray.h"
+
+#define INITIAL_CAPACITY 16
+
+/*
+ * The real definition of struct dparray
+ */
+
+struct dparray {
+    char *elements;     // 'size' elements of 'element_size' bytes, room for 'capacity'
+    int element_size;
+    int size;
+    int capacity;
+    bool sorted;        // elements are in element_compare() order, see dpa_sort()
+
+    void (*element_free)(void *element);
+
+    int (*element_compare)(void *x, void *y);
+};
+
+// address of the element at 'index'
+static inline void *at(dparray_t *array, int index) {
+    return array->elements + (size_t) index * array->element_size;
+}
+
+
+dparray_t *dpa_create(// callback functions
+        int element_size,
+        void (*element_free)(void *element),
+        int (*element_compare)(void *x, void *y)
+) {
+    dparray_t *array;
+    if (element_size <= 0) return NULL;
+    array = malloc(sizeof(struct dparray));
+    if (array == NULL) return NULL;
+    array->elements = NULL;
+    array->element_size = element_size;
+    array->size = 0;
+    array->capacity = 0;
+    array->sorted = false;
+    array->element_free = element_free;
+    array->element_compare = element_compare;
+    return array;
+}
+
+void dpa_free(dparray_t **array, bool free_element) {
+    if (array == NULL || *array == NULL) {
+        return;
+    }
+    if (free_element && (*array)->element_free != NULL) {
+        for (int i = 0; i < (*array)->size; i++) {
+            (*array)->element_free(at(*array, i));
+        }
+    }
+    free((*array)->elements);
+    free(*array);
+    *array = NULL;
+}
+
+int dpa_size(dparray_t *array) {
+    if (array == NULL) {
+        return -1;
+    }
+    return array->size;
+}
+
+dparray_t *dpa_reserve(dparray_t *array, int capacity) {
+    char *elements;
+    if (array == NULL) {
+        return NULL;
+    }
+    if (capacity <= array->capacity) {
+        return array;
+    }
+    elements = realloc(array->elements, (size_t) capacity * array->element_size);
+    if (elements == NULL) {
+        return array; // keep the old storage, the caller sees the capacity didn't grow
+    }
+    array->elements = elements;
+    array->capacity = capacity;
+    return array;
+}
+
+dparray_t *dpa_insert_at_index(dparray_t *array, void *element, int index) {
+    if (array == NULL) {
+        return NULL;
+    }
+    if (array->size == array->capacity) {
+        dpa_reserve(array, array->capacity ? array->capacity * 2 : INITIAL_CAPACITY);
+        if (array->size == array->capacity) {
+            return array; // growing failed, return original array
+        }
+    }
+
+    if (index < 0) index = 0;
+    if (index > array->size) index = array->size;
+    if (array->sorted &&
+        ((index > 0 && array->element_compare(at(array, index - 1), element) > 0) ||
+         (index < array->size && array->element_compare(element, at(array, index)) > 0))) {
+        array->sorted = false;
+    }
+    memmove(at(array, index + 1), at(array, index), (size_t) (array->size - index) * array->element_size);
+    memcpy(at(array, index), element, array->element_size);
+    array->size++;
+    return array;
+}
+
+dparray_t *dpa_remove_at_index(dparray_t *array, int index, bool free_element) {
+    if (array == NULL) {
+        return NULL;
+    }
+    if (array->size == 0) {
+        return array;
+    }
+
+    if (index < 0) index = 0;
+    if (index >= array->size) index = array->size - 1;
+    if (free_element && array->element_free != NULL) {
+        array->element_free(at(array, index));
+    }
+    memmove(at(array, index), at(array, index + 1), (size_t) (array->size - index - 1) * array->element_size);
+    array->size--;
+    return array;
+}
+
+void *dpa_get_element_at_index(dparray_t *array, int index) {
+    if (array == NULL || array->size == 0) {
+        return NULL;
+    }
+    if (index < 0) index = 0;
+    if (index >= array->size) index = array->size - 1;
+    return at(array, index);
+}
+
+int dpa_get_index_of_element(dparray_t *array, void *element) {
+    if (array == NULL) {
+        return -1;
+    }
+    if (array->sorted) {
+        int index = dpa_lower_bound(array, element);
+        if (index < array->size && array->element_compare(at(array, index), element) == 0) {
+            return index;
+        }
+        return -1;
+    }
+    for (int i = 0; i < array->size; i++) {
+        if (array->element_compare(at(array, i), element) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Bottom-up merge sort: stable and O(n log n) with any comparator, unlike qsort() which can't pass the
+ * callback of the array to its compare function
+ */
+dparray_t *dpa_sort(dparray_t *array) {
+    char *src, *dst, *tmp;
+    size_t es;
+    if (array == NULL) {
+        return NULL;
+    }
+    if (array->size < 2) {
+        array->sorted = true;
+        return array;
+    }
+    es = array->element_size;
+    tmp = malloc(array->size * es);
+    if (tmp == NULL) {
+        return NULL;
+    }
+    src = array->elements;
+    dst = tmp;
+    for (int width = 1; width < array->size; width *= 2) {
+        for (int lo = 0; lo < array->size; lo += 2 * width) {
+            int mid = (lo + width < array->size) ? lo + width : array->size;
+            int hi = (lo + 2 * width < array->size) ? lo + 2 * width : array->size;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                // take from the left run on ties, that keeps equal elements in order
+                int from = (array->element_compare(src + j * es, src + i * es) < 0) ? j++ : i++;
+                memcpy(dst + k++ * es, src + from * es, es);
+            }
+            memcpy(dst + k * es, src + i * es, (mid - i) * es);
+            k += mid - i;
+            memcpy(dst + k * es, src + j * es, (hi - j) * es);
+        }
+        char *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != array->elements) {
+        memcpy(array->elements, src, array->size * es);
+    }
+    free(tmp);
+    array->sorted = true;
+    return array;
+}
+
+bool dpa_is_sorted(dparray_t *array) {
+    return (array != NULL && array->sorted) ? true : false;
+}
+
+int dpa_lower_bound(dparray_t *array, void *element) {
+    int lo = 0, hi;
+    if (array == NULL || !array->sorted) {
+        return -1;
+    }
+    hi = array->size;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (array->element_compare(at(array, mid), element) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+dparray_t *dpa_insert_sorted(dparray_t *array, void *element) {
+    int lo = 0, hi;
+    if (array == NULL) {
+        return NULL;
+    }
+    if (!array->sorted) {
+        return dpa_insert_at_index(array, element, array->size);
+    }
+    hi = array->size;
+    // upper bound: behind the elements that compare equal, so equal elements stay in insertion order
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (array->element_compare(at(array, mid), element) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return dpa_insert_at_index(array, element, lo);
+}
+
+dpa_iterator_t dpa_iterator(dparray_t *array) {
+    dpa_iterator_t it = {NULL, NULL, 0};
+    if (array != NULL && array->size > 0) {
+        it.next = array->elements;
+        it.end = at(array, array->size);
+        it.element_size = array->element_size;
+    }
+    return it;
+}
@@ -0,0 +1,170 @@
+#ifndef _DPARRAY_H_
+#define _DPARRAY_H_
+
+#ifndef _DPL_BOOL_
+#define _DPL_BOOL_  // shared with dplist.h, so both lists can be used in one file
+typedef enum {
+    false, true
+} bool; // or use C99 #include <stdbool.h>
+#endif
+
+/**
+ * dparray_t is the contiguous companion of dplist_t: the same functions (dpa_ instead of dpl_), but the elements
+ * themselves are stored in one growable array of 'element_size' bytes each instead of a node per element.
+ * - Access by index is O(1), so index-based loops are linear instead of quadratic.
+ * - A scan reads consecutive memory without following a pointer per element, prefer the iterator below for it.
+ * - Inserting copies the element into the array; the returned element pointers point into the array and are
+ *   valid until the next insert or remove.
+ * - Inserting or removing anywhere but at the end moves the elements behind it.
+ */
+typedef struct dparray dparray_t;
+
+/* General remark on error handling
+ * If growing the array fails, the insert is not done and the unmodified array is returned.
+ */
+
+/** Create and allocate memory for a new array
+ * \param element_size the number of bytes of one element, copied in and out with memcpy()
+ * \param element_free callback function to free the memory an element points to (not the element itself, it is
+ *        part of the array); NULL if elements own nothing
+ * \param element_compare callback function to compare two element elements; returns -1 if x<y, 0 if x==y, or 1 if x>y
+ * \return a pointer to a newly-allocated and initialized array, or NULL
+ */
+dparray_t *dpa_create(
+        int element_size,
+        void (*element_free)(void *element),
+        int (*element_compare)(void *x, void *y)
+);
+
+/** Deletes all elements in the array
+ * - The array itself also needs to be deleted. (free all memory)
+ * - '*array' must be set to NULL.
+ * \param array a double pointer to the array
+ * \param free_element if true call element_free() on every element
+ */
+void dpa_free(dparray_t **array, bool free_element);
+
+/** Returns the number of elements in the array.
+ * - If 'array' is is NULL, -1 is returned.
+ * \param array a pointer to the array
+ * \return the size of the array
+ */
+int dpa_size(dparray_t *array);
+
+/** Makes room for at least 'capacity' elements, so the next inserts don't need to grow the array
+ * - If 'array' is is NULL, NULL is returned.
+ * \param array a pointer to the array
+ * \param capacity the number of elements to make room for
+ * \return a pointer to the array or NULL
+ */
+dparray_t *dpa_reserve(dparray_t *array, int capacity);
+
+/** Inserts a copy of the 'element_size' bytes at 'element' in the array at position 'index'
+ * - the first element has index 0.
+ * - If 'index' is 0 or negative, the element is inserted at the start of 'array'.
+ * - If 'index' is bigger than the number of elements in the array, the element is inserted at the end.
+ * - If 'array' is is NULL, NULL is returned.
+ * \param array a pointer to the array
+ * \param element a pointer to the data that needs to be inserted
+ * \param index the position at which the element should be inserted in the array
+ * \return a pointer to the array or NULL
+ */
+dparray_t *dpa_insert_at_index(dparray_t *array, void *element, int index);
+
+/** Removes the element at index 'index' from the array.
+ * - If 'index' is 0 or negative, the first element is removed.
+ * - If 'index' is bigger than the number of elements in the array, the last element is removed.
+ * - If the array is empty, return the unmodified array.
+ * - If 'array' is is NULL, NULL is returned.
+ * \param array a pointer to the array
+ * \param index the position of the element to remove
+ * \param free_element if true, call element_free() on the removed element
+ * \return a pointer to the array or NULL
+ */
+dparray_t *dpa_remove_at_index(dparray_t *array, int index, bool free_element);
+
+/** Returns the element with index 'index' in the array.
+ * - return is a pointer into the array, valid until the next insert or remove.
+ * - If 'index' is 0 or negative, the first element is returned.
+ * - If 'index' is bigger than the number of elements in the array, the last element is returned.
+ * - If the array is empty, NULL is returned.
+ * - If 'array' is NULL, NULL is returned.
+ * \param array a pointer to the array
+ * \param index the position of the element to return
+ * \return a pointer to the element at the given index or NULL
+ */
+void *dpa_get_element_at_index(dparray_t *array, int index);
+
+/** Returns the index of the first element in the array that matches 'element'.
+ * - Use 'element_compare()' to search 'element' in the array, a match is found when 'element_compare()' returns 0.
+ * - In sorted mode a binary search is used, otherwise the array is scanned from the start.
+ * - If 'element' is not found in the array, -1 is returned.
+ * - If 'array' is NULL, -1 is returned.
+ * \param array a pointer to the array
+ * \param element the element to look for
+ * \return the index of the element that matches 'element'
+ */
+int dpa_get_index_of_element(dparray_t *array, void *element);
+
+/**
+ * Sorted mode: after dpa_sort() the array is kept in 'element_compare()' order and lookups use binary search.
+ * - Build in bulk: append everything in any order, then call dpa_sort() once (O(n log n) instead of n inserts).
+ * - While sorted, dpa_get_index_of_element() is O(log n) and still returns the first matching element.
+ * - dpa_insert_at_index() keeps the mode only if the element fits in order at 'index'; use dpa_insert_sorted()
+ *   to let the array pick the position. Removing never breaks the order.
+ * - Changing the compared fields of an element in place is not detected; remove and re-insert it instead.
+ */
+
+/** Sorts the array with 'element_compare()' and switches it to sorted mode
+ * - The sort is stable, elements that compare equal keep their relative order.
+ * - If 'array' is NULL or the temporary buffer can't be allocated, the array is left unmodified and NULL is returned.
+ * \param array a pointer to the array
+ * \return a pointer to the array or NULL
+ */
+dparray_t *dpa_sort(dparray_t *array);
+
+/** Returns true if the array is in sorted mode, false otherwise (or if 'array' is NULL) */
+bool dpa_is_sorted(dparray_t *array);
+
+/** Returns the index of the first element that is not smaller than 'element' in a sorted array
+ * - If all elements are smaller, dpa_size() is returned.
+ * - If 'array' is NULL or not in sorted mode, -1 is returned.
+ * \param array a pointer to the array
+ * \param element the element to compare with
+ * \return the lower bound of 'element'
+ */
+int dpa_lower_bound(dparray_t *array, void *element);
+
+/** Inserts a copy of 'element' in a sorted array after all elements that are smaller or equal
+ * - If 'array' is not in sorted mode, the element is appended (same as inserting at dpa_size()).
+ * - If 'array' is is NULL, NULL is returned.
+ * \param array a pointer to the array
+ * \param element a pointer to the data that needs to be inserted
+ * \return a pointer to the array or NULL
+ */
+dparray_t *dpa_insert_sorted(dparray_t *array, void *element);
+
+/**
+ * Iterator over the elements, from index 0 to the end (so in order for a sorted array):
+ *     dpa_iterator_t it = dpa_iterator(array);
+ *     for (my_element_t *e; (e = dpa_iterator_next(&it)) != NULL;) { ... }
+ * - An iterator is invalidated by any insert or remove on the array.
+ */
+typedef struct {
+    char *next;
+    char *end;
+    int element_size;
+} dpa_iterator_t;
+
+/** Returns an iterator positioned before the first element (an empty iterator if 'array' is NULL) */
+dpa_iterator_t dpa_iterator(dparray_t *array);
+
+/** Returns the next element and advances the iterator, or NULL if there are no more elements */
+static inline void *dpa_iterator_next(dpa_iterator_t *it) {
+    void *element = it->next;
+    if (it->next >= it->end) return NULL;
+    it->next += it->element_size;
+    return element;
+}
+
+#endif  // _DPARRAY_H_
@@ -2,9 +2,19 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include "dplist.h"
 
+#define ARENA_ALIGN         _Alignof(max_align_t)
+#define ARENA_ROUND(n)      (((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+#define ARENA_MIN_BLOCK     (64 * 1024)
+#define ARENA_MAX_BLOCK     (8 * 1024 * 1024)
+// in arena mode a copied element lives right behind its node
+#define NODE_ELEMENT(node)  ((void *) ((char *) (node) + ARENA_ROUND(sizeof(dplist_node_t))))
+#define BLOCK_DATA(block)   ((char *) (block) + ARENA_ROUND(sizeof(dpl_block_t)))
+
 
 
 
@@ -17,8 +27,24 @@ struct dplist_node {
     void *element;
 };
 
+typedef struct dpl_block {
+    struct dpl_block *next;
+    size_t size;                    // usable bytes behind the header
+} dpl_block_t;
+
+typedef struct {
+    size_t slot_size;               // a node plus its in-arena element, rounded up to ARENA_ALIGN
+    int element_size;
+    dpl_block_t *blocks;            // all blocks, in the order they were allocated
+    dpl_block_t *current;           // the block nodes are carved from, NULL if there are no blocks yet
+    char *next, *end;               // the free part of 'current'
+    dplist_node_t *free_nodes;      // removed nodes, linked through 'next' and reused first
+    int external;                   // elements in the list that are not stored in the arena
+} dpl_arena_t;
+
 struct dplist {
     dplist_node_t *head;
+    dpl_arena_t *arena;             // NULL: every node is a separate malloc()
 
     void *(*element_copy)(void *src_element);
 
@@ -36,34 +62,146 @@ dplist_t *dpl_create(// callback functions
     dplist_t *list;
     list = malloc(sizeof(struct dplist));
     list->head = NULL;
+    list->arena = NULL;
     list->element_copy = element_copy;
     list->element_free = element_free;
     list->element_compare = element_compare;
     return list;
 }
 
-void dpl_free(dplist_t **list, bool free_element) {
+dplist_t *dpl_create_arena(// callback functions
+        void *(*element_copy)(void *src_element),
+        void (*element_free)(void **element),
+        int (*element_compare)(void *x, void *y),
+        int element_size
+) {
+    dplist_t *list = dpl_create(element_copy, element_free, element_compare);
+    if (list == NULL) {
+        return NULL;
+    }
+    list->arena = calloc(1, sizeof(dpl_arena_t));
+    if (list->arena == NULL) {
+        free(list);
+        return NULL;
+    }
+    list->arena->element_size = (element_size > 0) ? element_size : 0;
+    list->arena->slot_size = ARENA_ROUND(sizeof(dplist_node_t)) + ARENA_ROUND((size_t) list->arena->element_size);
+    return list;
+}
 
-    //TODO: add your code here
-    dplist_node_t *current;
-    dplist_node_t *next_node;
+// rewind to the start of the first block, all blocks are kept for reuse
+static void arena_reset(dpl_arena_t *arena) {
+    arena->current = arena->blocks;
+    arena->next = (arena->current != NULL) ? BLOCK_DATA(arena->current) : NULL;
+    arena->end = (arena->current != NULL) ? arena->next + arena->current->size : NULL;
+    arena->free_nodes = NULL;
+    arena->external = 0;
+}
 
-    if (list == NULL || *list == NULL) {
+static dplist_node_t *node_alloc(dplist_t *list) {
+    dpl_arena_t *arena = list->arena;
+    dplist_node_t *node;
+
+    if (arena == NULL) {
+        return malloc(sizeof(dplist_node_t));
+    }
+    if (arena->free_nodes != NULL) {
+        node = arena->free_nodes;
+        arena->free_nodes = node->next;
+        return node;
+    }
+    if ((size_t) (arena->end - arena->next) < arena->slot_size) {
+        // move on to a block kept from before the last dpl_clear(), or add one twice as large as the last
+        dpl_block_t *block = (arena->current != NULL) ? arena->current->next : NULL;
+        if (block == NULL) {
+            size_t size = (arena->current != NULL) ? arena->current->size * 2 : ARENA_MIN_BLOCK;
+            if (size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+            if (size < arena->slot_size) size = arena->slot_size;
+            block = malloc(ARENA_ROUND(sizeof(dpl_block_t)) + size);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->next = NULL;
+            block->size = size;
+            if (arena->current != NULL) {
+                arena->current->next = block;
+            } else {
+                arena->blocks = block;
+            }
+        }
+        arena->current = block;
+        arena->next = BLOCK_DATA(block);
+        arena->end = arena->next + block->size;
+    }
+    node = (dplist_node_t *) arena->next;
+    arena->next += arena->slot_size;
+    return node;
+}
+
+static void node_release(dplist_t *list, dplist_node_t *node) {
+    if (list->arena == NULL) {
+        free(node);
         return;
     }
+    node->next = list->arena->free_nodes;
+    list->arena->free_nodes = node;
+}
 
-    current = (*list)->head;
+static bool element_in_arena(dplist_t *list, dplist_node_t *node) {
+    return (list->arena != NULL && list->arena->element_size > 0 && node->element == NODE_ELEMENT(node)) ? true : false;
+}
 
-    while (current != NULL) {
-        next_node = current->next; // Save next node before freeing current
+// gives up 'node's element: frees it if asked and it's not stored in the arena
+static void element_release(dplist_t *list, dplist_node_t *node, bool free_element) {
+    if (element_in_arena(list, node)) {
+        return;
+    }
+    if (list->arena != NULL) {
+        list->arena->external--;
+    }
+    if (free_element) {
+        list->element_free(&(node->element));
+    }
+}
+
+void dpl_clear(dplist_t *list, bool free_element) {
+    dplist_node_t *current, *next_node;
 
-        if (free_element) {
-            // Use the callback function to free the element
-            (*list)->element_free(&(current->element));
+    if (list == NULL) {
+        return;
+    }
+    // an arena holding nothing that needs element_free() is simply rewound
+    if (list->arena == NULL || (free_element && list->arena->external > 0)) {
+        for (current = list->head; current != NULL; current = next_node) {
+            next_node = current->next;
+            element_release(list, current, free_element);
+            if (list->arena == NULL) {
+                free(current);
+            }
         }
+    }
+    list->head = NULL;
+    if (list->arena != NULL) {
+        arena_reset(list->arena);
+    }
+}
+
+void dpl_free(dplist_t **list, bool free_element) {
+
+    //TODO: add your code here
+    dpl_block_t *block, *next_block;
+
+    if (list == NULL || *list == NULL) {
+        return;
+    }
 
-        free(current);
-        current = next_node;
+    dpl_clear(*list, free_element);
+    if ((*list)->arena != NULL) {
+        for (block = (*list)->arena->blocks; block != NULL; block = next_block) {
+            next_block = block->next;
+            free(block);
+        }
+        free((*list)->arena);
     }
 
     free(*list);
@@ -82,16 +220,24 @@ dplist_t *dpl_insert_at_index(dplist_t *list, void *element, int index, bool ins
         return NULL;
     }
 
-    new_node = malloc(sizeof(dplist_node_t));
+    new_node = node_alloc(list);
     if (new_node == NULL)
     {
         return list; // Malloc failed, return original list
     }
 
-    if (insert_copy) {
-        new_node->element = list->element_copy(element);
+    if (insert_copy && list->arena != NULL && list->arena->element_size > 0) {
+        new_node->element = NODE_ELEMENT(new_node);
+        memcpy(new_node->element, element, list->arena->element_size);
     } else {
-        new_node->element = element;
+        if (insert_copy) {
+            new_node->element = list->element_copy(element);
+        } else {
+            new_node->element = element;
+        }
+        if (list->arena != NULL) {
+            list->arena->external++;
+        }
     }
     new_node->prev = NULL;
     new_node->next = NULL;
@@ -161,11 +307,8 @@ dplist_t *dpl_remove_at_index(dplist_t *list, int index, bool free_element) {
         node_to_remove->next->prev = node_to_remove->prev;
     }
 
-    if (free_element) {
-        list->element_free(&(node_to_remove->element));
-    }
-
-    free(node_to_remove);
+    element_release(list, node_to_remove, free_element);
+    node_release(list, node_to_remove);
     return list;
 }
 
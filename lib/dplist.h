@@ -5,9 +5,12 @@
 #ifndef _DPLIST_H_
 #define _DPLIST_H_
 
+#ifndef _DPL_BOOL_
+#define _DPL_BOOL_  // shared with dparray.h, so both lists can be used in one file
 typedef enum {
     false, true
 } bool; // or use C99 #include <stdbool.h>
+#endif
 
 /**
  * dplist_t is a struct containing at least a head pointer to the start of the list;
@@ -33,15 +36,44 @@ dplist_t *dpl_create(
         int (*element_compare)(void *x, void *y)
 );
 
+/** Create a list in arena mode: nodes (and copied elements) are carved from large blocks owned by the list
+ * - Inserting takes no malloc() once the blocks are warm, and dpl_clear() / dpl_free() release everything at once.
+ * - If 'element_size' > 0, inserted copies are made with a plain memcpy() of 'element_size' bytes into the node
+ *   instead of element_copy(), so only use it for elements without pointers to memory they own. Such copies are
+ *   released with the arena, element_free() is never called on them.
+ * - If 'element_size' is 0, only the nodes come from the arena and copies are made with element_copy() as usual.
+ * - Memory of removed nodes is reused by later inserts, it only goes back to the heap in dpl_free().
+ * \param element_copy callback function to duplicate 'element' (only used if 'element_size' is 0)
+ * \param element_free callback function to free memory allocated to element
+ * \param element_compare callback function to compare two element elements; returns -1 if x<y, 0 if x==y, or 1 if x>y
+ * \param element_size the size of one element for in-arena copies, or 0
+ * \return a pointer to a newly-allocated and initialized list.
+ */
+dplist_t *dpl_create_arena(
+        void* (*element_copy)(void *element),
+        void (*element_free)(void **element),
+        int (*element_compare)(void *x, void *y),
+        int element_size
+);
+
 /** Deletes all elements in the list
  * - Every list node of the list needs to be deleted. (free memory)
  * - The list itself also needs to be deleted. (free all memory)
  * - '*list' must be set to NULL.
+ * - In arena mode the blocks are freed at once, element_free() is only called on elements not stored in the arena.
  * \param list a double pointer to the list
  * \param free_element if true call element_free() on the element of the list node to remove
  */
 void dpl_free(dplist_t **list, bool free_element);
 
+/** Removes all elements from the list, the list itself stays valid and empty
+ * - In arena mode this is O(1) when no element needs element_free(): the arena is rewound and its blocks are kept
+ *   for the next inserts. Otherwise every node is visited.
+ * \param list a pointer to the list
+ * \param free_element if true call element_free() on every element that is not stored in the arena
+ */
+void dpl_clear(dplist_t *list, bool free_element);
+
 /** Returns the number of elements in the list.
  * - If 'list' is is NULL, -1 is returned.
  * \param list a pointer to the list
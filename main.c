@@ -2,134 +2,311 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <sys/types.h>
 #include <pthread.h>
 #include <time.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "config.h"
 #include "sbuffer.h"
 #include "connmgr.h"
 #include "datamgr.h"
 #include "sensor_db.h"
+#include "latency.h"
+#include "metrics.h"
+#include "ingest.h"
+#include "rollup.h"
+#include "journal.h"
+#include "store.h"
+#include "state.h"
+#include "pubsub.h"
+#include "forward.h"
+#include "dedup.h"
+#include "validate.h"
+#include "placement.h"
 
-// --- Logger Implementation ---
+static void print_usage(char *prog) {
+    fprintf(stderr, "Usage: %s <port> <max_connections> [options]\n", prog);
+    fprintf(stderr, "   or: %s --ingest-file <file> [options]\n", prog);
+    fprintf(stderr, "\t%-22s : feed a sensor_data file through the pipeline instead of listening on a port\n",
+            "--ingest-file <file>");
+    fprintf(stderr, "\t%-22s : producer threads for --ingest-file (default %d)\n", "--ingest-threads <n>",
+            INGEST_THREADS);
+    fprintf(stderr, "\t%-22s : all producers insert in one shared list instead of a queue each\n",
+            "--shared-buffer");
+    fprintf(stderr, "\t%-22s : seconds a reading may lag behind the newest one and still count in the rollups "
+            "(default %d)\n", "--rollup-lateness <s>", ROLLUP_LATENESS);
+    fprintf(stderr, "\t%-22s : journal the buffered readings in this directory and replay them after a crash\n",
+            "--journal <dir>");
+    fprintf(stderr, "\t%-22s : ms between two group syncs of the journal (default %d)\n", "--journal-sync-ms <ms>",
+            JOURNAL_SYNC_INTERVAL);
+    fprintf(stderr, "\t%-22s : store the readings as indexed segments in this directory instead of data.csv\n",
+            "--storage-dir <dir>");
+    fprintf(stderr, "\t%-22s : MiB of readings after which a new segment is started (default %ld)\n",
+            "--segment-mb <n>", STORE_SEGMENT_SIZE >> 20);
+    fprintf(stderr, "\t%-22s : seconds after which a new segment is started (default %d, 0 = no limit)\n",
+            "--segment-seconds <s>", STORE_SEGMENT_SECONDS);
+    fprintf(stderr, "\t%-22s : answer 'GET sensor <id>' and 'DUMP' with the latest sensor state on this unix "
+            "socket\n", "--state-socket <path>");
+    fprintf(stderr, "\t%-22s : stream live readings to subscribers on this TCP port\n", "--pubsub-port <port>");
+    fprintf(stderr, "\t%-22s : IPv4 address the pubsub port is bound to (default %s)\n", "--pubsub-address <ip>",
+            PUBSUB_ADDRESS);
+    fprintf(stderr, "\t%-22s : stream live readings to subscribers on this unix socket\n", "--pubsub-socket <path>");
+    fprintf(stderr, "\t%-22s : forward all readings to the gateway listening on this address\n",
+            "--forward-to <ip:port>");
+    fprintf(stderr, "\t%-22s : spool forwarded readings here while the upstream is unreachable (default %s)\n",
+            "--forward-spool <dir>", FORWARD_SPOOL_DIR);
+    fprintf(stderr, "\t%-22s : drop readings a sensor or forwarder sends again, e.g. after a reconnect\n",
+            "--dedup");
+    fprintf(stderr, "\t%-22s : drop or tag implausible readings (range, timestamp, rate of change, validate.h)\n",
+            "--validate <drop|tag>");
+    fprintf(stderr, "\t%-22s : largest change per second of a sensor's value (default %.1f, 0 = no limit)\n",
+            "--validate-max-step <v>", VALIDATE_MAX_STEP);
+    fprintf(stderr, "\t%-22s : run the io (connections, ingest), datamgr or storage threads on these CPUs "
+            "(\"0-3,6\" or \"node1\")\n", "--pin <role>=<cpus>");
+    fprintf(stderr, "\t%-22s : stack size of the threads of a role (default io=%d, others system default)\n",
+            "--stack-kb <role>=<kb>", PLACEMENT_IO_STACK / 1024);
+    fprintf(stderr, "\t%-22s : handle the connections as coroutines on n threads instead of a thread each\n",
+            "--coro-threads <n>");
+    fprintf(stderr, "\t%-22s : serve Prometheus-style metrics on 127.0.0.1:port (default %d, 0 = off)\n",
+            "--metrics-port <port>", METRICS_PORT);
+}
 
-static int log_pipe_fd[2];
-static pid_t logger_pid = 0;
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+            {"metrics-port", required_argument, NULL, 'm'},
+            {"ingest-file", required_argument, NULL, 'i'},
+            {"ingest-threads", required_argument, NULL, 't'},
+            {"shared-buffer", no_argument, NULL, 's'},
+            {"rollup-lateness", required_argument, NULL, 'r'},
+            {"journal", required_argument, NULL, 'j'},
+            {"journal-sync-ms", required_argument, NULL, 'y'},
+            {"storage-dir", required_argument, NULL, 'd'},
+            {"segment-mb", required_argument, NULL, 'b'},
+            {"segment-seconds", required_argument, NULL, 'a'},
+            {"state-socket", required_argument, NULL, 'u'},
+            {"pubsub-port", required_argument, NULL, 'p'},
+            {"pubsub-socket", required_argument, NULL, 'q'},
+            {"pubsub-address", required_argument, NULL, 'l'},
+            {"forward-to", required_argument, NULL, 'f'},
+            {"forward-spool", required_argument, NULL, 'g'},
+            {"dedup", no_argument, NULL, 'e'},
+            {"validate", required_argument, NULL, 'v'},
+            {"validate-max-step", required_argument, NULL, 'w'},
+            {"pin", required_argument, NULL, 'c'},
+            {"stack-kb", required_argument, NULL, 'k'},
+            {"coro-threads", required_argument, NULL, 'x'},
+            {NULL, 0, NULL, 0}
+    };
+    int metrics_port = METRICS_PORT;
+    char *ingest_path = NULL;
+    int ingest_threads = INGEST_THREADS;
+    int shared_buffer = 0;
+    int rollup_lateness = ROLLUP_LATENESS;
+    char *journal_dir = NULL;
+    int journal_sync_ms = JOURNAL_SYNC_INTERVAL;
+    char *store_dir = NULL;
+    long store_segment_size = STORE_SEGMENT_SIZE;
+    int store_segment_seconds = STORE_SEGMENT_SECONDS;
+    storage_args_t storage_args = {.store = NULL, .csv_file = NULL};
+    char *state_socket = NULL;
+    int dedup = 0;
+    validate_mode_t validate = VALIDATE_OFF;
+    double validate_max_step = VALIDATE_MAX_STEP;
+    pubsub_args_t pubsub_args = {.port = 0, .address = NULL, .socket_path = NULL};
+    forward_args_t forward_args = {.upstream = NULL, .spool_dir = FORWARD_SPOOL_DIR};
+    int port = 0, max_conn = 0;
+    int placed = 0;
+    int coro_threads = 0;
+    int opt;
 
-void logger_loop(int read_fd) {
-    FILE *log_file = fopen("gateway.log", "w"); // Req 8: create new empty file
-    if (log_file == NULL) {
-        perror("Logger: Failed to open gateway.log");
-        exit(EXIT_FAILURE);
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm': metrics_port = atoi(optarg); break;
+            case 'i': ingest_path = optarg; break;
+            case 't': ingest_threads = atoi(optarg); break;
+            case 's': shared_buffer = 1; break;
+            case 'r': rollup_lateness = atoi(optarg); break;
+            case 'j': journal_dir = optarg; break;
+            case 'y': journal_sync_ms = atoi(optarg); break;
+            case 'd': store_dir = optarg; break;
+            case 'b': store_segment_size = atol(optarg) << 20; break;
+            case 'a': store_segment_seconds = atoi(optarg); break;
+            case 'u': state_socket = optarg; break;
+            case 'p': pubsub_args.port = atoi(optarg); break;
+            case 'q': pubsub_args.socket_path = optarg; break;
+            case 'l': pubsub_args.address = optarg; break;
+            case 'f': forward_args.upstream = optarg; break;
+            case 'g': forward_args.spool_dir = optarg; break;
+            case 'e': dedup = 1; break;
+            case 'v':
+                if (strcmp(optarg, "drop") == 0) validate = VALIDATE_DROP;
+                else if (strcmp(optarg, "tag") == 0) validate = VALIDATE_TAG;
+                else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w': validate_max_step = atof(optarg); break;
+            case 'x': coro_threads = atoi(optarg); break;
+            case 'c':
+            case 'k':
+                if ((opt == 'c' ? placement_pin(optarg) : placement_stack(optarg)) != 0) {
+                    fprintf(stderr, "Invalid thread placement '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                placed = 1;
+                break;
+            default: print_usage(argv[0]); exit(EXIT_FAILURE);
+        }
     }
-
-    FILE *pipe_stream = fdopen(read_fd, "r");
-    if (pipe_stream == NULL) {
-        perror("Logger: fdopen failed");
-        fclose(log_file);
+    if (argc - optind != (ingest_path == NULL ? 2 : 0)) {
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-
-    char buffer[256];
-    int sequence_num = 0;
-
-    while (fgets(buffer, sizeof(buffer), pipe_stream) != NULL) {
-        buffer[strcspn(buffer, "\n")] = 0;
-
-        time_t now;
-        time(&now);
-        char *time_str = ctime(&now);
-        time_str[strcspn(time_str, "\n")] = 0;
-
-        // Req 8: Format <sequence number> <timestamp> <log-event info message>
-        fprintf(log_file, "%d %s %s\n", sequence_num++, time_str, buffer);
-        fflush(log_file);
+    if (ingest_path == NULL) {
+        port = atoi(argv[optind]);
+        max_conn = atoi(argv[optind + 1]);
     }
 
-    fclose(pipe_stream);
-    fclose(log_file);
-    exit(EXIT_SUCCESS);
-}
+    sbuffer_t *sbuf;
+    uint64_t start_ns = latency_now();
+    long ingested = 0;
+    pthread_t datamgr_thread, storagemgr_thread, rollup_thread, pubsub_thread, forward_thread;
+    rollup_args_t rollup_args;
 
-int create_log_process() {
-    if (pipe(log_pipe_fd) == -1) {
-        perror("Pipe creation failed");
-        return -1;
-    }
-    logger_pid = fork();
-    if (logger_pid < 0) {
-        perror("Fork failed");
-        return -1;
-    }
-    if (logger_pid == 0) {
-        close(log_pipe_fd[1]);
-        logger_loop(log_pipe_fd[0]);
-        exit(0);
-    } else {
-        close(log_pipe_fd[0]);
-        return 0;
+    if (create_log_process() != 0) {
+        fprintf(stderr, "Failed to create log process\n");
+        exit(EXIT_FAILURE);
     }
-}
 
-int end_log_process() {
-    if (logger_pid <= 0) return -1;
-    close(log_pipe_fd[1]);
-    waitpid(logger_pid, NULL, 0);
-    logger_pid = 0;
-    return 0;
-}
-
-int write_to_log_process(char *msg) {
-    if (logger_pid <= 0) return -1;
-    char buffer[300];
-    snprintf(buffer, sizeof(buffer), "%s\n", msg);
-    if (write(log_pipe_fd[1], buffer, strlen(buffer)) == -1) return -1;
-    return 0;
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <max_connections>\n", argv[0]);
+    // one queue per connection or ingest thread, so producers never contend with each other
+    int max_queues = shared_buffer ? 0 : (ingest_path != NULL) ? ingest_threads : max_conn;
+    if (sbuffer_init_queues(&sbuf, max_queues) != SBUFFER_SUCCESS) {
+        fprintf(stderr, "Failed to init sbuffer\n");
+        end_log_process();
         exit(EXIT_FAILURE);
     }
+    // pubsub and forward only read the buffer when they are configured, so they don't hold back its recycling
+    int pubsub_on = pubsub_args.port > 0 || pubsub_args.socket_path != NULL;
+    int forward_on = forward_args.upstream != NULL;
+    sbuffer_set_readers(sbuf, (1 << READER_DATAMGR) | (1 << READER_STORAGEMGR) | (1 << READER_ROLLUP) |
+                              (pubsub_on << READER_PUBSUB) | (forward_on << READER_FORWARD));
 
-    int port = atoi(argv[1]);
-    int max_conn = atoi(argv[2]);
-    sbuffer_t *sbuf;
-    pthread_t datamgr_thread, storagemgr_thread;
+    // before data.csv is opened, it is appended to when there is a journal
+    if (journal_dir != NULL && journal_open(journal_dir, journal_sync_ms) != 0) {
+        fprintf(stderr, "Failed to open the journal in %s\n", journal_dir);
+        sbuffer_free(&sbuf);
+        end_log_process();
+        exit(EXIT_FAILURE);
+    }
 
-    if (create_log_process() != 0) {
-        fprintf(stderr, "Failed to create log process\n");
+    // a store that fails to open is a startup error too: a journal could never release the readings it misses
+    if (store_dir != NULL &&
+        (storage_args.store = store_open(store_dir, store_segment_size, store_segment_seconds)) == NULL) {
+        fprintf(stderr, "Failed to open the segment store in %s\n", store_dir);
+        journal_close();
+        sbuffer_free(&sbuf);
+        end_log_process();
         exit(EXIT_FAILURE);
     }
 
-    if (sbuffer_init(&sbuf) != SBUFFER_SUCCESS) {
-        fprintf(stderr, "Failed to init sbuffer\n");
+    // same for data.csv: the producers would fill their bounded queues and wait forever for a reader that quit.
+    // With a journal, readings replayed after a crash continue the file of the previous run.
+    if (store_dir == NULL && (storage_args.csv_file = fopen("data.csv", journal_active() ? "a" : "w")) == NULL) {
+        fprintf(stderr, "Failed to open data.csv\n");
+        journal_close();
+        sbuffer_free(&sbuf);
         end_log_process();
         exit(EXIT_FAILURE);
     }
 
+    // the table is cheap to keep up, so the datamgr always publishes; the socket is optional
+    if (state_init() != 0) {
+        fprintf(stderr, "Failed to allocate the sensor state table\n");
+    } else if (state_socket != NULL && state_start_server(state_socket) != 0) {
+        fprintf(stderr, "Failed to start the state server on %s\n", state_socket);
+    }
+
+    if (dedup && dedup_init() != 0) {
+        fprintf(stderr, "Failed to allocate the dedup table, duplicates are kept\n");
+    }
+
+    if (validate != VALIDATE_OFF && validate_init(validate, validate_max_step) != 0) {
+        fprintf(stderr, "Failed to allocate the validation table, readings are not validated\n");
+    }
+
+    if (metrics_port > 0 && metrics_start_server(metrics_port) != 0) {
+        fprintf(stderr, "Failed to start metrics server on port %d\n", metrics_port);
+    }
 
-    if (pthread_create(&datamgr_thread, NULL, datamgr_run, sbuf) != 0) {
+    if (latency_start_reporter(LATENCY_DUMP_INTERVAL) != 0) {
+        fprintf(stderr, "Failed to start latency reporter\n");
+    }
+
+    for (int role = 0; placed && role < PLACEMENT_NUM_ROLES; role++) {
+        char where[96], log_msg[128];
+        placement_describe(role, where, sizeof(where));
+        snprintf(log_msg, sizeof(log_msg), "Thread placement %s", where);
+        write_to_log_process(log_msg);
+    }
+    if (placement_create(&datamgr_thread, PLACEMENT_DATAMGR, datamgr_run, sbuf) != 0) {
         fprintf(stderr, "Failed to create datamgr thread\n");
         // Cleanup...
     }
-    if (pthread_create(&storagemgr_thread, NULL, storage_mgr_run, sbuf) != 0) {
+    storage_args.buffer = sbuf;
+    if (placement_create(&storagemgr_thread, PLACEMENT_STORAGE, storage_mgr_run, &storage_args) != 0) {
         fprintf(stderr, "Failed to create storagemgr thread\n");
         // Cleanup...
     }
+    rollup_args.buffer = sbuf;
+    rollup_args.lateness = rollup_lateness;
+    if (pthread_create(&rollup_thread, NULL, rollup_run, &rollup_args) != 0) {
+        fprintf(stderr, "Failed to create rollup thread\n");
+        // Cleanup...
+    }
+    pubsub_args.buffer = sbuf;
+    if (pubsub_on && pthread_create(&pubsub_thread, NULL, pubsub_run, &pubsub_args) != 0) {
+        fprintf(stderr, "Failed to create pubsub thread\n");
+        // Cleanup...
+    }
+    forward_args.buffer = sbuf;
+    if (forward_on && pthread_create(&forward_thread, NULL, forward_run, &forward_args) != 0) {
+        fprintf(stderr, "Failed to create forward thread\n");
+        // Cleanup...
+    }
+
+    // readings a previous run buffered but never wrote to data.csv go first
+    journal_replay(sbuf);
 
-    connmgr_listen(port, max_conn, sbuf);
+    if (ingest_path != NULL) {
+        ingested = ingest_file(ingest_path, ingest_threads, sbuf);
+        if (ingested < 0) fprintf(stderr, "Failed to ingest %s\n", ingest_path);
+    } else {
+        connmgr_listen(port, max_conn, sbuf, coro_threads);
+    }
 
-    sensor_data_t end_marker;
+    sensor_record_t end_marker;
     end_marker.id = 0;
     sbuffer_insert(sbuf, &end_marker);
 
     pthread_join(datamgr_thread, NULL);
     pthread_join(storagemgr_thread, NULL);
+    pthread_join(rollup_thread, NULL);
+    if (pubsub_on) pthread_join(pubsub_thread, NULL);
+    if (forward_on) pthread_join(forward_thread, NULL);
+    journal_close();
+    if (ingested > 0) {
+        // the readers are done as well, so this is the throughput of the whole pipeline
+        double elapsed = (latency_now() - start_ns) / 1e9;
+        printf("Ingested %ld records in %.3f s (%.0f records/s)\n", ingested, elapsed, ingested / elapsed);
+    }
+    latency_stop_reporter();
+    metrics_stop_server();
+    state_stop();
+    dedup_free();
+    validate_free();
 
     sbuffer_free(&sbuf);
     end_log_process();
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "config.h"
+
+#define CACHE_LINE_SIZE 64
+#define RESPONSE_SIZE   8192
+
+typedef struct metrics_slot {
+    // only the owning thread writes, so relaxed load + store is enough
+    _Atomic uint64_t counters[METRIC_NUM_COUNTERS];
+    struct metrics_slot *next;  // registry link, protected by registry_mutex
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_slot_t;
+
+static const char *reader_names[SBUFFER_NUM_READERS] = {"datamgr", "storagemgr", "rollup", "pubsub", "forward"};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_slot_t *registry = NULL;
+static uint64_t retired[METRIC_NUM_COUNTERS];   // slots of threads that already exited
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local metrics_slot_t *local = NULL;
+
+static int server_sd = -1;
+static pthread_t server_thread;
+
+// pthread key destructor: fold the slot of an exiting thread into the retired totals
+static void slot_exit(void *arg) {
+    metrics_slot_t *slot = (metrics_slot_t *) arg, **pp;
+    pthread_mutex_lock(&registry_mutex);
+    for (int c = 0; c < METRIC_NUM_COUNTERS; c++) {
+        retired[c] += atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+    }
+    for (pp = &registry; *pp != slot; pp = &(*pp)->next);
+    *pp = slot->next;
+    pthread_mutex_unlock(&registry_mutex);
+    free(slot);
+}
+
+static void make_key(void) {
+    pthread_key_create(&slot_key, slot_exit);
+}
+
+static metrics_slot_t *register_slot(void) {
+    metrics_slot_t *slot = aligned_alloc(CACHE_LINE_SIZE, sizeof(metrics_slot_t));
+    if (slot == NULL) return NULL;
+    memset(slot, 0, sizeof(metrics_slot_t));
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(slot_key, slot);
+    pthread_mutex_lock(&registry_mutex);
+    slot->next = registry;
+    registry = slot;
+    pthread_mutex_unlock(&registry_mutex);
+    local = slot;
+    return slot;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t n) {
+    metrics_slot_t *slot = local;
+    if (slot == NULL && (slot = register_slot()) == NULL) return;
+    _Atomic uint64_t *c = &slot->counters[counter];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t metrics_get(metric_counter_t counter) {
+    uint64_t sum;
+    pthread_mutex_lock(&registry_mutex);
+    sum = retired[counter];
+    for (metrics_slot_t *slot = registry; slot != NULL; slot = slot->next) {
+        sum += atomic_load_explicit(&slot->counters[counter], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return sum;
+}
+
+// counters are read one after the other while threads keep counting, so a difference may briefly go negative
+#define GAUGE(added, removed) ((added) > (removed) ? (added) - (removed) : 0)
+
+#define APPEND(...) do {                                                    \
+        if (len < size) len += snprintf(buf + len, size - len, __VA_ARGS__);  \
+    } while (0)
+
+#define APPEND_METRIC(name, type, help, value) do {                         \
+        APPEND("# HELP sensor_gateway_%s %s\n", (name), (help));           \
+        APPEND("# TYPE sensor_gateway_%s %s\n", (name), (type));           \
+        APPEND("sensor_gateway_%s %llu\n", (name), (unsigned long long) (value)); \
+    } while (0)
+
+int metrics_format(char *buf, int size) {
+    uint64_t v[METRIC_NUM_COUNTERS];
+    int len = 0, r;
+
+    pthread_mutex_lock(&registry_mutex);
+    for (int c = 0; c < METRIC_NUM_COUNTERS; c++) {
+        v[c] = retired[c];
+        for (metrics_slot_t *slot = registry; slot != NULL; slot = slot->next) {
+            v[c] += atomic_load_explicit(&slot->counters[c], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    APPEND_METRIC("records_received_total", "counter", "Readings received from sensor nodes.",
+                  v[METRIC_RECORDS_RECEIVED]);
+    APPEND_METRIC("bytes_received_total", "counter", "Payload bytes received from sensor nodes.",
+                  v[METRIC_BYTES_RECEIVED]);
+    APPEND_METRIC("records_inserted_total", "counter", "Readings inserted in the sbuffer.",
+                  v[METRIC_RECORDS_INSERTED]);
+    APPEND_METRIC("records_dropped_total", "counter", "Readings that did not reach the sbuffer.",
+                  v[METRIC_RECORDS_DROPPED]);
+    APPEND_METRIC("records_duplicate_total", "counter", "Readings dropped as duplicates before the sbuffer.",
+                  v[METRIC_RECORDS_DUPLICATE]);
+    APPEND_METRIC("records_invalid_total", "counter", "Readings that failed validation, dropped or tagged.",
+                  v[METRIC_RECORDS_INVALID]);
+    APPEND("# HELP sensor_gateway_records_removed_total Readings consumed from the sbuffer per reader.\n");
+    APPEND("# TYPE sensor_gateway_records_removed_total counter\n");
+    for (r = 0; r < SBUFFER_NUM_READERS; r++) {
+        APPEND("sensor_gateway_records_removed_total{reader=\"%s\"} %llu\n", reader_names[r],
+               (unsigned long long) v[METRIC_RECORDS_REMOVED + r]);
+    }
+    APPEND("# HELP sensor_gateway_sbuffer_depth Readings in the sbuffer not yet consumed per reader.\n");
+    APPEND("# TYPE sensor_gateway_sbuffer_depth gauge\n");
+    for (r = 0; r < SBUFFER_NUM_READERS; r++) {
+        APPEND("sensor_gateway_sbuffer_depth{reader=\"%s\"} %llu\n", reader_names[r],
+               (unsigned long long) GAUGE(v[METRIC_RECORDS_INSERTED], v[METRIC_RECORDS_REMOVED + r]));
+    }
+    APPEND_METRIC("csv_flushes_total", "counter", "Flushes of data.csv.", v[METRIC_CSV_FLUSHES]);
+    APPEND_METRIC("log_messages_total", "counter", "Messages written to the log process.",
+                  v[METRIC_LOG_MESSAGES]);
+    APPEND_METRIC("log_queue_bytes", "gauge", "Bytes waiting in the pipe to the log process.",
+                  log_process_queue_depth());
+    APPEND_METRIC("connections_opened_total", "counter", "Sensor node connections accepted.",
+                  v[METRIC_CONNECTIONS_OPENED]);
+    APPEND_METRIC("active_connections", "gauge", "Sensor node connections currently open.",
+                  GAUGE(v[METRIC_CONNECTIONS_OPENED], v[METRIC_CONNECTIONS_CLOSED]));
+    APPEND_METRIC("silent_sensors_total", "counter", "Times a sensor was reported silent.",
+                  v[METRIC_SENSORS_SILENT]);
+    APPEND_METRIC("journal_syncs_total", "counter", "Group syncs of the journal.", v[METRIC_JOURNAL_SYNCS]);
+    APPEND_METRIC("journal_replayed_total", "counter", "Readings replayed from the journal at startup.",
+                  v[METRIC_JOURNAL_REPLAYED]);
+    APPEND_METRIC("rollup_windows_total", "counter", "Minute and hour rollup windows written.",
+                  v[METRIC_ROLLUP_WINDOWS]);
+    APPEND_METRIC("rollup_late_total", "counter", "Readings dropped from rollups because their window had closed.",
+                  v[METRIC_ROLLUP_LATE]);
+    APPEND_METRIC("store_blocks_total", "counter", "Blocks written to the segment store.", v[METRIC_STORE_BLOCKS]);
+    APPEND_METRIC("store_segments_total", "counter", "Segments started in the segment store.",
+                  v[METRIC_STORE_SEGMENTS]);
+    APPEND_METRIC("pubsub_sent_total", "counter", "Readings sent to pubsub subscribers.", v[METRIC_PUBSUB_SENT]);
+    APPEND_METRIC("pubsub_evicted_total", "counter", "Pubsub subscribers evicted because their queue overflowed.",
+                  v[METRIC_PUBSUB_EVICTED]);
+    APPEND_METRIC("forward_records_total", "counter", "Readings acknowledged by the upstream gateway.",
+                  v[METRIC_FORWARD_RECORDS]);
+    APPEND_METRIC("forward_bytes_total", "counter", "Frame bytes sent to the upstream gateway.",
+                  v[METRIC_FORWARD_BYTES]);
+    APPEND_METRIC("forward_spooled_total", "counter", "Readings spooled while the upstream gateway was unreachable.",
+                  v[METRIC_FORWARD_SPOOLED]);
+    return (len < size) ? len : size - 1;
+}
+
+static void *server_run(void *arg) {
+    char *response = malloc(RESPONSE_SIZE);
+    char request[1024];
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 200000};
+    int client, header_len, body_len;
+
+    if (response == NULL) return NULL;
+    while ((client = accept(server_sd, NULL, NULL)) >= 0) {
+        // the request itself is not interpreted: every path returns all metrics
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // a bare connect (e.g. 'nc') just times out here and is answered as well
+        recv(client, request, sizeof(request), 0);
+        header_len = snprintf(response, RESPONSE_SIZE,
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        body_len = metrics_format(response + header_len, RESPONSE_SIZE - header_len);
+        send(client, response, header_len + body_len, MSG_NOSIGNAL);
+        close(client);
+    }
+    free(response);
+    return NULL;
+}
+
+int metrics_start_server(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    server_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server_sd < 0) return -1;
+    setsockopt(server_sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server_sd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(server_sd, 8) != 0 ||
+        pthread_create(&server_thread, NULL, server_run, NULL) != 0) {
+        close(server_sd);
+        server_sd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop_server(void) {
+    if (server_sd < 0) return;
+    // shutdown() wakes up the blocking accept() in the server thread
+    shutdown(server_sd, SHUT_RDWR);
+    pthread_join(server_thread, NULL);
+    close(server_sd);
+    server_sd = -1;
+}
@@ -0,0 +1,66 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include "sbuffer.h"
+
+/*
+ * Live operational counters of the gateway.
+ * Every thread adds to its own cache-line-padded slot, so counting takes no lock and causes no false sharing.
+ * Slots are only summed when the counters are read, e.g. by the localhost metrics server.
+ */
+
+#ifndef METRICS_PORT
+#define METRICS_PORT 0      // default port of the metrics server, 0 = disabled
+#endif
+
+typedef enum {
+    METRIC_RECORDS_RECEIVED,            // readings received from sensor nodes
+    METRIC_BYTES_RECEIVED,              // payload bytes of those readings
+    METRIC_RECORDS_INSERTED,            // readings inserted in the sbuffer
+    METRIC_RECORDS_REMOVED,             // readings removed from the sbuffer, one counter per reader id
+    METRIC_RECORDS_DROPPED = METRIC_RECORDS_REMOVED + SBUFFER_NUM_READERS,  // readings that never reached the sbuffer
+    METRIC_RECORDS_DUPLICATE,           // readings dropped as duplicates at the receiving edge (dedup.h)
+    METRIC_RECORDS_INVALID,             // readings that failed validation, dropped or tagged (validate.h)
+    METRIC_CSV_FLUSHES,                 // fflush() calls on data.csv
+    METRIC_LOG_MESSAGES,                // messages written to the log process
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_SENSORS_SILENT,              // sensors reported silent by the datamgr
+    METRIC_JOURNAL_SYNCS,               // group syncs of the journal
+    METRIC_JOURNAL_REPLAYED,            // readings replayed from the journal at startup
+    METRIC_ROLLUP_WINDOWS,              // minute and hour windows written by the rollup reader
+    METRIC_ROLLUP_LATE,                 // readings too late for a rollup window that was already closed
+    METRIC_STORE_BLOCKS,                // blocks written to the segment store
+    METRIC_STORE_SEGMENTS,              // store segments started
+    METRIC_PUBSUB_SENT,                 // readings sent to pubsub subscribers
+    METRIC_PUBSUB_EVICTED,              // pubsub subscribers evicted for falling behind
+    METRIC_FORWARD_RECORDS,             // readings acknowledged by the upstream gateway
+    METRIC_FORWARD_BYTES,               // frame bytes sent upstream, spool replays included
+    METRIC_FORWARD_SPOOLED,             // readings written to the forward spool
+    METRIC_NUM_COUNTERS
+} metric_counter_t;
+
+/** Adds 'n' to 'counter' in the slot of the calling thread
+ * - The first call of a thread allocates and registers its slot, later calls are lock-free.
+ * - When the thread exits, its slot is folded into the totals automatically.
+ */
+void metrics_add(metric_counter_t counter, uint64_t n);
+
+/** Returns the sum of 'counter' over all slots */
+uint64_t metrics_get(metric_counter_t counter);
+
+/** Writes all counters and gauges in the Prometheus text exposition format to 'buf'
+ * \return the number of characters written (at most 'size' - 1)
+ */
+int metrics_format(char *buf, int size);
+
+/** Starts a thread serving metrics_format() over HTTP on 127.0.0.1:'port'
+ * \return 0 on success, -1 if the socket or thread could not be set up
+ */
+int metrics_start_server(int port);
+
+/** Stops the metrics server thread (if started) */
+void metrics_stop_server(void);
+
+#endif /* _METRICS_H_ */
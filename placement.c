@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+
+#include "placement.h"
+#include "config.h"
+
+static const char *role_names[PLACEMENT_NUM_ROLES] = {"io", "datamgr", "storage"};
+
+typedef struct {
+    int pinned;
+    cpu_set_t cpus;
+    char where[64];             // the CPU list or node as given, for placement_describe()
+    size_t stack;               // bytes, 0 = system default
+    int warned;                 // the pinning failure was logged
+} placement_t;
+
+static placement_t roles[PLACEMENT_NUM_ROLES] = {[PLACEMENT_IO] = {.stack = PLACEMENT_IO_STACK}};
+
+// "<role>=<rest>": returns the role and points 'rest' after the '=', -1 if the role is unknown
+static int parse_role(const char *spec, const char **rest) {
+    const char *eq = strchr(spec, '=');
+
+    if (eq == NULL) return -1;
+    for (int r = 0; r < PLACEMENT_NUM_ROLES; r++) {
+        if (strlen(role_names[r]) == (size_t) (eq - spec) && strncmp(spec, role_names[r], eq - spec) == 0) {
+            *rest = eq + 1;
+            return r;
+        }
+    }
+    return -1;
+}
+
+// a CPU list in the kernel's format, "0-3,6,8-9"
+static int parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (1) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+
+        if (end == list || first < 0) return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*end != ',') return (*end == '\0' || *end == '\n') ? 0 : -1;
+        list = end + 1;
+    }
+}
+
+static int parse_node(const char *node, cpu_set_t *set) {
+    char path[64], list[1024];
+    char *end;
+    long id = strtol(node, &end, 10);
+    FILE *fp;
+    int result = -1;
+
+    if (end == node || *end != '\0' || id < 0) return -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", id);
+    if ((fp = fopen(path, "r")) == NULL) return -1;
+    if (fgets(list, sizeof(list), fp) != NULL) result = parse_cpus(list, set);
+    fclose(fp);
+    return result;
+}
+
+int placement_pin(const char *spec) {
+    const char *where;
+    int role = parse_role(spec, &where);
+    cpu_set_t set, allowed;
+
+    if (role < 0) return -1;
+    if (strncmp(where, "node", 4) == 0 ? parse_node(where + 4, &set) : parse_cpus(where, &set)) return -1;
+    // CPUs outside the process' own mask (taskset, cgroups) or offline would make pthread_create() fail
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) CPU_AND(&set, &set, &allowed);
+    if (CPU_COUNT(&set) == 0) return -1;
+
+    roles[role].pinned = 1;
+    roles[role].cpus = set;
+    snprintf(roles[role].where, sizeof(roles[role].where), "%s", where);
+    return 0;
+}
+
+int placement_stack(const char *spec) {
+    const char *kb;
+    int role = parse_role(spec, &kb);
+    char *end;
+    long value;
+
+    if (role < 0) return -1;
+    value = strtol(kb, &end, 10);
+    if (end == kb || *end != '\0' || value < 0 || value > (1L << 30)) return -1;
+    roles[role].stack = (size_t) value * 1024;
+    return 0;
+}
+
+static void init_attr(pthread_attr_t *attr, const placement_t *p, int pin) {
+    pthread_attr_init(attr);
+    if (p->stack > 0) pthread_attr_setstacksize(attr, (p->stack < PTHREAD_STACK_MIN) ? PTHREAD_STACK_MIN : p->stack);
+    if (pin && p->pinned) pthread_attr_setaffinity_np(attr, sizeof(p->cpus), &p->cpus);
+}
+
+int placement_create(pthread_t *thread, placement_role_t role, void *(*start)(void *), void *arg) {
+    placement_t *p = &roles[role];
+    pthread_attr_t attr;
+    char log_msg[160];
+    int result;
+
+    if (!p->pinned && p->stack == 0) return pthread_create(thread, NULL, start, arg);
+    init_attr(&attr, p, 1);
+    result = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    if (result == EINVAL && p->pinned) {
+        if (!p->warned) {
+            snprintf(log_msg, sizeof(log_msg), "Error: Could not pin the %s threads to %s, they run unpinned",
+                     role_names[role], p->where);
+            write_to_log_process(log_msg);
+            p->warned = 1;
+        }
+        init_attr(&attr, p, 0);
+        result = pthread_create(thread, &attr, start, arg);
+        pthread_attr_destroy(&attr);
+    }
+    return result;
+}
+
+void placement_describe(placement_role_t role, char *buf, size_t size) {
+    placement_t *p = &roles[role];
+    char stack[32];
+
+    if (p->stack > 0) snprintf(stack, sizeof(stack), "%zuk", p->stack / 1024);
+    else snprintf(stack, sizeof(stack), "default");
+    snprintf(buf, size, "%s: cpus=%s stack=%s", role_names[role], p->pinned ? p->where : "any", stack);
+}
+
+void placement_reset(void) {
+    for (int r = 0; r < PLACEMENT_NUM_ROLES; r++) {
+        roles[r] = (placement_t) {.stack = (r == PLACEMENT_IO) ? PLACEMENT_IO_STACK : 0};
+    }
+}
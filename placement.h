@@ -0,0 +1,52 @@
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Thread placement: which CPUs the gateway threads may run on and how large their stacks are.
+ * - Threads come in roles: the I/O threads (a connection handler per sensor node, the ingest producers), the
+ *   datamgr and the storage manager. Each role can be pinned (--pin <role>=<cpus>) to a CPU list like
+ *   "0-3,6" or to the CPUs of a NUMA node, "node1". Memory is allocated on first touch, so a pinned thread
+ *   gets its stack and buffers from its own node as well.
+ * - Pinning the datamgr and the storage manager next to the producers keeps the sbuffer handoff within one
+ *   cache (or one node); pinning them away from the I/O threads keeps socket work from disturbing them.
+ * - Stacks (--stack-kb <role>=<kb>) default to PLACEMENT_IO_STACK for the I/O threads instead of the 8 MB
+ *   of the system default, which is reserved per connection; the other roles keep the system default.
+ * Without --pin the scheduler places the threads, as before.
+ */
+
+#ifndef PLACEMENT_IO_STACK
+#define PLACEMENT_IO_STACK (256 * 1024)     // bytes of stack per I/O thread, 0 = system default
+#endif
+
+typedef enum {
+    PLACEMENT_IO = 0,
+    PLACEMENT_DATAMGR,
+    PLACEMENT_STORAGE,
+    PLACEMENT_NUM_ROLES
+} placement_role_t;
+
+/** Parses "<role>=<cpus>" (--pin), with <role> io, datamgr or storage and <cpus> a CPU list or "node<N>"
+ * \return 0 on success, -1 if the spec is malformed or none of its CPUs is available to the process
+ */
+int placement_pin(const char *spec);
+
+/** Parses "<role>=<kb>" (--stack-kb), 0 kb = system default
+ * \return 0 on success, -1 if the spec is malformed
+ */
+int placement_stack(const char *spec);
+
+/** Like pthread_create(), with the CPUs and stack size of 'role'
+ * - If the CPUs can't be used (e.g. one went offline), the thread is created unpinned and that is logged.
+ */
+int placement_create(pthread_t *thread, placement_role_t role, void *(*start)(void *), void *arg);
+
+/** Writes the placement of 'role' in 'buf', e.g. "io: cpus=0-3 stack=256k" */
+void placement_describe(placement_role_t role, char *buf, size_t size);
+
+/** Forgets every --pin and --stack-kb, for benchmarks that try several placements */
+void placement_reset(void);
+
+#endif /* _PLACEMENT_H_ */
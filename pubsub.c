@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pubsub.h"
+#include "datamgr.h"
+#include "latency.h"
+#include "metrics.h"
+
+// one reading on the wire: <sensor_id><value><timestamp>, packed like sensor_node sends it
+#define WIRE_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define QUEUE_BYTES ((size_t) PUBSUB_QUEUE_RECORDS * WIRE_SIZE)
+#define COMMAND_SIZE 64
+#define FLUSH_INTERVAL_NS ((uint64_t) PUBSUB_FLUSH_INTERVAL * 1000000ull)
+
+typedef struct {
+    int fd;
+    int id;                     // for the log
+    int all;                    // subscribed to every sensor
+    int closing;                // evicted or gone, removed at the end of the service round
+    uint8_t sensors[NUM_SENSOR_IDS / 8];   // bitmap of the subscribed sensor ids
+    char *queue;                // ring of QUEUE_BYTES bytes waiting for send()
+    size_t head, len;
+    char command[COMMAND_SIZE];
+    int command_len;
+} subscriber_t;
+
+typedef struct {
+    int listen_fds[2];          // TCP and unix socket, -1 if not used
+    const char *socket_path;
+    subscriber_t *subscribers[PUBSUB_MAX_SUBSCRIBERS];
+    int num_subscribers;
+    int next_id;
+    uint16_t room_of[NUM_SENSOR_IDS];      // room of every sensor in room_sensor.map, 0 if unmapped
+} pubsub_t;
+
+static int listen_tcp(const char *address, int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    int one = 1, fd;
+
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) return -1;
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void load_rooms(pubsub_t *pubsub) {
+    dparray_t *map = datamgr_load_map("room_sensor.map");
+    if (map == NULL) return;
+    dpa_iterator_t it = dpa_iterator(map);
+    for (my_element_t *sensor; (sensor = dpa_iterator_next(&it)) != NULL;) {
+        pubsub->room_of[sensor->sensor_id] = sensor->room_id;
+    }
+    dpa_free(&map, true);
+}
+
+static void close_subscriber(subscriber_t *sub, const char *reason) {
+    char log_msg[128];
+    if (sub->closing) return;
+    sub->closing = 1;
+    snprintf(log_msg, sizeof(log_msg), "Subscriber %d %s", sub->id, reason);
+    write_to_log_process(log_msg);
+}
+
+static void accept_subscriber(pubsub_t *pubsub, int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    subscriber_t *sub;
+    char log_msg[64];
+
+    if (fd < 0) return;
+    if (pubsub->num_subscribers == PUBSUB_MAX_SUBSCRIBERS || (sub = calloc(1, sizeof(subscriber_t))) == NULL) {
+        close(fd);
+        return;
+    }
+    sub->queue = malloc(QUEUE_BYTES);
+    if (sub->queue == NULL) {
+        free(sub);
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    sub->fd = fd;
+    sub->id = ++pubsub->next_id;
+    pubsub->subscribers[pubsub->num_subscribers++] = sub;
+    snprintf(log_msg, sizeof(log_msg), "Subscriber %d connected", sub->id);
+    write_to_log_process(log_msg);
+}
+
+// one filter line: "sensor <id>", "room <id>" or "all"
+static int apply_command(pubsub_t *pubsub, subscriber_t *sub, const char *line) {
+    unsigned id;
+    int end = 0;
+
+    if (strcmp(line, "all") == 0) {
+        sub->all = 1;
+    } else if (sscanf(line, "sensor %u%n", &id, &end) == 1 && line[end] == '\0' && id < NUM_SENSOR_IDS) {
+        sub->sensors[id / 8] |= 1 << (id % 8);
+    } else if (sscanf(line, "room %u%n", &id, &end) == 1 && line[end] == '\0' && id < NUM_SENSOR_IDS) {
+        for (int s = 0; s < NUM_SENSOR_IDS; s++) {
+            if (pubsub->room_of[s] == id) sub->sensors[s / 8] |= 1 << (s % 8);
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void read_commands(pubsub_t *pubsub, subscriber_t *sub) {
+    ssize_t got = recv(sub->fd, sub->command + sub->command_len, COMMAND_SIZE - sub->command_len, 0);
+    char *line, *newline;
+
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+        close_subscriber(sub, "disconnected");
+        return;
+    }
+    if (got < 0) return;
+    sub->command_len += got;
+    line = sub->command;
+    while ((newline = memchr(line, '\n', sub->command + sub->command_len - line)) != NULL) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+        if (apply_command(pubsub, sub, line) != 0) {
+            close_subscriber(sub, "sent an invalid filter, closed");
+            return;
+        }
+        line = newline + 1;
+    }
+    sub->command_len -= line - sub->command;
+    memmove(sub->command, line, sub->command_len);
+    if (sub->command_len == COMMAND_SIZE) close_subscriber(sub, "sent an invalid filter, closed");
+}
+
+// sends what the socket takes without blocking
+static void flush_subscriber(subscriber_t *sub) {
+    while (sub->len > 0 && !sub->closing) {
+        size_t chunk = (sub->head + sub->len > QUEUE_BYTES) ? QUEUE_BYTES - sub->head : sub->len;
+        ssize_t sent = send(sub->fd, sub->queue + sub->head, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EINTR) close_subscriber(sub, "disconnected");
+            return;
+        }
+        metrics_add(METRIC_PUBSUB_SENT, sent / WIRE_SIZE);
+        sub->head = (sub->head + sent) % QUEUE_BYTES;
+        sub->len -= sent;
+    }
+}
+
+/* Accepts new subscribers, reads filters and sends the queued readings; called every PUBSUB_FLUSH_INTERVAL,
+ * never waits for a socket */
+static void service(pubsub_t *pubsub) {
+    struct pollfd fds[2 + PUBSUB_MAX_SUBSCRIBERS];
+    int n = pubsub->num_subscribers;
+
+    for (int l = 0; l < 2; l++) fds[l] = (struct pollfd) {.fd = pubsub->listen_fds[l], .events = POLLIN};
+    for (int i = 0; i < n; i++) fds[2 + i] = (struct pollfd) {.fd = pubsub->subscribers[i]->fd, .events = POLLIN};
+    if (poll(fds, 2 + n, 0) > 0) {
+        for (int i = 0; i < n; i++) {
+            if (fds[2 + i].revents) read_commands(pubsub, pubsub->subscribers[i]);
+        }
+        for (int l = 0; l < 2; l++) {
+            if (fds[l].revents & POLLIN) accept_subscriber(pubsub, pubsub->listen_fds[l]);
+        }
+    }
+
+    for (int i = 0; i < pubsub->num_subscribers; i++) {
+        subscriber_t *sub = pubsub->subscribers[i];
+        flush_subscriber(sub);
+        if (!sub->closing) continue;
+        close(sub->fd);
+        free(sub->queue);
+        free(sub);
+        pubsub->subscribers[i--] = pubsub->subscribers[--pubsub->num_subscribers];
+    }
+}
+
+// queues the reading for every subscriber whose filter matches; a full queue evicts its subscriber
+static void publish(pubsub_t *pubsub, sensor_record_t *record) {
+    sensor_data_t data = record_unpack(record);
+    char wire[WIRE_SIZE];
+
+    memcpy(wire, &data.id, sizeof(data.id));
+    memcpy(wire + sizeof(data.id), &data.value, sizeof(data.value));
+    memcpy(wire + sizeof(data.id) + sizeof(data.value), &data.ts, sizeof(data.ts));
+    for (int i = 0; i < pubsub->num_subscribers; i++) {
+        subscriber_t *sub = pubsub->subscribers[i];
+        if (sub->closing || !(sub->all || (sub->sensors[record->id / 8] & (1 << (record->id % 8))))) continue;
+        if (sub->len + WIRE_SIZE > QUEUE_BYTES) {
+            metrics_add(METRIC_PUBSUB_EVICTED, 1);
+            close_subscriber(sub, "evicted, its queue overflowed");
+            continue;
+        }
+        size_t tail = (sub->head + sub->len) % QUEUE_BYTES;
+        size_t first = (tail + WIRE_SIZE > QUEUE_BYTES) ? QUEUE_BYTES - tail : WIRE_SIZE;
+        memcpy(sub->queue + tail, wire, first);
+        memcpy(sub->queue, wire + first, WIRE_SIZE - first);
+        sub->len += WIRE_SIZE;
+    }
+}
+
+void *pubsub_run(void *arg) {
+    pubsub_args_t *args = (pubsub_args_t *) arg;
+    pubsub_t *pubsub = calloc(1, sizeof(pubsub_t));
+    sensor_record_t data;
+    uint64_t next_service = latency_now(), now;
+    int result, active = 0;
+    const char *address = (args->address != NULL) ? args->address : PUBSUB_ADDRESS;
+    char log_msg[192];
+
+    if (pubsub != NULL) {
+        pubsub->listen_fds[0] = (args->port > 0) ? listen_tcp(address, args->port) : -1;
+        pubsub->listen_fds[1] = (args->socket_path != NULL) ? listen_unix(args->socket_path) : -1;
+        pubsub->socket_path = args->socket_path;
+        if ((args->port > 0 && pubsub->listen_fds[0] < 0) || (args->socket_path != NULL && pubsub->listen_fds[1] < 0)) {
+            write_to_log_process("Error: Could not open the pubsub listening sockets");
+        }
+        active = pubsub->listen_fds[0] >= 0 || pubsub->listen_fds[1] >= 0;
+        if (active) {
+            load_rooms(pubsub);
+            snprintf(log_msg, sizeof(log_msg), "Pubsub server accepting subscribers (%s:%d, socket %s)", address,
+                     args->port, (args->socket_path != NULL) ? args->socket_path : "-");
+            write_to_log_process(log_msg);
+        }
+    }
+
+    while (1) {
+        result = sbuffer_remove_timed(args->buffer, &data, READER_PUBSUB, NULL, active ? next_service : 0);
+        if (result == SBUFFER_NO_DATA) break;
+        if (!active) continue;
+        // subscribers get the readings as a sensor node sends them, which has no room for the validation tag
+        if (result == SBUFFER_SUCCESS && pubsub->num_subscribers > 0 && !(data.flags & RECORD_FLAG_INVALID)) {
+            publish(pubsub, &data);
+        }
+        now = latency_now();
+        if (now >= next_service) {
+            service(pubsub);
+            next_service = now + FLUSH_INTERVAL_NS;
+        }
+    }
+
+    if (pubsub != NULL) {
+        // a last non-blocking send of what is queued, then the subscribers see the end of the stream
+        for (int i = 0; i < pubsub->num_subscribers; i++) {
+            flush_subscriber(pubsub->subscribers[i]);
+            close(pubsub->subscribers[i]->fd);
+            free(pubsub->subscribers[i]->queue);
+            free(pubsub->subscribers[i]);
+        }
+        for (int l = 0; l < 2; l++) {
+            if (pubsub->listen_fds[l] >= 0) close(pubsub->listen_fds[l]);
+        }
+        if (pubsub->listen_fds[1] >= 0) unlink(pubsub->socket_path);
+        free(pubsub);
+    }
+    return NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef _PUBSUB_H_
+#define _PUBSUB_H_
+
+#include "config.h"
+#include "sbuffer.h"
+
+/*
+ * Live fan-out of the readings to subscribers (HVAC controllers, dashboards); the pubsub thread is the fourth
+ * reader of the sbuffer.
+ * - Subscribers connect over TCP (--pubsub-port, on PUBSUB_ADDRESS unless --pubsub-address says otherwise) or a
+ *   unix socket (--pubsub-socket) and send text lines:
+ *   "sensor <id>", "room <id>" (rooms from room_sensor.map) or "all". Every line adds to the filter.
+ * - Matching readings are sent as a stream of records in the wire format of the sensor nodes
+ *   (<uint16 id><double value><time_t ts>, packed), batched into one send() per PUBSUB_FLUSH_INTERVAL.
+ * - Each subscriber has a bounded queue of PUBSUB_QUEUE_RECORDS. Sockets are non-blocking, so a slow subscriber
+ *   only fills its own queue; when that overflows the subscriber is evicted and the reader moves on. The stream
+ *   of an evicted subscriber may end in the middle of a record.
+ * Without a port or socket the thread isn't started and its reader isn't registered with the sbuffer.
+ */
+
+#ifndef PUBSUB_QUEUE_RECORDS
+#define PUBSUB_QUEUE_RECORDS 16384  // readings queued per subscriber before it is evicted
+#endif
+
+#ifndef PUBSUB_FLUSH_INTERVAL
+#define PUBSUB_FLUSH_INTERVAL 10    // ms between two sends to a subscriber at most
+#endif
+
+#define PUBSUB_MAX_SUBSCRIBERS 64
+
+#ifndef PUBSUB_ADDRESS
+#define PUBSUB_ADDRESS "127.0.0.1"  // the stream is unauthenticated: loopback only, like the metrics endpoint
+#endif
+
+typedef struct {
+    sbuffer_t *buffer;
+    int port;                   // TCP port to listen on, 0 = none
+    const char *address;        // IPv4 address the TCP port is bound to, NULL = PUBSUB_ADDRESS
+    const char *socket_path;    // unix socket to listen on, NULL = none
+} pubsub_args_t;
+
+/** Thread function: serves subscribers until the end-of-stream marker
+ * \param args a pubsub_args_t, must stay valid until the thread exits
+ */
+void *pubsub_run(void *args);
+
+#endif /* _PUBSUB_H_ */
@@ -0,0 +1,108 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+#include <math.h>
+#include "config.h"
+
+/*
+ * Compact in-memory form of a reading, used inside the gateway from the receiving edge (connmgr, ingest) to the
+ * readers of the sbuffer. sensor_data_t is padded to 24 bytes, a sensor_record_t is 12, so twice as many
+ * readings fit in a cache line. Readings are converted with record_pack() when they enter the gateway and
+ * turned back into doubles / time_t only where they leave it (data.csv, log messages, running averages).
+ */
+
+#ifndef RECORD_VALUE_SCALE
+/* Precision trade-off of the value:
+ * - > 0: fixed point, the value is stored as round(value * RECORD_VALUE_SCALE) in 32 bits. The default keeps
+ *   4 decimals (the precision of data.csv) for values within +-214748. Only the sign of a value that rounds
+ *   to zero is lost: data.csv prints 0.0000 where printf() of the original double gives -0.0000.
+ * - 0: a 32-bit float, any magnitude but only about 7 significant digits.
+ */
+#define RECORD_VALUE_SCALE 10000
+#endif
+
+#ifndef RECORD_EPOCH_BASE
+#define RECORD_EPOCH_BASE 0     // timestamps are stored as unsigned seconds since this base (136 years of range)
+#endif
+
+#define RECORD_FLAG_VALUE_CLAMPED   0x0001  // the value was out of range and saturated
+#define RECORD_FLAG_TS_CLAMPED      0x0002  // the timestamp was out of range and saturated
+#define RECORD_FLAG_JOURNALED       0x0004  // appended to the journal, bits 4-15 tell where (journal.h)
+#define RECORD_FLAG_INVALID         0x0008  // failed validation and kept in tag mode (validate.h)
+#define RECORD_JOURNAL_BLOCK_SHIFT  4       // bits 4-7: block within the journal segment
+#define RECORD_JOURNAL_TAG_SHIFT    8       // bits 8-15: journal segment
+#define RECORD_JOURNAL_BITS         0xFFF4  // everything the journal sets, local to this gateway
+
+// size of the tables indexed by sensor id; they are calloc'ed, so the pages of ids that never send are never touched
+#define NUM_SENSOR_IDS (1 << (8 * sizeof(sensor_id_t)))
+
+typedef struct {
+    sensor_id_t id;
+    uint16_t flags;
+    uint32_t ts;                // seconds since RECORD_EPOCH_BASE
+#if RECORD_VALUE_SCALE > 0
+    int32_t value;              // value * RECORD_VALUE_SCALE
+#else
+    float value;
+#endif
+} sensor_record_t;
+
+#if RECORD_VALUE_SCALE > 0
+/* round(value * RECORD_VALUE_SCALE) the way printf() rounds the decimal text of the double: to the nearest, ties
+ * to even. The product is rounded itself, so a value right next to a tie (like -0.00005, which is a bit below it
+ * as a double) can come out as exactly n + 0.5; for those fma() gives the rounding error of the product, whose
+ * sign tells on what side of the tie the double really is. Any product that isn't a tie rounds like the exact one. */
+static inline double record_scale(double value) {
+    double product = value * RECORD_VALUE_SCALE;
+    double nearest = rint(product);
+
+    if (fabs(product - nearest) == 0.5) {
+        double error = fma(value, RECORD_VALUE_SCALE, -product);
+        if (error > 0) nearest = ceil(product);
+        if (error < 0) nearest = floor(product);
+    }
+    return nearest;
+}
+#endif
+
+static inline sensor_record_t record_pack(const sensor_data_t *data) {
+    sensor_record_t record = {.id = data->id, .flags = 0};
+    int64_t ts = (int64_t) data->ts - RECORD_EPOCH_BASE;
+
+    if (ts < 0 || ts > UINT32_MAX) {
+        record.flags |= RECORD_FLAG_TS_CLAMPED;
+        ts = (ts < 0) ? 0 : UINT32_MAX;
+    }
+    record.ts = (uint32_t) ts;
+#if RECORD_VALUE_SCALE > 0
+    double scaled = record_scale(data->value);
+    if (!(scaled >= INT32_MIN && scaled <= INT32_MAX)) {
+        record.flags |= RECORD_FLAG_VALUE_CLAMPED;
+        scaled = (scaled < 0) ? INT32_MIN : (scaled > 0) ? INT32_MAX : 0;   // NaN becomes 0
+    }
+    record.value = (int32_t) scaled;
+#else
+    record.value = (float) data->value;
+#endif
+    return record;
+}
+
+static inline sensor_value_t record_value(const sensor_record_t *record) {
+#if RECORD_VALUE_SCALE > 0
+    return (sensor_value_t) record->value / RECORD_VALUE_SCALE;
+#else
+    return (sensor_value_t) record->value;
+#endif
+}
+
+static inline sensor_ts_t record_ts(const sensor_record_t *record) {
+    return (sensor_ts_t) ((int64_t) record->ts + RECORD_EPOCH_BASE);
+}
+
+static inline sensor_data_t record_unpack(const sensor_record_t *record) {
+    sensor_data_t data = {.id = record->id, .value = record_value(record), .ts = record_ts(record)};
+    return data;
+}
+
+#endif /* _RECORD_H_ */
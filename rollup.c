@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "rollup.h"
+#include "datamgr.h"
+#include "metrics.h"
+
+#define ROLLUP_SCOPE_SENSOR 0
+#define ROLLUP_SCOPE_ROOM 1
+#define ROLLUP_NUM_SCOPES 2
+#define ROLLUP_NUM_SPANS 2
+
+static const int spans[ROLLUP_NUM_SPANS] = {60, 3600};
+static const char *scope_names[ROLLUP_NUM_SCOPES] = {"sensor", "room"};
+
+typedef struct {
+    time_t start;
+    uint32_t count;
+    double min, max, sum;
+} rollup_window_t;
+
+typedef struct {
+    int num, cap;
+    rollup_window_t *windows;   // open windows, sorted by start
+} rollup_series_t;
+
+typedef struct {
+    uint16_t id;
+    rollup_series_t series[ROLLUP_NUM_SPANS];
+} rollup_key_t;
+
+struct rollup {
+    dparray_t *map;
+    dparray_t *keys[ROLLUP_NUM_SCOPES];     // sensors / rooms with an open window, sorted by id
+    FILE *out[ROLLUP_NUM_SPANS];
+    int lateness;
+    int started;                            // 'newest' and 'closed' are valid
+    time_t newest;                          // highest timestamp seen
+    time_t closed[ROLLUP_NUM_SPANS];        // windows that start before this are closed
+    long late;
+};
+
+// --- Dparray Callback Functions ---
+static void key_free(void *element) {
+    rollup_key_t *key = (rollup_key_t *) element;
+    for (int s = 0; s < ROLLUP_NUM_SPANS; s++) free(key->series[s].windows);
+}
+
+static int key_compare(void *x, void *y) {
+    uint16_t a = ((rollup_key_t *) x)->id, b = ((rollup_key_t *) y)->id;
+    return (a < b) ? -1 : (a == b) ? 0 : 1;
+}
+
+// start of the window of length 'span' that holds 'ts', rounding down for negative timestamps as well
+static time_t window_start(time_t ts, int span) {
+    time_t rem = ts % span;
+    return ts - ((rem < 0) ? rem + span : rem);
+}
+
+rollup_t *rollup_create(int lateness, dparray_t *map, FILE *minute, FILE *hour) {
+    rollup_t *rollup = calloc(1, sizeof(rollup_t));
+    if (rollup == NULL) return NULL;
+    rollup->lateness = (lateness > 0) ? lateness : 0;
+    rollup->map = map;
+    rollup->out[0] = minute;
+    rollup->out[1] = hour;
+    for (int c = 0; c < ROLLUP_NUM_SCOPES; c++) {
+        rollup->keys[c] = dpa_create(sizeof(rollup_key_t), key_free, key_compare);
+        if (rollup->keys[c] == NULL) {
+            rollup_free(&rollup);
+            return NULL;
+        }
+        dpa_sort(rollup->keys[c]);  // empty, but from now on new keys are inserted in order
+    }
+    return rollup;
+}
+
+// finds the key of 'id', adding it if it has no open window yet; NULL if out of memory
+static rollup_key_t *get_key(rollup_t *rollup, int scope, uint16_t id) {
+    dparray_t *keys = rollup->keys[scope];
+    rollup_key_t dummy = {.id = id};
+    int index = dpa_lower_bound(keys, &dummy), size = dpa_size(keys);
+    rollup_key_t *key = (index < size) ? dpa_get_element_at_index(keys, index) : NULL;
+
+    if (key != NULL && key->id == id) return key;
+    dpa_insert_at_index(keys, &dummy, index);
+    if (dpa_size(keys) == size) return NULL;    // the array couldn't grow
+    return dpa_get_element_at_index(keys, index);
+}
+
+static void add_to_window(rollup_series_t *series, time_t start, double value) {
+    int i = series->num - 1;
+
+    // readings are mostly in order, so the window is nearly always the last one
+    while (i >= 0 && series->windows[i].start > start) i--;
+    if (i < 0 || series->windows[i].start != start) {
+        if (series->num == series->cap) {
+            int cap = series->cap ? series->cap * 2 : 2;
+            rollup_window_t *windows = realloc(series->windows, cap * sizeof(rollup_window_t));
+            if (windows == NULL) return;
+            series->windows = windows;
+            series->cap = cap;
+        }
+        i++;
+        memmove(&series->windows[i + 1], &series->windows[i], (series->num - i) * sizeof(rollup_window_t));
+        series->windows[i] = (rollup_window_t) {.start = start, .min = value, .max = value};
+        series->num++;
+    }
+
+    rollup_window_t *window = &series->windows[i];
+    window->count++;
+    window->sum += value;
+    if (value < window->min) window->min = value;
+    if (value > window->max) window->max = value;
+}
+
+/* Writes out and drops the windows of 'span' that start before 'limit'; keys left without any window are
+ * removed, so idle sensors give back their memory. 'partial' tags the rows of windows that are still open. */
+static void close_windows(rollup_t *rollup, int span, time_t limit, int partial) {
+    FILE *out = rollup->out[span];
+    int written = 0;
+
+    for (int c = 0; c < ROLLUP_NUM_SCOPES; c++) {
+        dparray_t *keys = rollup->keys[c];
+        for (int i = 0; i < dpa_size(keys); i++) {
+            rollup_key_t *key = dpa_get_element_at_index(keys, i);
+            rollup_series_t *series = &key->series[span];
+            int n = 0, empty = 1;
+
+            while (n < series->num && series->windows[n].start < limit) {
+                rollup_window_t *w = &series->windows[n++];
+                if (out != NULL) {
+                    fprintf(out, "%s,%hu,%ld,%u,%.4f,%.4f,%.4f%s\n", scope_names[c], key->id, (long) w->start,
+                            w->count, w->min, w->max, w->sum / w->count, partial ? ",partial" : "");
+                }
+            }
+            if (n == 0) continue;
+            written += n;
+            series->num -= n;
+            memmove(series->windows, &series->windows[n], series->num * sizeof(rollup_window_t));
+
+            for (int s = 0; s < ROLLUP_NUM_SPANS; s++) {
+                if (key->series[s].num > 0) empty = 0;
+            }
+            if (empty) dpa_remove_at_index(keys, i--, true);
+        }
+    }
+    if (written > 0) {
+        metrics_add(METRIC_ROLLUP_WINDOWS, written);
+        if (out != NULL) fflush(out);
+    }
+}
+
+int rollup_add(rollup_t *rollup, sensor_record_t *record) {
+    time_t ts = record_ts(record);
+    double value = record_value(record);
+    rollup_key_t *keys[ROLLUP_NUM_SCOPES] = {NULL, NULL};
+    int room = -1, late = 0;
+
+    if (rollup->map != NULL) {
+        my_element_t dummy = {.sensor_id = record->id};
+        int index = dpa_get_index_of_element(rollup->map, &dummy);
+        if (index != -1) room = ((my_element_t *) dpa_get_element_at_index(rollup->map, index))->room_id;
+    }
+
+    for (int s = 0; s < ROLLUP_NUM_SPANS; s++) {
+        time_t start = window_start(ts, spans[s]);
+        if (rollup->started && start < rollup->closed[s]) {
+            late = 1;
+            continue;
+        }
+        // looked up only here, so a reading that is late for every window doesn't bring back a removed key
+        if (keys[ROLLUP_SCOPE_SENSOR] == NULL) {
+            keys[ROLLUP_SCOPE_SENSOR] = get_key(rollup, ROLLUP_SCOPE_SENSOR, record->id);
+            if (keys[ROLLUP_SCOPE_SENSOR] == NULL) return -1;
+            if (room != -1) keys[ROLLUP_SCOPE_ROOM] = get_key(rollup, ROLLUP_SCOPE_ROOM, (uint16_t) room);
+        }
+        add_to_window(&keys[ROLLUP_SCOPE_SENSOR]->series[s], start, value);
+        if (keys[ROLLUP_SCOPE_ROOM] != NULL) add_to_window(&keys[ROLLUP_SCOPE_ROOM]->series[s], start, value);
+    }
+    if (late) {
+        rollup->late++;
+        metrics_add(METRIC_ROLLUP_LATE, 1);
+    }
+
+    if (!rollup->started || ts > rollup->newest) {
+        rollup->newest = ts;
+        for (int s = 0; s < ROLLUP_NUM_SPANS; s++) {
+            // a window [start, start + span) closes once newest - lateness >= start + span
+            time_t limit = window_start(ts - rollup->lateness, spans[s]);
+            if (rollup->started && limit > rollup->closed[s]) close_windows(rollup, s, limit, 0);
+            if (!rollup->started || limit > rollup->closed[s]) rollup->closed[s] = limit;
+        }
+        rollup->started = 1;
+    }
+    return late ? -1 : 0;
+}
+
+void rollup_flush(rollup_t *rollup) {
+    for (int s = 0; s < ROLLUP_NUM_SPANS; s++) close_windows(rollup, s, LONG_MAX, 1);
+}
+
+long rollup_late(rollup_t *rollup) {
+    return rollup->late;
+}
+
+void rollup_free(rollup_t **rollup) {
+    if (rollup == NULL || *rollup == NULL) return;
+    for (int c = 0; c < ROLLUP_NUM_SCOPES; c++) dpa_free(&(*rollup)->keys[c], true);
+    free(*rollup);
+    *rollup = NULL;
+}
+
+// --- Main Thread Function ---
+void *rollup_run(void *arg) {
+    rollup_args_t *args = (rollup_args_t *) arg;
+    dparray_t *map = datamgr_load_map("room_sensor.map");
+    FILE *minute = fopen(ROLLUP_MINUTE_FILE, "a");     // appended: the history survives a restart
+    FILE *hour = fopen(ROLLUP_HOUR_FILE, "a");
+    sensor_record_t data;
+    char log_msg[128];
+    rollup_t *rollup;
+
+    if (map == NULL) write_to_log_process("Error: Could not open room_sensor.map, no room rollups");
+    if (minute == NULL || hour == NULL) write_to_log_process("Error: Could not open the rollup files");
+    // keeps reading even without output: the buffer can only recycle what every reader has taken
+    rollup = rollup_create(args->lateness, map, minute, hour);
+
+    while (sbuffer_remove(args->buffer, &data, READER_ROLLUP) != SBUFFER_NO_DATA) {
+        if (rollup != NULL && !(data.flags & RECORD_FLAG_INVALID)) rollup_add(rollup, &data);
+    }
+
+    if (rollup != NULL) {
+        rollup_flush(rollup);
+        snprintf(log_msg, sizeof(log_msg), "The rollup files have been closed, %ld late readings dropped",
+                 rollup_late(rollup));
+        write_to_log_process(log_msg);
+        rollup_free(&rollup);
+    }
+    if (minute != NULL) fclose(minute);
+    if (hour != NULL) fclose(hour);
+    dpa_free(&map, true);
+    return NULL;
+}
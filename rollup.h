@@ -0,0 +1,65 @@
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdio.h>
+#include "config.h"
+#include "sbuffer.h"
+#include "lib/dparray.h"
+
+/*
+ * Minute and hour aggregates (count, min, max, mean) per sensor and per room, computed while the readings stream
+ * through the gateway; the rollup thread is the third reader of the sbuffer.
+ * - Windows are tumbling and aligned to the epoch, rooms come from room_sensor.map like in the datamgr.
+ * - A window closes when the newest timestamp seen is at least 'lateness' seconds past its end. It is then
+ *   appended to rollup_minute.csv or rollup_hour.csv as "<sensor|room>,<id>,<window start>,<count>,<min>,<max>,<mean>".
+ *   The files are kept across restarts. A window still open at shutdown is written then with an eighth
+ *   column ",partial", and its readings after the restart give another row when it closes. Readers merge the
+ *   rows of one window: counts add up, min and max of the parts, mean weighted by count.
+ * - A reading for a window that is already closed is dropped and counted (METRIC_ROLLUP_LATE).
+ * - Only sensors and rooms with an open window take memory, a few windows each.
+ */
+
+#ifndef ROLLUP_LATENESS
+#define ROLLUP_LATENESS 60      // default out-of-order bound in seconds
+#endif
+
+#define ROLLUP_MINUTE_FILE "rollup_minute.csv"
+#define ROLLUP_HOUR_FILE "rollup_hour.csv"
+
+typedef struct rollup rollup_t;
+
+typedef struct {
+    sbuffer_t *buffer;
+    int lateness;               // seconds a reading may lag behind the newest one
+} rollup_args_t;
+
+/** Thread function: aggregates every reading of the buffer until the end-of-stream marker
+ * \param args a rollup_args_t, must stay valid until the thread exits
+ */
+void *rollup_run(void *args);
+
+/** Creates the window state
+ * \param lateness out-of-order bound in seconds (negative is treated as 0)
+ * \param map sensor to room mapping as returned by datamgr_load_map(), or NULL for per-sensor rollups only;
+ *        it is only read, the caller keeps ownership
+ * \param minute, hour where closed windows are written, NULL to discard them
+ * \return the state, or NULL if out of memory
+ */
+rollup_t *rollup_create(int lateness, dparray_t *map, FILE *minute, FILE *hour);
+
+/** Adds one reading to its windows and writes out the windows it closes
+ * \return 0, or -1 if the reading was too late for at least one of its windows or out of memory
+ */
+int rollup_add(rollup_t *rollup, sensor_record_t *record);
+
+/** Writes out all open windows, e.g. at the end of the stream; those that could still get readings are tagged
+ * ",partial" */
+void rollup_flush(rollup_t *rollup);
+
+/** Returns the number of readings dropped because they were too late */
+long rollup_late(rollup_t *rollup);
+
+/** Frees the window state; open windows are lost, see rollup_flush() */
+void rollup_free(rollup_t **rollup);
+
+#endif /* _ROLLUP_H_ */
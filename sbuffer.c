@@ -2,55 +2,161 @@
  * \author {MINGHAO CHEN}
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 #include "sbuffer.h"
+#include "latency.h"
+#include "metrics.h"
+#include "coro.h"
+
+#define SBUFFER_SLAB_NODES 1024
+#define SBUFFER_QUEUE_BURST 64      // records a reader takes from one queue before it moves on to the next
+#define SBUFFER_READER_YIELDS 16    // sched_yield() calls of an idle reader before it sleeps
+#define CACHE_LINE_SIZE 64
 
 typedef struct sbuffer_node {
     struct sbuffer_node *next;
-    sensor_data_t data;
+    sensor_record_t record;
+    uint32_t enqueue_us;    // side field: low 32 bits of latency_now() in us, wraps after 71 minutes
 } sbuffer_node_t;
 
+typedef struct sbuffer_slab {
+    struct sbuffer_slab *next;
+    sbuffer_node_t nodes[SBUFFER_SLAB_NODES];
+} sbuffer_slab_t;
+
+typedef struct {
+    sensor_record_t record;
+    uint32_t enqueue_us;
+} sbuffer_entry_t;
+
+/*
+ * A bounded ring with one producer and one read index per reader. Indexes only grow, the entry of index i is
+ * entries[i % SBUFFER_QUEUE_SIZE]. Every index is written by one thread only and sits on its own cache line.
+ */
+struct sbuffer_queue {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;    // next index to write, published with release
+    uint64_t free_until;                                // producer's cached min(tail) + size
+    sbuffer_t *buffer;
+    int slot;
+    struct {
+        _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t index;
+    } tail[SBUFFER_NUM_READERS];
+    _Alignas(CACHE_LINE_SIZE) _Atomic int closed;
+    sbuffer_entry_t entries[SBUFFER_QUEUE_SIZE];
+};
+
+typedef struct {
+    _Atomic(sbuffer_queue_t *) queue;   // NULL if the slot is free
+    _Atomic int done;                   // bit r: reader r drained the closed queue and won't touch it again
+} sbuffer_queue_slot_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) int slot; // round-robin position over the queue slots
+    int burst;                          // records left before moving on from 'slot'
+    uint64_t shared_taken;              // records taken from the shared list
+} sbuffer_reader_t;
+
 struct sbuffer {
     sbuffer_node_t *head;
     sbuffer_node_t *tail;
 
-    sbuffer_node_t *last_read_datamgr;
-    sbuffer_node_t *last_read_storagemgr;
+    sbuffer_node_t *last_read[SBUFFER_NUM_READERS];    // last node taken by each reader
+
+    sbuffer_node_t *free_nodes; // nodes every reader is done with, linked through 'next'
+    sbuffer_slab_t *slabs;      // only freed in sbuffer_free(), so the buffer keeps its high-water mark
 
     pthread_mutex_t mutex;
     pthread_cond_t can_read;
     int end_of_stream;
+
+    _Atomic uint64_t shared_inserted;   // records ever linked into the shared list, updated with the mutex held
+    _Atomic int sleepers;               // readers about to wait on 'can_read'
+    sbuffer_queue_slot_t *slots;
+    int max_queues;
+    _Atomic int used_slots;             // high-water mark of the slots in use, readers scan up to here
+    int reader_mask;                    // bit r: reader r takes records, see sbuffer_set_readers()
+    sbuffer_reader_t readers[SBUFFER_NUM_READERS];
 };
 
 
-static sbuffer_node_t* create_node() {
-    sbuffer_node_t* node = malloc(sizeof(sbuffer_node_t));
-    if(node) node->next = NULL;
+// takes a node from the free list, adding a new slab if it is empty; called with the mutex held
+static sbuffer_node_t* create_node(sbuffer_t *buffer) {
+    sbuffer_node_t* node;
+    if (buffer->free_nodes == NULL) {
+        sbuffer_slab_t *slab = malloc(sizeof(sbuffer_slab_t));
+        if (slab == NULL) return NULL;
+        slab->next = buffer->slabs;
+        buffer->slabs = slab;
+        for (int i = 0; i < SBUFFER_SLAB_NODES; i++) {
+            slab->nodes[i].next = buffer->free_nodes;
+            buffer->free_nodes = &slab->nodes[i];
+        }
+    }
+    node = buffer->free_nodes;
+    buffer->free_nodes = node->next;
+    node->next = NULL;
     return node;
 }
 
+static void free_node(sbuffer_t *buffer, sbuffer_node_t *node) {
+    node->next = buffer->free_nodes;
+    buffer->free_nodes = node;
+}
+
+static uint32_t stamp_now(void) {
+    return (uint32_t) (latency_now() / 1000);
+}
+
 int sbuffer_init(sbuffer_t **buffer) {
-    *buffer = malloc(sizeof(sbuffer_t));
+    return sbuffer_init_queues(buffer, 0);
+}
+
+int sbuffer_init_queues(sbuffer_t **buffer, int max_queues) {
+    *buffer = calloc(1, sizeof(sbuffer_t));
     if (*buffer == NULL) return SBUFFER_FAILURE;
+    if (max_queues > 0) {
+        (*buffer)->slots = calloc(max_queues, sizeof(sbuffer_queue_slot_t));
+        if ((*buffer)->slots == NULL) { free(*buffer); return SBUFFER_FAILURE; }
+        (*buffer)->max_queues = max_queues;
+    }
 
-    sbuffer_node_t *dummy = create_node();
-    if (dummy == NULL) { free(*buffer); return SBUFFER_FAILURE; }
+    sbuffer_node_t *dummy = create_node(*buffer);
+    if (dummy == NULL) { free((*buffer)->slots); free(*buffer); return SBUFFER_FAILURE; }
 
     (*buffer)->head = dummy;
     (*buffer)->tail = dummy;
-    (*buffer)->last_read_datamgr = dummy;
-    (*buffer)->last_read_storagemgr = dummy;
+    for (int r = 0; r < SBUFFER_NUM_READERS; r++) (*buffer)->last_read[r] = dummy;
+    (*buffer)->reader_mask = (1 << SBUFFER_NUM_READERS) - 1;
     (*buffer)->end_of_stream = 0;
 
     if (pthread_mutex_init(&(*buffer)->mutex, NULL) != 0) {
-        free(dummy); free(*buffer); return SBUFFER_FAILURE;
+        free((*buffer)->slabs); free((*buffer)->slots); free(*buffer); return SBUFFER_FAILURE;
     }
-    if (pthread_cond_init(&(*buffer)->can_read, NULL) != 0) {
+    // monotonic, so the deadlines of sbuffer_remove_timed() are in latency_now() time
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int cond_result = pthread_cond_init(&(*buffer)->can_read, &attr);
+    pthread_condattr_destroy(&attr);
+    if (cond_result != 0) {
         pthread_mutex_destroy(&(*buffer)->mutex);
-        free(dummy); free(*buffer); return SBUFFER_FAILURE;
+        free((*buffer)->slabs); free((*buffer)->slots); free(*buffer); return SBUFFER_FAILURE;
+    }
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_set_readers(sbuffer_t *buffer, int reader_mask) {
+    if (buffer == NULL || reader_mask == 0 || (reader_mask & ~((1 << SBUFFER_NUM_READERS) - 1))) {
+        return SBUFFER_FAILURE;
     }
+    buffer->reader_mask = reader_mask;
     return SBUFFER_SUCCESS;
 }
 
@@ -58,12 +164,15 @@ int sbuffer_free(sbuffer_t **buffer) {
     if ((buffer == NULL) || (*buffer == NULL)) return SBUFFER_FAILURE;
 
     pthread_mutex_lock(&(*buffer)->mutex);
-    sbuffer_node_t *current = (*buffer)->head;
+    sbuffer_slab_t *current = (*buffer)->slabs;
     while (current) {
-        sbuffer_node_t *next = current->next;
+        sbuffer_slab_t *next = current->next;
         free(current);
         current = next;
     }
+    // queues that were never closed or not drained by every reader
+    for (int i = 0; i < (*buffer)->max_queues; i++) free(atomic_load(&(*buffer)->slots[i].queue));
+    free((*buffer)->slots);
     pthread_mutex_unlock(&(*buffer)->mutex);
 
     pthread_mutex_destroy(&(*buffer)->mutex);
@@ -73,64 +182,342 @@ int sbuffer_free(sbuffer_t **buffer) {
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, int reader_id) {
-    if (buffer == NULL) return SBUFFER_FAILURE;
+/* Wakes up readers waiting for data, if any. The fence pairs with the one in sbuffer_remove_stamped(): either
+ * the producer sees the sleeper, or the sleeper sees the new head before it waits. */
+static void wake_readers(sbuffer_t *buffer) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&buffer->sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&buffer->mutex);
+        pthread_cond_broadcast(&buffer->can_read);
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+}
 
-    pthread_mutex_lock(&buffer->mutex);
+// whether some reader still has to move past the head node
+static int head_in_use(sbuffer_t *buffer) {
+    for (int r = 0; r < SBUFFER_NUM_READERS; r++) {
+        if ((buffer->reader_mask & (1 << r)) && buffer->last_read[r] == buffer->head) return 1;
+    }
+    return 0;
+}
 
-    sbuffer_node_t **my_cursor = (reader_id == READER_DATAMGR) ?
-                                 &buffer->last_read_datamgr :
-                                 &buffer->last_read_storagemgr;
+// takes the next record of the shared list for 'reader_id'; called with the mutex held
+static int shared_pop(sbuffer_t *buffer, int reader_id, sensor_record_t *record, uint32_t *enqueue_us) {
+    sbuffer_node_t **my_cursor = &buffer->last_read[reader_id];
 
-    while ((*my_cursor)->next == NULL) {
-        if (buffer->end_of_stream) {
-            pthread_mutex_unlock(&buffer->mutex);
-            return SBUFFER_NO_DATA;
-        }
-        pthread_cond_wait(&buffer->can_read, &buffer->mutex);
-    }
+    if ((*my_cursor)->next == NULL) return 0;
 
     sbuffer_node_t *next_node = (*my_cursor)->next;
-    *data = next_node->data;
+    *record = next_node->record;
+    *enqueue_us = next_node->enqueue_us;
     *my_cursor = next_node;
+    buffer->readers[reader_id].shared_taken++;
 
-    while (buffer->head != buffer->tail &&
-           buffer->head != buffer->last_read_datamgr &&
-           buffer->head != buffer->last_read_storagemgr) {
+    while (buffer->head != buffer->tail && !head_in_use(buffer)) {
 
         sbuffer_node_t *garbage = buffer->head;
         buffer->head = buffer->head->next; // Head 后移
-        free(garbage);
+        free_node(buffer, garbage);
     }
+    return 1;
+}
+
+static int shared_available(sbuffer_t *buffer, int reader_id) {
+    return atomic_load_explicit(&buffer->shared_inserted, memory_order_acquire) !=
+           buffer->readers[reader_id].shared_taken;
+}
 
+// the last reader to finish a closed queue frees it and its slot
+static void queue_done(sbuffer_t *buffer, sbuffer_queue_slot_t *slot, sbuffer_queue_t *queue, int reader_id) {
+    int done = atomic_fetch_or(&slot->done, 1 << reader_id) | (1 << reader_id);
+    if (done != buffer->reader_mask) return;
+    pthread_mutex_lock(&buffer->mutex);
+    atomic_store_explicit(&slot->queue, NULL, memory_order_release);
+    atomic_store_explicit(&slot->done, 0, memory_order_release);
     pthread_mutex_unlock(&buffer->mutex);
+    free(queue);
+}
+
+/* Takes the next record from the per-producer queues, round-robin with bursts of SBUFFER_QUEUE_BURST
+ * \return 1 if a record was taken, 0 if all queues are empty for this reader */
+static int queues_pop(sbuffer_t *buffer, int reader_id, sensor_record_t *record, uint32_t *enqueue_us) {
+    sbuffer_reader_t *reader = &buffer->readers[reader_id];
+    int used = atomic_load_explicit(&buffer->used_slots, memory_order_acquire);
+
+    // every slot is tried once, starting with the one this reader was taking a burst from
+    for (int scanned = 0; scanned < used; scanned++) {
+        if (reader->slot >= used) {
+            reader->slot = 0;
+            reader->burst = SBUFFER_QUEUE_BURST;
+        } else if (reader->burst == 0) {
+            reader->slot = (reader->slot + 1) % used;
+            reader->burst = SBUFFER_QUEUE_BURST;
+        }
+
+        sbuffer_queue_slot_t *slot = &buffer->slots[reader->slot];
+        sbuffer_queue_t *queue = NULL;
+        if (!(atomic_load_explicit(&slot->done, memory_order_acquire) & (1 << reader_id))) {
+            queue = atomic_load_explicit(&slot->queue, memory_order_acquire);
+        }
+        if (queue != NULL) {
+            uint64_t tail = atomic_load_explicit(&queue->tail[reader_id].index, memory_order_relaxed);
+            int closed = atomic_load_explicit(&queue->closed, memory_order_acquire);
+            if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+                sbuffer_entry_t *entry = &queue->entries[tail % SBUFFER_QUEUE_SIZE];
+                *record = entry->record;
+                *enqueue_us = entry->enqueue_us;
+                atomic_store_explicit(&queue->tail[reader_id].index, tail + 1, memory_order_release);
+                reader->burst--;
+                return 1;
+            }
+            // 'closed' was read before 'head', so nothing can follow once both say so
+            if (closed) queue_done(buffer, slot, queue, reader_id);
+        }
+        reader->burst = 0;
+    }
+    return 0;
+}
+
+static int queues_available(sbuffer_t *buffer, int reader_id) {
+    int used = atomic_load_explicit(&buffer->used_slots, memory_order_acquire);
+    for (int i = 0; i < used; i++) {
+        sbuffer_queue_slot_t *slot = &buffer->slots[i];
+        if (atomic_load_explicit(&slot->done, memory_order_acquire) & (1 << reader_id)) continue;
+        sbuffer_queue_t *queue = atomic_load_explicit(&slot->queue, memory_order_acquire);
+        if (queue == NULL) continue;
+        // a closed queue counts as well, so the reader comes back to retire it
+        if (atomic_load_explicit(&queue->closed, memory_order_acquire) ||
+            atomic_load_explicit(&queue->tail[reader_id].index, memory_order_relaxed) !=
+            atomic_load_explicit(&queue->head, memory_order_acquire)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sbuffer_remove(sbuffer_t *buffer, sensor_record_t *record, int reader_id) {
+    return sbuffer_remove_stamped(buffer, record, reader_id, NULL);
+}
+
+int sbuffer_remove_stamped(sbuffer_t *buffer, sensor_record_t *record, int reader_id, uint64_t *enqueue_ns) {
+    return sbuffer_remove_timed(buffer, record, reader_id, enqueue_ns, 0);
+}
+
+int sbuffer_remove_timed(sbuffer_t *buffer, sensor_record_t *record, int reader_id, uint64_t *enqueue_ns,
+                         uint64_t deadline_ns) {
+    uint32_t enqueue_us;
+    int found, idle = 0;
+
+    if (buffer == NULL) return SBUFFER_FAILURE;
+
+    while (1) {
+        if (queues_pop(buffer, reader_id, record, &enqueue_us)) break;
+        if (shared_available(buffer, reader_id)) {
+            pthread_mutex_lock(&buffer->mutex);
+            found = shared_pop(buffer, reader_id, record, &enqueue_us);
+            pthread_mutex_unlock(&buffer->mutex);
+            if (found) break;
+        }
+        // give the producers a moment first: a queue insert only has to wake a reader that went to sleep
+        if (buffer->max_queues > 0 && idle++ < SBUFFER_READER_YIELDS) {
+            sched_yield();
+            continue;
+        }
+
+        // nothing anywhere: register as a sleeper, then look once more before waiting (see wake_readers())
+        pthread_mutex_lock(&buffer->mutex);
+        atomic_fetch_add(&buffer->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        found = queues_available(buffer, reader_id) || shared_available(buffer, reader_id);
+        if (!found && buffer->end_of_stream) {
+            atomic_fetch_sub(&buffer->sleepers, 1);
+            pthread_mutex_unlock(&buffer->mutex);
+            return SBUFFER_NO_DATA;
+        }
+        if (!found && deadline_ns != 0) {
+            struct timespec until = {.tv_sec = deadline_ns / 1000000000ULL, .tv_nsec = deadline_ns % 1000000000ULL};
+            if (latency_now() >= deadline_ns ||
+                pthread_cond_timedwait(&buffer->can_read, &buffer->mutex, &until) == ETIMEDOUT) {
+                atomic_fetch_sub(&buffer->sleepers, 1);
+                pthread_mutex_unlock(&buffer->mutex);
+                return SBUFFER_TIMEOUT;
+            }
+        } else if (!found) {
+            pthread_cond_wait(&buffer->can_read, &buffer->mutex);
+        }
+        atomic_fetch_sub(&buffer->sleepers, 1);
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+
+    if (enqueue_ns != NULL) {
+        uint64_t now = latency_now();
+        *enqueue_ns = now - (uint64_t) ((uint32_t) (now / 1000) - enqueue_us) * 1000;
+    }
+    metrics_add(METRIC_RECORDS_REMOVED + reader_id, 1);
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
+int sbuffer_insert(sbuffer_t *buffer, sensor_record_t *record) {
     if (buffer == NULL) return SBUFFER_FAILURE;
 
     pthread_mutex_lock(&buffer->mutex);
 
-    if (data->id == 0) {
+    if (record->id == 0) {
         buffer->end_of_stream = 1;
         pthread_cond_broadcast(&buffer->can_read);
         pthread_mutex_unlock(&buffer->mutex);
         return SBUFFER_SUCCESS;
     }
 
-    sbuffer_node_t *new_node = create_node();
+    sbuffer_node_t *new_node = create_node(buffer);
     if (new_node == NULL) {
         pthread_mutex_unlock(&buffer->mutex);
+        metrics_add(METRIC_RECORDS_DROPPED, 1);
         return SBUFFER_FAILURE;
     }
-    new_node->data = *data;
+    new_node->record = *record;
+    new_node->enqueue_us = stamp_now();
 
     buffer->tail->next = new_node;
     buffer->tail = new_node;
+    atomic_fetch_add_explicit(&buffer->shared_inserted, 1, memory_order_release);
 
     pthread_cond_broadcast(&buffer->can_read);
     pthread_mutex_unlock(&buffer->mutex);
+    metrics_add(METRIC_RECORDS_INSERTED, 1);
+
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_insert_batch(sbuffer_t *buffer, sensor_record_t *record, int count) {
+    sbuffer_node_t *first = NULL, *last = NULL;
+    uint32_t now = stamp_now();
+    int inserted = 0;
+
+    if (buffer == NULL) return SBUFFER_FAILURE;
+
+    // taking a node from the free list is a pointer pop, cheap enough to do under the lock
+    pthread_mutex_lock(&buffer->mutex);
+    for (int i = 0; i < count; i++) {
+        if (record[i].id == 0) continue;
+        sbuffer_node_t *new_node = create_node(buffer);
+        if (new_node == NULL) {
+            while (first != NULL) {
+                sbuffer_node_t *garbage = first;
+                first = first->next;
+                free_node(buffer, garbage);
+            }
+            pthread_mutex_unlock(&buffer->mutex);
+            metrics_add(METRIC_RECORDS_DROPPED, count);
+            return SBUFFER_FAILURE;
+        }
+        new_node->record = record[i];
+        new_node->enqueue_us = now;
+        if (last == NULL) first = new_node;
+        else last->next = new_node;
+        last = new_node;
+        inserted++;
+    }
+    if (first != NULL) {
+        buffer->tail->next = first;
+        buffer->tail = last;
+        atomic_fetch_add_explicit(&buffer->shared_inserted, inserted, memory_order_release);
+        pthread_cond_broadcast(&buffer->can_read);
+    }
+    pthread_mutex_unlock(&buffer->mutex);
+    if (inserted > 0) metrics_add(METRIC_RECORDS_INSERTED, inserted);
+
+    return SBUFFER_SUCCESS;
+}
+
+sbuffer_queue_t *sbuffer_queue_open(sbuffer_t *buffer) {
+    sbuffer_queue_t *queue;
+    int i;
+
+    if (buffer == NULL || buffer->max_queues == 0) return NULL;
+    queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(sbuffer_queue_t));
+    if (queue == NULL) return NULL;
+    atomic_init(&queue->head, 0);
+    queue->free_until = SBUFFER_QUEUE_SIZE;
+    queue->buffer = buffer;
+    for (int r = 0; r < SBUFFER_NUM_READERS; r++) atomic_init(&queue->tail[r].index, 0);
+    atomic_init(&queue->closed, 0);
+
+    pthread_mutex_lock(&buffer->mutex);
+    for (i = 0; i < buffer->max_queues && atomic_load(&buffer->slots[i].queue) != NULL; i++);
+    if (i == buffer->max_queues) {
+        pthread_mutex_unlock(&buffer->mutex);
+        free(queue);
+        return NULL;
+    }
+    queue->slot = i;
+    atomic_store_explicit(&buffer->slots[i].queue, queue, memory_order_release);
+    if (i >= atomic_load(&buffer->used_slots)) atomic_store_explicit(&buffer->used_slots, i + 1, memory_order_release);
+    pthread_mutex_unlock(&buffer->mutex);
+    return queue;
+}
 
+// waits until the slowest reader left room for 'count' more entries
+static void queue_wait_for_room(sbuffer_queue_t *queue, uint64_t head, int count) {
+    int spins = 0;
+    while (head + count > queue->free_until) {
+        uint64_t min_tail = UINT64_MAX;
+        for (int r = 0; r < SBUFFER_NUM_READERS; r++) {
+            if (!(queue->buffer->reader_mask & (1 << r))) continue;
+            uint64_t tail = atomic_load_explicit(&queue->tail[r].index, memory_order_acquire);
+            if (tail < min_tail) min_tail = tail;
+        }
+        queue->free_until = min_tail + SBUFFER_QUEUE_SIZE;
+        if (head + count <= queue->free_until) break;
+        // full: the readers are behind, so back off (up to 1 ms) and leave them the CPU; the socket buffer of
+        // this connection takes the backlog meanwhile. A coroutine leaves the CPU to the other connections of
+        // its worker instead of putting the whole thread to sleep.
+        long backoff_us = (spins < 23) ? 50L * (spins - 2) : 1000L;
+        if (++spins < 4) {
+            if (coro_current() != NULL) coro_yield();
+            else sched_yield();
+        } else if (coro_current() != NULL) {
+            coro_sleep(backoff_us);
+        } else {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = backoff_us * 1000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+int sbuffer_queue_insert(sbuffer_queue_t *queue, sensor_record_t *record) {
+    return sbuffer_queue_insert_batch(queue, record, 1);
+}
+
+int sbuffer_queue_insert_batch(sbuffer_queue_t *queue, sensor_record_t *record, int count) {
+    uint32_t now = stamp_now();
+    int inserted = 0;
+
+    if (queue == NULL) return SBUFFER_FAILURE;
+
+    uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (int i = 0; i < count;) {
+        int chunk = (count - i < SBUFFER_QUEUE_SIZE / 2) ? count - i : SBUFFER_QUEUE_SIZE / 2;
+        queue_wait_for_room(queue, head, chunk);
+        for (int end = i + chunk; i < end; i++) {
+            if (record[i].id == 0) continue;
+            sbuffer_entry_t *entry = &queue->entries[head % SBUFFER_QUEUE_SIZE];
+            entry->record = record[i];
+            entry->enqueue_us = now;
+            head++;
+            inserted++;
+        }
+        atomic_store_explicit(&queue->head, head, memory_order_release);
+        wake_readers(queue->buffer);
+    }
+    if (inserted > 0) metrics_add(METRIC_RECORDS_INSERTED, inserted);
     return SBUFFER_SUCCESS;
-}
\ No newline at end of file
+}
+
+void sbuffer_queue_close(sbuffer_queue_t *queue) {
+    if (queue == NULL) return;
+    // once 'closed' is set the readers may free the queue at any moment
+    sbuffer_t *buffer = queue->buffer;
+    atomic_store_explicit(&queue->closed, 1, memory_order_release);
+    wake_readers(buffer);
+}
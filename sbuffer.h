@@ -5,22 +5,75 @@
 #ifndef _SBUFFER_H_
 #define _SBUFFER_H_
 
+#include <stdint.h>
 #include "config.h"
+#include "record.h"
 
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
+#define SBUFFER_TIMEOUT 2
 
 #define READER_DATAMGR 0
 #define READER_STORAGEMGR 1
+#define READER_ROLLUP 2
+#define READER_PUBSUB 3
+#define READER_FORWARD 4
+#define SBUFFER_NUM_READERS 5
 
+#ifndef SBUFFER_QUEUE_SIZE
+#define SBUFFER_QUEUE_SIZE 4096     // records per producer queue
+#endif
+
+/* The buffer holds readings in their compact form (see record.h); nodes come from slabs owned by the buffer and
+ * are recycled, so a buffered reading takes 24 bytes instead of a 48-byte malloc() chunk. */
 typedef struct sbuffer sbuffer_t;
 
+/* A producer queue: a bounded ring owned by one producer thread (e.g. one connection), see sbuffer_queue_open() */
+typedef struct sbuffer_queue sbuffer_queue_t;
+
 int sbuffer_init(sbuffer_t **buffer);
+
+/* Same as sbuffer_init(), but with room for 'max_queues' producer queues next to the shared list.
+ * sbuffer_init() is sbuffer_init_queues() with 0 queues: every producer inserts in the shared list. */
+int sbuffer_init_queues(sbuffer_t **buffer, int max_queues);
 int sbuffer_free(sbuffer_t **buffer);
 
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, int reader_id);
+/* Sets the readers that take records, a mask of (1 << READER_*) bits; all SBUFFER_NUM_READERS by default.
+ * A record is only recycled once every one of them has taken it, so a reader without a thread must not be set.
+ * Call it before the first insert. */
+int sbuffer_set_readers(sbuffer_t *buffer, int reader_mask);
+
+/* Every reader sees every record, whether it was inserted in the shared list or in a producer queue.
+ * Records of one producer keep their order, the producer queues are drained round-robin. */
+int sbuffer_remove(sbuffer_t *buffer, sensor_record_t *record, int reader_id);
+
+/* Same as sbuffer_remove(), but also returns the monotonic time (see latency_now()) at which the record
+ * was inserted, so readers can measure how long it waited in the buffer. The stamp has a resolution of 1 us. */
+int sbuffer_remove_stamped(sbuffer_t *buffer, sensor_record_t *record, int reader_id, uint64_t *enqueue_ns);
+
+/* Same as sbuffer_remove_stamped(), but gives up at 'deadline_ns' (latency_now() time, 0 = never) and returns
+ * SBUFFER_TIMEOUT if no record arrived by then. Lets a reader act on time passing while no data comes in. */
+int sbuffer_remove_timed(sbuffer_t *buffer, sensor_record_t *record, int reader_id, uint64_t *enqueue_ns,
+                         uint64_t deadline_ns);
+
+int sbuffer_insert(sbuffer_t *buffer, sensor_record_t *record);
+
+/* Inserts 'count' records with a single lock round-trip.
+ * Records with id 0 are skipped here, the end-of-stream marker must be inserted with sbuffer_insert(). */
+int sbuffer_insert_batch(sbuffer_t *buffer, sensor_record_t *record, int count);
+
+/* Gives the calling producer its own queue: inserting takes no lock and never contends with other producers.
+ * When the queue is full the producer waits for the slowest reader, so a burst is held back in its socket.
+ * Returns NULL if the buffer has no free queue slot (or no memory); insert in the shared list then. */
+sbuffer_queue_t *sbuffer_queue_open(sbuffer_t *buffer);
+
+int sbuffer_queue_insert(sbuffer_queue_t *queue, sensor_record_t *record);
+
+/* Records with id 0 are skipped, the end-of-stream marker goes through sbuffer_insert() as before. */
+int sbuffer_queue_insert_batch(sbuffer_queue_t *queue, sensor_record_t *record, int count);
 
-int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data);
+/* Ends the queue: the readers drain what is left and then free it. The queue must not be used afterwards. */
+void sbuffer_queue_close(sbuffer_queue_t *queue);
 
 #endif  //_SBUFFER_H_
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,38 +6,90 @@
 #include "sensor_db.h"
 #include "config.h"
 #include "sbuffer.h"
+#include "latency.h"
+#include "metrics.h"
+#include "journal.h"
+#include "store.h"
+
+int storage_format_csv(char *buf, int size, sensor_record_t *record) {
+    return snprintf(buf, size, "%hu,%.4f,%ld%s\n", record->id, record_value(record), (long) record_ts(record),
+                    (record->flags & RECORD_FLAG_INVALID) ? ",invalid" : "");
+}
+
+// readings go to the segment store in blocks per sensor; the loop wakes up when a block is due
+static void store_run(storage_args_t *args) {
+    store_t *store = args->store;
+    sensor_record_t data;
+    int result;
+    char log_msg[128];
+    uint64_t enqueue_ns;
+
+    while (1) {
+        result = sbuffer_remove_timed(args->buffer, &data, READER_STORAGEMGR, &enqueue_ns,
+                                      store_next_flush(store));
+
+        if (result == SBUFFER_NO_DATA) {
+            break;
+        }
+        if (result == SBUFFER_SUCCESS) {
+            store_append(store, &data);
+            latency_record(LATENCY_ENQUEUE_TO_DISK, enqueue_ns);
+
+            snprintf(log_msg, sizeof(log_msg), "Data insertion from sensor %d succeeded", data.id);
+            write_to_log_process(log_msg);
+        }
+        store_tick(store, latency_now());
+    }
+
+    store_close(&store);
+    args->store = NULL;
+    write_to_log_process("The segment store has been closed");
+}
 
 void *storage_mgr_run(void *arg) {
-    sbuffer_t *buffer = (sbuffer_t *)arg;
-    sensor_data_t data;
+    storage_args_t *args = (storage_args_t *) arg;
+    sbuffer_t *buffer = args->buffer;
+    sensor_record_t data;
     int result;
     char log_msg[128];
-    FILE *csv_file;
+    char line[STORAGE_CSV_LINE_SIZE];
+    FILE *csv_file = args->csv_file;
+    uint64_t enqueue_ns;
 
-    csv_file = fopen("data.csv", "w");
-    if (csv_file == NULL) {
-        write_to_log_process("Error: Could not create data.csv");
+    if (args->store != NULL) {
+        store_run(args);
         return NULL;
     }
 
-    write_to_log_process("A new data.csv file has been created");
+    write_to_log_process(journal_active() ? "The data.csv file has been opened for appending"
+                                          : "A new data.csv file has been created");
 
     while (1) {
-        result = sbuffer_remove(buffer, &data, READER_STORAGEMGR);
+        result = sbuffer_remove_stamped(buffer, &data, READER_STORAGEMGR, &enqueue_ns);
 
         if (result == SBUFFER_NO_DATA) {
             break;
         }
 
-        fprintf(csv_file, "%hu,%.4f,%ld\n", data.id, data.value, data.ts);
+        storage_format_csv(line, sizeof(line), &data);
+        fputs(line, csv_file);
         fflush(csv_file);
+        metrics_add(METRIC_CSV_FLUSHES, 1);
+        latency_record(LATENCY_ENQUEUE_TO_DISK, enqueue_ns);
+        if (journal_release(&data)) {
+            // a whole journal segment is in data.csv: make that durable before the segment goes
+            fdatasync(fileno(csv_file));
+            journal_retire();
+        }
 
         // Log message: Data insertion from sensor <sensorNodeID> succeeded.
         snprintf(log_msg, sizeof(log_msg), "Data insertion from sensor %d succeeded", data.id);
         write_to_log_process(log_msg);
     }
 
+    if (journal_active()) fdatasync(fileno(csv_file));   // journal_close() drops the segments
     fclose(csv_file);
+    args->csv_file = NULL;
 
     write_to_log_process("The data.csv file has been closed");
 
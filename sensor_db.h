@@ -9,7 +9,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "config.h"
+#include "record.h"
+#include "sbuffer.h"
+#include "store.h"
 
-void *storage_mgr_run(void *buffer);
+// longest data.csv line with its NUL: a 5-digit id, a value printed with %.4f (up to 39 digits before the point
+// with RECORD_VALUE_SCALE 0), a 64-bit timestamp and ",invalid"
+#define STORAGE_CSV_LINE_SIZE 96
+
+typedef struct {
+    sbuffer_t *buffer;
+    store_t *store;             // NULL to write data.csv, else the opened segment store, closed by the thread
+    FILE *csv_file;             // data.csv when there is no store, opened by main() and closed by the thread
+} storage_args_t;
+
+/** Thread function: writes every reading of the buffer to data.csv or to the segment store
+ * \param args a storage_args_t, must stay valid until the thread exits
+ */
+void *storage_mgr_run(void *args);
+
+/* Formats one record as a data.csv line ("<id>,<value>,<ts>\n") into 'buf'; returns the length like snprintf.
+ * A reading tagged by validation (validate.h) gets a fourth column: "<id>,<value>,<ts>,invalid\n".
+ * A buffer of STORAGE_CSV_LINE_SIZE always holds the whole line. */
+int storage_format_csv(char *buf, int size, sensor_record_t *record);
 
 #endif /* _SENSOR_DB_H_ */
\ No newline at end of file
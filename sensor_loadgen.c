@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "config.h"
+#include "lib/tcpsock.h"
+
+// one reading on the wire: <sensor_id><temperature><timestamp>, packed (so not as a struct)
+#define RECORD_SIZE     (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define MAX_SENSOR_ID   65535   // id 0 is reserved as end-of-stream marker inside the gateway
+#define NSEC_PER_SEC    1000000000ULL
+
+#define INITIAL_TEMPERATURE    20
+#define TEMP_DEV        5    // max afwijking vorige temperatuur in 0.1 celsius
+
+typedef enum {
+    MODE_OPEN, MODE_CLOSED
+} loadgen_mode_t;
+
+typedef struct {
+    int num_sensors;
+    int num_connections;
+    int num_threads;
+    double rate;            // readings per second per sensor
+    int burst;              // readings per sensor sent back-to-back per tick
+    loadgen_mode_t mode;
+    long churn;             // reconnect after this many records on a connection, 0 = never
+    int duration;           // seconds
+    char *map_file;
+    char *server_ip;
+    int server_port;
+} loadgen_config_t;
+
+typedef struct {
+    tcpsock_t *socket;
+    int first_sensor;       // sensors [first_sensor, first_sensor + num_sensors) are sent on this connection
+    int num_sensors;
+    uint64_t next_due;      // monotonic ns at which the next tick is sent
+    long sent_since_connect;
+} loadgen_conn_t;
+
+typedef struct {
+    pthread_t thread;
+    loadgen_conn_t *conns;
+    int num_conns;
+    char *send_buf;
+    unsigned short xsubi[3];
+    // statistics, only read by main after the worker is joined
+    long records;
+    long bytes;
+    long connects;
+    long errors;
+    long late_ticks;
+    uint64_t max_lag;
+} loadgen_worker_t;
+
+static loadgen_config_t config = {
+        .num_sensors = 1000, .num_connections = 100, .num_threads = 4, .rate = 1.0, .burst = 1,
+        .mode = MODE_OPEN, .churn = 0, .duration = 10, .map_file = NULL
+};
+
+// per sensor state; every sensor belongs to exactly one connection, so to one worker
+static sensor_id_t *sensor_ids;
+static sensor_value_t *sensor_values;
+
+static uint64_t tick_ns;
+static uint64_t end_time;
+static volatile sig_atomic_t stop_requested = 0;
+
+void print_help(void);
+
+static void handle_stop(int signo) {
+    (void) signo;
+    stop_requested = 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = {.tv_sec = deadline / NSEC_PER_SEC, .tv_nsec = deadline % NSEC_PER_SEC};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/**
+ * Fills the sensor id table, either cycling through the ids of a room_sensor.map file or numbering from 1
+ * \return 0 on success, -1 if the map file can't be used
+ */
+static int load_sensor_ids(void) {
+    int i, n = 0;
+    sensor_id_t map_ids[MAX_SENSOR_ID];
+
+    if (config.map_file != NULL) {
+        FILE *fp = fopen(config.map_file, "r");
+        uint16_t room_id, sensor_id;
+        if (fp == NULL) return -1;
+        while (n < MAX_SENSOR_ID && fscanf(fp, "%hu %hu", &room_id, &sensor_id) == 2) {
+            if (sensor_id != 0) map_ids[n++] = sensor_id;
+        }
+        fclose(fp);
+        if (n == 0) return -1;
+    }
+    for (i = 0; i < config.num_sensors; i++) {
+        sensor_ids[i] = (n > 0) ? map_ids[i % n] : (sensor_id_t) (i % MAX_SENSOR_ID + 1);
+        sensor_values[i] = INITIAL_TEMPERATURE;
+    }
+    return 0;
+}
+
+static int conn_open(loadgen_worker_t *worker, loadgen_conn_t *conn) {
+    if (tcp_active_open(&conn->socket, config.server_port, config.server_ip) != TCP_NO_ERROR) {
+        conn->socket = NULL;
+        worker->errors++;
+        return -1;
+    }
+    conn->sent_since_connect = 0;
+    worker->connects++;
+    return 0;
+}
+
+static void conn_close(loadgen_conn_t *conn) {
+    if (conn->socket != NULL) tcp_close(&conn->socket);
+}
+
+/**
+ * Sends one tick on 'conn': 'burst' readings for every sensor of the connection, coalesced into one buffer
+ * \return 0 on success, -1 if the connection failed (it is closed and reopened on the next tick)
+ */
+static int conn_send_tick(loadgen_worker_t *worker, loadgen_conn_t *conn) {
+    char *p = worker->send_buf;
+    int i, b, bytes, total;
+    sensor_ts_t ts = time(NULL);
+
+    if (conn->socket == NULL && conn_open(worker, conn) != 0) return -1;
+
+    for (b = 0; b < config.burst; b++) {
+        for (i = conn->first_sensor; i < conn->first_sensor + conn->num_sensors; i++) {
+            sensor_values[i] += TEMP_DEV * ((erand48(worker->xsubi) - 0.5) / 10);
+            memcpy(p, &sensor_ids[i], sizeof(sensor_id_t));
+            p += sizeof(sensor_id_t);
+            memcpy(p, &sensor_values[i], sizeof(sensor_value_t));
+            p += sizeof(sensor_value_t);
+            memcpy(p, &ts, sizeof(sensor_ts_t));
+            p += sizeof(sensor_ts_t);
+        }
+    }
+
+    total = p - worker->send_buf;
+    for (p = worker->send_buf; p < worker->send_buf + total; p += bytes) {
+        bytes = worker->send_buf + total - p;
+        if (tcp_send(conn->socket, p, &bytes) != TCP_NO_ERROR) {
+            worker->errors++;
+            conn_close(conn);
+            return -1;
+        }
+    }
+
+    worker->records += total / RECORD_SIZE;
+    worker->bytes += total;
+    conn->sent_since_connect += total / RECORD_SIZE;
+    if (config.churn > 0 && conn->sent_since_connect >= config.churn) conn_close(conn);
+    return 0;
+}
+
+/**
+ * Open loop: every connection keeps a fixed schedule of one tick per 'tick_ns', whatever the send latency is;
+ * ticks that are due late are still all sent and the worst lag is reported.
+ * Closed loop: the next tick of a connection is scheduled 'tick_ns' after the previous send completed.
+ */
+static void *worker_run(void *arg) {
+    loadgen_worker_t *worker = (loadgen_worker_t *) arg;
+    uint64_t now = now_ns(), earliest;
+    int c;
+
+    while (!stop_requested && now < end_time) {
+        earliest = end_time;
+        for (c = 0; c < worker->num_conns; c++) {
+            loadgen_conn_t *conn = &worker->conns[c];
+            if (conn->next_due <= now) {
+                if (config.mode == MODE_OPEN) {
+                    uint64_t lag = now - conn->next_due;
+                    if (lag > worker->max_lag) worker->max_lag = lag;
+                    if (lag >= tick_ns) worker->late_ticks++;
+                    conn->next_due += tick_ns;
+                    conn_send_tick(worker, conn);
+                } else {
+                    conn_send_tick(worker, conn);
+                    conn->next_due = now_ns() + tick_ns;
+                }
+            }
+            if (conn->next_due < earliest) earliest = conn->next_due;
+        }
+        now = now_ns();
+        if (earliest > now) {
+            sleep_until(earliest);
+            now = now_ns();
+        }
+    }
+
+    for (c = 0; c < worker->num_conns; c++) conn_close(&worker->conns[c]);
+    return NULL;
+}
+
+static int parse_args(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:t:r:b:m:k:d:f:h")) != -1) {
+        switch (opt) {
+            case 's': config.num_sensors = atoi(optarg); break;
+            case 'c': config.num_connections = atoi(optarg); break;
+            case 't': config.num_threads = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'b': config.burst = atoi(optarg); break;
+            case 'k': config.churn = atol(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'f': config.map_file = optarg; break;
+            case 'm':
+                if (strcmp(optarg, "open") == 0) config.mode = MODE_OPEN;
+                else if (strcmp(optarg, "closed") == 0) config.mode = MODE_CLOSED;
+                else return -1;
+                break;
+            default: return -1;
+        }
+    }
+    if (argc - optind != 2) return -1;
+    config.server_ip = argv[optind];
+    config.server_port = atoi(argv[optind + 1]);
+
+    if (config.num_sensors < 1 || config.num_connections < 1 || config.num_threads < 1) return -1;
+    if (config.burst < 1 || config.duration < 1 || config.churn < 0) return -1;
+    if (config.rate < 0 || (config.mode == MODE_OPEN && config.rate == 0)) return -1;
+    if (config.num_connections > config.num_sensors) config.num_connections = config.num_sensors;
+    if (config.num_threads > config.num_connections) config.num_threads = config.num_connections;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    loadgen_worker_t *workers;
+    loadgen_conn_t *conns;
+    struct sigaction sa;
+    uint64_t start;
+    double elapsed;
+    long records = 0, bytes = 0, connects = 0, errors = 0, late_ticks = 0;
+    uint64_t max_lag = 0;
+    int c, w, max_sensors_per_conn;
+
+    if (parse_args(argc, argv) != 0) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    sensor_ids = malloc(config.num_sensors * sizeof(sensor_id_t));
+    sensor_values = malloc(config.num_sensors * sizeof(sensor_value_t));
+    conns = calloc(config.num_connections, sizeof(loadgen_conn_t));
+    workers = calloc(config.num_threads, sizeof(loadgen_worker_t));
+    if (sensor_ids == NULL || sensor_values == NULL || conns == NULL || workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (load_sensor_ids() != 0) {
+        fprintf(stderr, "Couldn't read sensor ids from %s\n", config.map_file);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // a tick sends 'burst' readings per sensor, so the mean rate per sensor stays 'rate'
+    tick_ns = (config.rate > 0) ? (uint64_t) (config.burst * NSEC_PER_SEC / config.rate) : 0;
+    start = now_ns();
+    end_time = start + (uint64_t) config.duration * NSEC_PER_SEC;
+
+    // sensors are spread evenly over the connections, connections round-robin over the workers;
+    // the first tick of every connection is staggered over one tick period to avoid a thundering herd
+    max_sensors_per_conn = (config.num_sensors + config.num_connections - 1) / config.num_connections;
+    for (c = 0; c < config.num_connections; c++) {
+        conns[c].first_sensor = (int) ((long) c * config.num_sensors / config.num_connections);
+        conns[c].num_sensors = (int) ((long) (c + 1) * config.num_sensors / config.num_connections) - conns[c].first_sensor;
+        conns[c].next_due = start + tick_ns * c / config.num_connections;
+    }
+    for (w = 0; w < config.num_threads; w++) {
+        int per_worker = config.num_connections / config.num_threads;
+        int extra = config.num_connections % config.num_threads;
+        int first = w * per_worker + (w < extra ? w : extra);
+        workers[w].conns = &conns[first];
+        workers[w].num_conns = per_worker + (w < extra ? 1 : 0);
+        workers[w].send_buf = malloc((size_t) max_sensors_per_conn * config.burst * RECORD_SIZE);
+        workers[w].xsubi[0] = (unsigned short) time(NULL);
+        workers[w].xsubi[1] = (unsigned short) w;
+        workers[w].xsubi[2] = (unsigned short) getpid();
+        if (workers[w].send_buf == NULL || pthread_create(&workers[w].thread, NULL, worker_run, &workers[w]) != 0) {
+            fprintf(stderr, "Failed to start worker %d\n", w);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (w = 0; w < config.num_threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+        records += workers[w].records;
+        bytes += workers[w].bytes;
+        connects += workers[w].connects;
+        errors += workers[w].errors;
+        late_ticks += workers[w].late_ticks;
+        if (workers[w].max_lag > max_lag) max_lag = workers[w].max_lag;
+        free(workers[w].send_buf);
+    }
+    elapsed = (double) (now_ns() - start) / NSEC_PER_SEC;
+
+    printf("mode: %s\n", config.mode == MODE_OPEN ? "open" : "closed");
+    printf("sensors: %d\n", config.num_sensors);
+    printf("connections: %d\n", config.num_connections);
+    printf("threads: %d\n", config.num_threads);
+    printf("elapsed_s: %.3f\n", elapsed);
+    printf("records: %ld\n", records);
+    printf("bytes: %ld\n", bytes);
+    printf("connects: %ld\n", connects);
+    printf("errors: %ld\n", errors);
+    if (config.rate > 0) printf("target_records_per_s: %.1f\n", config.rate * config.num_sensors);
+    printf("achieved_records_per_s: %.1f\n", records / elapsed);
+    printf("achieved_mbytes_per_s: %.3f\n", bytes / elapsed / 1e6);
+    if (config.mode == MODE_OPEN) {
+        printf("late_ticks: %ld\n", late_ticks);
+        printf("max_schedule_lag_ms: %.3f\n", (double) max_lag / 1e6);
+    }
+
+    free(workers);
+    free(conns);
+    free(sensor_ids);
+    free(sensor_values);
+    return (errors > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+void print_help(void) {
+    printf("Use this program as: sensor_loadgen [options] <server IP> <server port>\n");
+    printf("\t%-15s : number of simulated sensors (default 1000)\n", "-s sensors");
+    printf("\t%-15s : number of TCP connections, sensors are spread over them (default 100)\n", "-c connections");
+    printf("\t%-15s : number of sending threads (default 4)\n", "-t threads");
+    printf("\t%-15s : readings per second per sensor, 0 = no think time in closed mode (default 1)\n", "-r rate");
+    printf("\t%-15s : readings per sensor sent back-to-back, the mean rate stays 'rate' (default 1)\n", "-b burst");
+    printf("\t%-15s : 'open' keeps a constant schedule, 'closed' waits for each send (default open)\n", "-m mode");
+    printf("\t%-15s : reconnect after this many records per connection, 0 = never (default 0)\n", "-k churn");
+    printf("\t%-15s : test duration in sec (default 10)\n", "-d duration");
+    printf("\t%-15s : take sensor ids from a room_sensor.map file instead of 1..sensors\n", "-f map file");
+    printf("Every (re)connect counts against the <max_connections> of sensor_gateway\n");
+}
@@ -9,6 +9,13 @@
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "config.h"
 #include "lib/tcpsock.h"
 
@@ -49,12 +56,35 @@
 #define LOG_CLOSE(...) (void)0
 #endif
 
+// conditional compilation options to control client-side batching (both can be overruled on the command line)
+// a batch is flushed when BATCH_SIZE readings are buffered or FLUSH_INTERVAL seconds passed since the last flush
+// the default of 1 reading per batch sends every measurement immediately, as before
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 1
+#endif
+
+#ifndef FLUSH_INTERVAL
+#define FLUSH_INTERVAL 0
+#endif
+
+#define FIELDS_PER_READING  3   // <sensor_id><temperature><timestamp>
+#define MAX_BATCH_SIZE      (IOV_MAX / FIELDS_PER_READING)
+
 #define INITIAL_TEMPERATURE    20
 #define TEMP_DEV        5    // max afwijking vorige temperatuur in 0.1 celsius
 
 
 void print_help(void);
 
+int flush_batch(int sd, sensor_data_t *batch, int count);
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int signo) {
+    (void) signo;
+    stop_requested = 1;
+}
+
 /**
  * For starting the sensor node 4 command line arguments are needed. These should be given in the order below
  * and can then be used through the argv[] variable
@@ -63,18 +93,26 @@ void print_help(void);
  * argv[2] = sleep time
  * argv[3] = server IP
  * argv[4] = server port
+ *
+ * Two optional arguments enable batching:
+ * argv[5] = batch size (readings per flush, at most MAX_BATCH_SIZE)
+ * argv[6] = flush interval (in sec, 0 means only flush full batches)
  */
 
 int main(int argc, char *argv[]) {
     sensor_data_t data;
+    sensor_data_t batch[MAX_BATCH_SIZE];
     int server_port;
     char server_ip[] = "000.000.000.000";
     tcpsock_t *client;
-    int i, bytes, sleep_time;
+    int i, sd, sleep_time;
+    int batch_size = BATCH_SIZE, flush_interval = FLUSH_INTERVAL, batch_count = 0;
+    time_t last_flush;
+    struct sigaction sa;
 
     LOG_OPEN();
 
-    if (argc != 5) {
+    if (argc < 5 || argc > 7) {
         print_help();
         exit(EXIT_SUCCESS);
     } else {
@@ -83,29 +121,44 @@ int main(int argc, char *argv[]) {
         sleep_time = atoi(argv[2]);
         strncpy(server_ip, argv[3], strlen(server_ip));
         server_port = atoi(argv[4]);
+        if (argc > 5) batch_size = atoi(argv[5]);
+        if (argc > 6) flush_interval = atoi(argv[6]);
     }
+    if (batch_size < 1) batch_size = 1;
+    if (batch_size > MAX_BATCH_SIZE) batch_size = MAX_BATCH_SIZE;
+
+    // flush what is still buffered when the node is stopped (e.g. killall sensor_node)
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
     srand48(time(NULL));
 
     // open TCP connection to the server; server is listening to SERVER_IP and PORT
     if (tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+    if (tcp_get_sd(client, &sd) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+    // every flush is coalesced into one sendmsg() by ourselves, so Nagle would only add delay
+    int one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
     data.value = INITIAL_TEMPERATURE;
+    time(&last_flush);
     i = LOOPS;
-    while (i) {
+    while (i && !stop_requested) {
         data.value = data.value + TEMP_DEV * ((drand48() - 0.5) / 10);
         time(&data.ts);
-        // send data to server in this order (!!): <sensor_id><temperature><timestamp>
-        // remark: don't send as a struct!
-        bytes = sizeof(data.id);
-        if (tcp_send(client, (void *) &data.id, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.value);
-        if (tcp_send(client, (void *) &data.value, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
-        bytes = sizeof(data.ts);
-        if (tcp_send(client, (void *) &data.ts, &bytes) != TCP_NO_ERROR) exit(EXIT_FAILURE);
+        batch[batch_count++] = data;
         LOG_PRINTF(data.id, data.value, data.ts);
+        if (batch_count == batch_size || (flush_interval > 0 && data.ts - last_flush >= flush_interval)) {
+            if (flush_batch(sd, batch, batch_count) != 0) exit(EXIT_FAILURE);
+            batch_count = 0;
+            last_flush = data.ts;
+        }
         sleep(sleep_time);
         UPDATE(i);
     }
+    if (batch_count > 0 && flush_batch(sd, batch, batch_count) != 0) exit(EXIT_FAILURE);
 
     if (tcp_close(&client) != TCP_NO_ERROR) exit(EXIT_FAILURE);
 
@@ -114,13 +167,60 @@ int main(int argc, char *argv[]) {
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * Sends 'count' readings with a single sendmsg() (looping only on partial writes)
+ * The fields are sent in this order (!!): <sensor_id><temperature><timestamp>, so not as a struct
+ * The socket is corked while the batch is written and uncorked afterwards to push out the last segment
+ * \return 0 on success, -1 if the connection failed
+ */
+int flush_batch(int sd, sensor_data_t *batch, int count) {
+    struct iovec iov[MAX_BATCH_SIZE * FIELDS_PER_READING];
+    struct msghdr msg;
+    struct iovec *next = iov;
+    int remaining_iov = count * FIELDS_PER_READING;
+    int cork = 1, j;
+    ssize_t sent;
+
+    for (j = 0; j < count; j++) {
+        iov[j * FIELDS_PER_READING] = (struct iovec) {&batch[j].id, sizeof(batch[j].id)};
+        iov[j * FIELDS_PER_READING + 1] = (struct iovec) {&batch[j].value, sizeof(batch[j].value)};
+        iov[j * FIELDS_PER_READING + 2] = (struct iovec) {&batch[j].ts, sizeof(batch[j].ts)};
+    }
+
+    setsockopt(sd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    while (remaining_iov > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = next;
+        msg.msg_iovlen = remaining_iov;
+        // use MSG_NOSIGNAL flag to avoid a SIGPIPE when the gateway closed the connection
+        sent = sendmsg(sd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        // skip what was sent; a partially sent field stays in the vector with an adjusted base
+        while (remaining_iov > 0 && (size_t) sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            remaining_iov--;
+        }
+        if (remaining_iov > 0) {
+            next->iov_base = (char *) next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    cork = 0;
+    setsockopt(sd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    return 0;
+}
+
 /**
  * Helper method to print a message on how to use this application
  */
 void print_help(void) {
-    printf("Use this program with 4 command line options: \n");
+    printf("Use this program with 4 (or up to 6) command line options: \n");
     printf("\t%-15s : a unique sensor node ID\n", "\'ID\'");
     printf("\t%-15s : node sleep time (in sec) between two measurements\n", "\'sleep time\'");
     printf("\t%-15s : TCP server IP address\n", "\'server IP\'");
     printf("\t%-15s : TCP server port number\n", "\'server port\'");
+    printf("\t%-15s : (optional) readings per flush, 1 to %d (default %d)\n", "\'batch size\'", MAX_BATCH_SIZE, BATCH_SIZE);
+    printf("\t%-15s : (optional) max sec between flushes, 0 = only full batches (default %d)\n", "\'flush interval\'", FLUSH_INTERVAL);
 }
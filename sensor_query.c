@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "store.h"
+
+/*
+ * Range queries over the segment store of the gateway (sensor_gateway --storage-dir). Segments whose header
+ * ranges miss the query are skipped, a sealed index is binary searched for the sensor, blocks inside the range
+ * are answered from their index entry and only the blocks at the edges of the range are read from the .dat file.
+ * Readings tagged invalid by the gateway (STORE_BLOCK_INVALID) are listed with an "invalid" column and left out of
+ * the aggregates.
+ */
+
+#define LANES 8                     // independent accumulators in the scans, enough for 256-bit vectors
+#define MAX_BUCKETS (1L << 24)
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef enum {AGG_NONE, AGG_MIN, AGG_MAX, AGG_AVG, AGG_COUNT} agg_kind_t;
+
+typedef struct {
+    long count;
+    double sum, min, max;
+} query_agg_t;
+
+typedef struct {
+    int64_t ts;
+    double value;
+    int invalid;
+} query_reading_t;
+
+typedef struct {
+    const store_index_header_t *header;
+    const store_index_entry_t *entries;
+    long num_entries;
+    size_t index_size;
+    const char *data;               // the .dat file, mapped on first use
+    size_t data_size;
+    char data_path[PATH_MAX + 32];
+} query_segment_t;
+
+static const char *store_dir = "store";
+static long sensor = -1;
+static int64_t from = INT64_MIN, to = INT64_MIN;
+static agg_kind_t agg_kind = AGG_NONE;
+static int64_t bucket = 0;
+static int show_stats = 0;
+
+static query_agg_t total;
+static query_agg_t *buckets;        // with bucket=, one per bucket from first_bucket on
+static int64_t first_bucket;
+static long num_buckets;
+static query_reading_t *readings;   // without agg=
+static long num_readings, cap_readings;
+
+static struct {
+    long segments, segments_pruned;
+    long blocks, blocks_from_index, blocks_scanned;
+    uint64_t bytes_read;
+} stats;
+
+void print_help(void);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// start of the bucket that holds 'ts', rounding down for negative timestamps as well
+static int64_t bucket_start(int64_t ts) {
+    int64_t rem = ts % bucket;
+    return ts - ((rem < 0) ? rem + bucket : rem);
+}
+
+static query_agg_t *agg_of(int64_t ts) {
+    return (bucket == 0) ? &total : &buckets[(bucket_start(ts) - first_bucket) / bucket];
+}
+
+static void agg_add(query_agg_t *agg, long count, double sum, double min, double max) {
+    if (count == 0) return;
+    if (agg->count == 0 || min < agg->min) agg->min = min;
+    if (agg->count == 0 || max > agg->max) agg->max = max;
+    agg->count += count;
+    agg->sum += sum;
+}
+
+static double decode(const query_segment_t *segment, store_value_t raw) {
+    int32_t scale = segment->header->value_scale, fixed;
+    float value;
+    if (scale > 0) {
+        memcpy(&fixed, &raw, sizeof(fixed));
+        return (double) fixed / scale;
+    }
+    memcpy(&value, &raw, sizeof(value));
+    return value;
+}
+
+/* Count, sum, min and max of 'n' fixed point values. Every lane keeps its own accumulators, so the inner loop
+ * has no dependency between its iterations and compiles to vector adds, mins and maxes. */
+static void scan_fixed(const int32_t *values, long n, int32_t scale, query_agg_t *agg) {
+    int64_t sum[LANES] = {0}, s = 0;
+    int32_t lo[LANES], hi[LANES];
+    long i = 0;
+
+    if (n <= 0) return;
+    for (int l = 0; l < LANES; l++) lo[l] = hi[l] = values[0];
+    for (; i + LANES <= n; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            int32_t v = values[i + l];
+            sum[l] += v;
+            lo[l] = (v < lo[l]) ? v : lo[l];
+            hi[l] = (v > hi[l]) ? v : hi[l];
+        }
+    }
+    for (; i < n; i++) {
+        sum[0] += values[i];
+        lo[0] = (values[i] < lo[0]) ? values[i] : lo[0];
+        hi[0] = (values[i] > hi[0]) ? values[i] : hi[0];
+    }
+    for (int l = 1; l < LANES; l++) {
+        lo[0] = (lo[l] < lo[0]) ? lo[l] : lo[0];
+        hi[0] = (hi[l] > hi[0]) ? hi[l] : hi[0];
+    }
+    for (int l = 0; l < LANES; l++) s += sum[l];
+    agg_add(agg, n, (double) s / scale, (double) lo[0] / scale, (double) hi[0] / scale);
+}
+
+// the same for float values (RECORD_VALUE_SCALE 0), summed in double
+static void scan_float(const float *values, long n, query_agg_t *agg) {
+    double sum[LANES] = {0}, s = 0;
+    float lo[LANES], hi[LANES];
+    long i = 0;
+
+    if (n <= 0) return;
+    for (int l = 0; l < LANES; l++) lo[l] = hi[l] = values[0];
+    for (; i + LANES <= n; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            float v = values[i + l];
+            sum[l] += v;
+            lo[l] = (v < lo[l]) ? v : lo[l];
+            hi[l] = (v > hi[l]) ? v : hi[l];
+        }
+    }
+    for (; i < n; i++) {
+        sum[0] += values[i];
+        lo[0] = (values[i] < lo[0]) ? values[i] : lo[0];
+        hi[0] = (values[i] > hi[0]) ? values[i] : hi[0];
+    }
+    for (int l = 1; l < LANES; l++) {
+        lo[0] = (lo[l] < lo[0]) ? lo[l] : lo[0];
+        hi[0] = (hi[l] > hi[0]) ? hi[l] : hi[0];
+    }
+    for (int l = 0; l < LANES; l++) s += sum[l];
+    agg_add(agg, n, s, lo[0], hi[0]);
+}
+
+static void scan_values(const query_segment_t *segment, const store_value_t *values, long n, query_agg_t *agg) {
+    if (agg_kind == AGG_COUNT) {
+        agg_add(agg, n, 0, 0, 0);   // the timestamps alone answer it
+    } else if (segment->header->value_scale > 0) {
+        scan_fixed((const int32_t *) values, n, segment->header->value_scale, agg);
+    } else {
+        scan_float((const float *) values, n, agg);
+    }
+}
+
+// first position in the sorted timestamps of a block at or after 'ts' (record time)
+static long lower_bound_ts(const uint32_t *ts, long n, int64_t key) {
+    long lo = 0, hi = n;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if ((int64_t) ts[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int add_reading(int64_t ts, double value, int invalid) {
+    if (num_readings == cap_readings) {
+        long cap = cap_readings ? cap_readings * 2 : 1024;
+        query_reading_t *grown = realloc(readings, cap * sizeof(query_reading_t));
+        if (grown == NULL) return -1;
+        readings = grown;
+        cap_readings = cap;
+    }
+    readings[num_readings++] = (query_reading_t) {.ts = ts, .value = value, .invalid = invalid};
+    return 0;
+}
+
+static int map_data(query_segment_t *segment) {
+    struct stat st;
+    int fd;
+
+    if (segment->data != NULL) return 0;
+    fd = open(segment->data_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    segment->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment->data == MAP_FAILED) {
+        segment->data = NULL;
+        return -1;
+    }
+    segment->data_size = st.st_size;
+    return 0;
+}
+
+static int query_block(query_segment_t *segment, const store_index_entry_t *entry) {
+    int64_t base = segment->header->epoch_base;
+    int64_t ts_min = entry->ts_min + base, ts_max = entry->ts_max + base;
+
+    if (ts_max < from || ts_min >= to) return 0;
+    if (agg_kind != AGG_NONE && (entry->flags & STORE_BLOCK_INVALID)) return 0;
+    stats.blocks++;
+
+    // a block inside the range (and inside one bucket) is answered by its index entry
+    if (agg_kind != AGG_NONE && ts_min >= from && ts_max < to &&
+        (bucket == 0 || bucket_start(ts_min) == bucket_start(ts_max))) {
+        double sum = (segment->header->value_scale > 0) ? entry->sum / segment->header->value_scale : entry->sum;
+        agg_add(agg_of(ts_min), entry->count, sum, decode(segment, entry->value_min),
+                decode(segment, entry->value_max));
+        stats.blocks_from_index++;
+        return 0;
+    }
+
+    if (map_data(segment) != 0 || entry->offset + 2ull * entry->count * sizeof(uint32_t) > segment->data_size) {
+        fprintf(stderr, "Skipping a block past the end of %s\n", segment->data_path);
+        return 0;
+    }
+    stats.blocks_scanned++;
+    stats.bytes_read += 2ull * entry->count * sizeof(uint32_t);
+
+    const uint32_t *ts = (const uint32_t *) (segment->data + entry->offset);
+    const store_value_t *values = (const store_value_t *) (ts + entry->count);
+    long lo = lower_bound_ts(ts, entry->count, from - base);
+    long hi = lower_bound_ts(ts, entry->count, (to == INT64_MAX) ? INT64_MAX : to - base);
+
+    if (agg_kind == AGG_NONE) {
+        for (long i = lo; i < hi; i++) {
+            if (add_reading(ts[i] + base, decode(segment, values[i]), entry->flags & STORE_BLOCK_INVALID) != 0) {
+                return -1;
+            }
+        }
+    } else if (bucket == 0) {
+        scan_values(segment, &values[lo], hi - lo, &total);
+    } else {
+        // the timestamps are sorted, so each bucket is one run of the block
+        for (long i = lo, end; i < hi; i = end) {
+            int64_t start = bucket_start(ts[i] + base);
+            end = i + lower_bound_ts(&ts[i], hi - i, start + bucket - base);
+            scan_values(segment, &values[i], end - i, agg_of(start));
+        }
+    }
+    return 0;
+}
+
+// first entry of 'sensor' in a sealed index, which is sorted by sensor and timestamp
+static long lower_bound_sensor(const store_index_entry_t *entries, long n) {
+    long lo = 0, hi = n;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (entries[mid].sensor < sensor) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int query_segment(const char *index_path) {
+    query_segment_t segment = {0};
+    struct stat st;
+    const store_index_header_t *header;
+    int fd, result = 0;
+
+    fd = open(index_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(store_index_header_t)) {
+        if (fd >= 0) close(fd);
+        return 0;   // being created by the gateway
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) return -1;
+    if (memcmp(header->magic, STORE_INDEX_MAGIC, 8) != 0 || header->entry_size != sizeof(store_index_entry_t)) {
+        fprintf(stderr, "Skipping %s: not a store index of this version\n", index_path);
+        munmap((void *) header, st.st_size);
+        return 0;
+    }
+    segment.header = header;
+    segment.entries = (const store_index_entry_t *) (header + 1);
+    // the gateway may be appending to the last index, an entry that is not complete yet is left out
+    segment.num_entries = (st.st_size - sizeof(store_index_header_t)) / sizeof(store_index_entry_t);
+    segment.index_size = st.st_size;
+    snprintf(segment.data_path, sizeof(segment.data_path), "%.*s.dat", (int) (strlen(index_path) - 4), index_path);
+    stats.segments++;
+    stats.bytes_read += sizeof(store_index_header_t);
+
+    if (header->sealed) {
+        if (sensor < header->sensor_min || sensor > header->sensor_max ||
+            header->ts_max + header->epoch_base < from || header->ts_min + header->epoch_base >= to) {
+            stats.segments_pruned++;
+        } else {
+            long first = lower_bound_sensor(segment.entries, segment.num_entries), i;
+            for (i = first; i < segment.num_entries && segment.entries[i].sensor == sensor && result == 0; i++) {
+                if (segment.entries[i].ts_min + header->epoch_base >= to) break;
+                result = query_block(&segment, &segment.entries[i]);
+            }
+            stats.bytes_read += (i - first + 1) * sizeof(store_index_entry_t);
+        }
+    } else {
+        for (long i = 0; i < segment.num_entries && result == 0; i++) {
+            if (segment.entries[i].sensor == sensor) result = query_block(&segment, &segment.entries[i]);
+        }
+        stats.bytes_read += segment.num_entries * sizeof(store_index_entry_t);
+    }
+
+    if (segment.data != NULL) munmap((void *) segment.data, segment.data_size);
+    munmap((void *) header, st.st_size);
+    return result;
+}
+
+static int compare_readings(const void *x, const void *y) {
+    const query_reading_t *a = x, *b = y;
+    if (a->ts != b->ts) return (a->ts < b->ts) ? -1 : 1;
+    return (a->value < b->value) ? -1 : (a->value > b->value);
+}
+
+static void print_agg(const query_agg_t *agg) {
+    switch (agg_kind) {
+        case AGG_COUNT: printf("%ld\n", agg->count); break;
+        case AGG_MIN: printf("%.4f\n", agg->min); break;
+        case AGG_MAX: printf("%.4f\n", agg->max); break;
+        case AGG_AVG: printf("%.4f\n", agg->sum / agg->count); break;
+        default: break;
+    }
+}
+
+// "60", "60s", "5m", "1h" or "1d"
+static int64_t parse_duration(const char *text) {
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    int64_t unit = (*end == '\0' || strcmp(end, "s") == 0) ? 1 : (strcmp(end, "m") == 0) ? 60 :
+                   (strcmp(end, "h") == 0) ? 3600 : (strcmp(end, "d") == 0) ? 86400 : 0;
+    return (end == text || unit == 0 || n <= 0) ? -1 : n * unit;
+}
+
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        char *value = strchr(argv[i], '=');
+        char *end;
+        if (value == NULL) return -1;
+        *value++ = '\0';
+        if (strcmp(argv[i], "sensor") == 0) {
+            sensor = strtol(value, &end, 10);
+            if (*end != '\0' || sensor < 1 || sensor > UINT16_MAX) return -1;
+        } else if (strcmp(argv[i], "from") == 0) {
+            from = strtoll(value, &end, 10);
+            if (*end != '\0') return -1;
+        } else if (strcmp(argv[i], "to") == 0) {
+            to = strtoll(value, &end, 10);
+            if (*end != '\0') return -1;
+        } else if (strcmp(argv[i], "agg") == 0) {
+            agg_kind = (strcmp(value, "min") == 0) ? AGG_MIN : (strcmp(value, "max") == 0) ? AGG_MAX :
+                       (strcmp(value, "avg") == 0) ? AGG_AVG : (strcmp(value, "count") == 0) ? AGG_COUNT : AGG_NONE;
+            if (agg_kind == AGG_NONE) return -1;
+        } else if (strcmp(argv[i], "bucket") == 0) {
+            if ((bucket = parse_duration(value)) < 0) return -1;
+        } else if (strcmp(argv[i], "dir") == 0) {
+            store_dir = value;
+        } else if (strcmp(argv[i], "stats") == 0) {
+            show_stats = atoi(value);
+        } else {
+            return -1;
+        }
+    }
+    if (sensor < 0 || from == INT64_MIN || to == INT64_MIN || from >= to) return -1;
+    if (bucket > 0 && agg_kind == AGG_NONE) return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char path[PATH_MAX + 32];
+    struct dirent *dirent;
+    uint64_t start = now_ns();
+    int failed = 0;
+    DIR *dir;
+
+    if (parse_args(argc, argv) != 0) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+    if (bucket > 0) {
+        first_bucket = bucket_start(from);
+        num_buckets = (to - first_bucket + bucket - 1) / bucket;
+        if (num_buckets > MAX_BUCKETS) {
+            fprintf(stderr, "More than %ld buckets, use a larger bucket=\n", MAX_BUCKETS);
+            exit(EXIT_FAILURE);
+        }
+        buckets = calloc(num_buckets, sizeof(query_agg_t));
+        if (buckets == NULL) exit(EXIT_FAILURE);
+    }
+
+    dir = opendir(store_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "Couldn't open the store directory %s\n", store_dir);
+        exit(EXIT_FAILURE);
+    }
+    while (!failed && (dirent = readdir(dir)) != NULL) {
+        unsigned seq;
+        int end = 0;
+        if (sscanf(dirent->d_name, "segment-%u.idx%n", &seq, &end) != 1 || end == 0 || dirent->d_name[end] != '\0') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", store_dir, dirent->d_name);
+        if (query_segment(path) != 0) failed = 1;
+    }
+    closedir(dir);
+    if (failed) {
+        fprintf(stderr, "Query failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (agg_kind == AGG_NONE) {
+        qsort(readings, num_readings, sizeof(query_reading_t), compare_readings);
+        for (long i = 0; i < num_readings; i++) {
+            printf("%ld,%.4f,%lld%s\n", sensor, readings[i].value, (long long) readings[i].ts,
+                   readings[i].invalid ? ",invalid" : "");
+        }
+    } else if (bucket == 0) {
+        if (total.count > 0 || agg_kind == AGG_COUNT) print_agg(&total);
+    } else {
+        for (long b = 0; b < num_buckets; b++) {
+            if (buckets[b].count == 0) continue;
+            printf("%lld,", (long long) (first_bucket + b * bucket));
+            print_agg(&buckets[b]);
+        }
+    }
+
+    if (show_stats) {
+        fprintf(stderr, "segments: %ld\n", stats.segments);
+        fprintf(stderr, "segments_pruned: %ld\n", stats.segments_pruned);
+        fprintf(stderr, "blocks: %ld\n", stats.blocks);
+        fprintf(stderr, "blocks_from_index: %ld\n", stats.blocks_from_index);
+        fprintf(stderr, "blocks_scanned: %ld\n", stats.blocks_scanned);
+        fprintf(stderr, "bytes_read: %llu\n", (unsigned long long) stats.bytes_read);
+        fprintf(stderr, "elapsed_ms: %.3f\n", (now_ns() - start) / 1e6);
+    }
+    free(buckets);
+    free(readings);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+void print_help(void) {
+    printf("Use this program as: sensor_query sensor=<id> from=<ts> to=<ts> [agg=min|max|avg|count] [bucket=60s] "
+           "[dir=<store dir>] [stats=1]\n");
+    printf("\t%-15s : readings of this sensor id, tagged ones end in \",invalid\" and count in no aggregate\n",
+           "sensor=<id>");
+    printf("\t%-15s : with from <= timestamp < to (seconds since the epoch)\n", "from=, to=");
+    printf("\t%-15s : print one aggregate instead of the readings (\"<id>,<value>,<ts>\" like data.csv)\n",
+           "agg=");
+    printf("\t%-15s : one aggregate per bucket of this length (s, m, h or d), as \"<bucket start>,<value>\"\n",
+           "bucket=");
+    printf("\t%-15s : the --storage-dir of the gateway (default store)\n", "dir=");
+    printf("\t%-15s : print the segments and blocks read on stderr\n", "stats=1");
+}
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "record.h"
+#include "lib/tcpsock.h"
+
+// one record in the file and on the wire: <sensor_id><temperature><timestamp>, packed (so not as a struct)
+#define RECORD_SIZE     (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define SEND_BUF_SIZE   (4096 * RECORD_SIZE)
+#define CSV_LINE_SIZE   96      // STORAGE_CSV_LINE_SIZE of sensor_db.h
+#define NSEC_PER_SEC    1000000000ULL
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    long records;
+    long bytes;
+    int failed;
+} replay_conn_t;
+
+static char *server_ip;
+static int server_port;
+static int num_connections = 4;
+static double speed = 0;        // 0 = line rate, otherwise file seconds per wall clock second
+static char *verify_file = NULL;
+static int verify_wait = 30;
+
+static const char *records;     // the mmap'ed input file
+static long num_records;
+static sensor_ts_t first_ts;
+static uint64_t start_time;
+// sensor id -> connection, in order of first appearance so the connections get an even share of sensors
+static int conn_of_sensor[UINT16_MAX + 1];
+
+void print_help(void);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static sensor_id_t input_id(long i) {
+    sensor_id_t id;
+    memcpy(&id, records + i * RECORD_SIZE, sizeof(id));
+    return id;
+}
+
+static sensor_value_t input_value(long i) {
+    sensor_value_t value;
+    memcpy(&value, records + i * RECORD_SIZE + sizeof(sensor_id_t), sizeof(value));
+    return value;
+}
+
+static sensor_ts_t input_ts(long i) {
+    sensor_ts_t ts;
+    memcpy(&ts, records + i * RECORD_SIZE + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(ts));
+    return ts;
+}
+
+static int send_all(replay_conn_t *conn, tcpsock_t *client, char *buf, int len) {
+    int bytes;
+    for (char *p = buf; p < buf + len; p += bytes) {
+        bytes = buf + len - p;
+        if (tcp_send(client, p, &bytes) != TCP_NO_ERROR) return -1;
+    }
+    conn->bytes += len;
+    return 0;
+}
+
+/**
+ * Streams all records of the sensors assigned to this connection, in file order.
+ * At line rate records are copied straight from the mapping in large chunks; in time-scaled mode the
+ * connection sleeps until a record is due, so records with the same timestamp still leave as one chunk.
+ */
+static void *conn_run(void *arg) {
+    replay_conn_t *conn = (replay_conn_t *) arg;
+    tcpsock_t *client;
+    char *buf = malloc(SEND_BUF_SIZE);
+    int len = 0;
+
+    if (buf == NULL || tcp_active_open(&client, server_port, server_ip) != TCP_NO_ERROR) {
+        free(buf);
+        conn->failed = 1;
+        return NULL;
+    }
+
+    for (long i = 0; i < num_records && !conn->failed; i++) {
+        sensor_id_t id = input_id(i);
+        if (id == 0 || conn_of_sensor[id] != conn->index) continue;
+        if (speed > 0) {
+            uint64_t due = start_time + (uint64_t) ((input_ts(i) - first_ts) * (NSEC_PER_SEC / speed));
+            if (due > now_ns()) {
+                if (len > 0 && send_all(conn, client, buf, len) != 0) conn->failed = 1;
+                len = 0;
+                struct timespec ts = {.tv_sec = due / NSEC_PER_SEC, .tv_nsec = due % NSEC_PER_SEC};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+        }
+        memcpy(buf + len, records + i * RECORD_SIZE, RECORD_SIZE);
+        len += RECORD_SIZE;
+        conn->records++;
+        if (len == SEND_BUF_SIZE) {
+            if (send_all(conn, client, buf, len) != 0) conn->failed = 1;
+            len = 0;
+        }
+    }
+    if (!conn->failed && len > 0 && send_all(conn, client, buf, len) != 0) conn->failed = 1;
+
+    tcp_close(&client);
+    free(buf);
+    return NULL;
+}
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b);
+}
+
+static long count_lines(const char *path) {
+    FILE *fp = fopen(path, "r");
+    long lines = 0;
+    int c;
+    if (fp == NULL) return -1;
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\n') lines++;
+    }
+    fclose(fp);
+    return lines;
+}
+
+/**
+ * Checks that 'verify_file' holds exactly the replayed records (as a multiset, order between sensors is free)
+ * The gateway writes every record with "%hu,%.4f,%ld" after record_pack(), so the input goes through the same
+ * packing (which keeps RECORD_VALUE_SCALE precision, record.h) and is formatted the same way, and both are sorted.
+ * Readings the gateway tagged as invalid (--validate tag) have a fourth column ",invalid"; they are compared without
+ * it and counted.
+ * \return 0 if both sets are equal, -1 otherwise
+ */
+static int verify(long expected) {
+    char (*want)[CSV_LINE_SIZE] = malloc(expected * CSV_LINE_SIZE);
+    char (*got)[CSV_LINE_SIZE] = NULL;
+    long n_want = 0, n_got = 0, lines, missing = 0, extra = 0, invalid = 0, i, j;
+    uint64_t deadline = now_ns() + (uint64_t) verify_wait * NSEC_PER_SEC;
+    FILE *fp;
+
+    // the gateway may still be draining its buffer; wait until the file stops growing short of the target
+    while ((lines = count_lines(verify_file)) < expected && now_ns() < deadline) usleep(100000);
+    if (lines < 0 || want == NULL) {
+        fprintf(stderr, "Couldn't read %s\n", verify_file);
+        free(want);
+        return -1;
+    }
+
+    for (i = 0; i < num_records; i++) {
+        if (input_id(i) == 0) continue;
+        sensor_data_t data = {.id = input_id(i), .value = input_value(i), .ts = input_ts(i)};
+        sensor_record_t record = record_pack(&data);
+        snprintf(want[n_want++], CSV_LINE_SIZE, "%hu,%.4f,%ld", record.id, record_value(&record),
+                 (long) record_ts(&record));
+    }
+    got = malloc((lines > 0 ? lines : 1) * CSV_LINE_SIZE);
+    fp = fopen(verify_file, "r");
+    if (got == NULL || fp == NULL) {
+        fprintf(stderr, "Couldn't read %s\n", verify_file);
+        free(want);
+        free(got);
+        if (fp) fclose(fp);
+        return -1;
+    }
+    while (n_got < lines && fgets(got[n_got], CSV_LINE_SIZE, fp) != NULL) {
+        size_t len = strcspn(got[n_got], "\n");
+        got[n_got][len] = 0;
+        if (len > strlen(",invalid") && strcmp(got[n_got] + len - strlen(",invalid"), ",invalid") == 0) {
+            got[n_got][len - strlen(",invalid")] = 0;
+            invalid++;
+        }
+        n_got++;
+    }
+    fclose(fp);
+
+    qsort(want, n_want, CSV_LINE_SIZE, compare_lines);
+    qsort(got, n_got, CSV_LINE_SIZE, compare_lines);
+    for (i = 0, j = 0; i < n_want || j < n_got;) {
+        int cmp = (i == n_want) ? 1 : (j == n_got) ? -1 : strcmp(want[i], got[j]);
+        if (cmp == 0) {
+            i++;
+            j++;
+        } else if (cmp < 0) {
+            if (missing++ < 5) fprintf(stderr, "missing: %s\n", want[i]);
+            i++;
+        } else {
+            if (extra++ < 5) fprintf(stderr, "unexpected: %s\n", got[j]);
+            j++;
+        }
+    }
+    printf("verify_expected: %ld\n", n_want);
+    printf("verify_found: %ld\n", n_got);
+    printf("verify_tagged_invalid: %ld\n", invalid);
+    printf("verify_missing: %ld\n", missing);
+    printf("verify_unexpected: %ld\n", extra);
+    printf("verify: %s\n", (missing == 0 && extra == 0) ? "OK" : "FAILED");
+    free(want);
+    free(got);
+    return (missing == 0 && extra == 0) ? 0 : -1;
+}
+
+static int parse_args(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:x:v:w:h")) != -1) {
+        switch (opt) {
+            case 'c': num_connections = atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'v': verify_file = optarg; break;
+            case 'w': verify_wait = atoi(optarg); break;
+            default: return -1;
+        }
+    }
+    if (argc - optind != 3 || num_connections < 1 || speed < 0) return -1;
+    server_ip = argv[optind + 1];
+    server_port = atoi(argv[optind + 2]);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    replay_conn_t *conns;
+    struct stat st;
+    long sent = 0, bytes = 0, skipped = 0;
+    int fd, c, sensors = 0, failed = 0;
+    double elapsed;
+
+    if (parse_args(argc, argv) != 0) {
+        print_help();
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Couldn't open %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    num_records = st.st_size / RECORD_SIZE;
+    if (st.st_size % RECORD_SIZE != 0) fprintf(stderr, "Ignoring %ld trailing bytes\n", (long) (st.st_size % RECORD_SIZE));
+    if (num_records == 0) {
+        fprintf(stderr, "No records in %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    records = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (records == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *) records, st.st_size, MADV_SEQUENTIAL);
+
+    // id 0 is the end-of-stream marker inside the gateway, so such records can't be replayed
+    for (c = 0; c <= UINT16_MAX; c++) conn_of_sensor[c] = -1;
+    first_ts = input_ts(0);
+    for (long i = 0; i < num_records; i++) {
+        sensor_id_t id = input_id(i);
+        if (id == 0) {
+            skipped++;
+            continue;
+        }
+        if (conn_of_sensor[id] == -1) conn_of_sensor[id] = sensors++ % num_connections;
+        if (input_ts(i) < first_ts) first_ts = input_ts(i);
+    }
+    if (num_connections > sensors) num_connections = sensors;
+
+    conns = calloc(num_connections, sizeof(replay_conn_t));
+    if (conns == NULL) exit(EXIT_FAILURE);
+    start_time = now_ns();
+    for (c = 0; c < num_connections; c++) {
+        conns[c].index = c;
+        if (pthread_create(&conns[c].thread, NULL, conn_run, &conns[c]) != 0) {
+            fprintf(stderr, "Failed to start connection %d\n", c);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (c = 0; c < num_connections; c++) {
+        pthread_join(conns[c].thread, NULL);
+        sent += conns[c].records;
+        bytes += conns[c].bytes;
+        failed += conns[c].failed;
+    }
+    elapsed = (double) (now_ns() - start_time) / NSEC_PER_SEC;
+
+    printf("connections: %d\n", num_connections);
+    printf("sensors: %d\n", sensors);
+    printf("records: %ld\n", sent);
+    printf("skipped_id0: %ld\n", skipped);
+    printf("failed_connections: %d\n", failed);
+    printf("elapsed_s: %.3f\n", elapsed);
+    printf("records_per_s: %.1f\n", sent / elapsed);
+    printf("mbytes_per_s: %.3f\n", bytes / elapsed / 1e6);
+
+    if (failed == 0 && verify_file != NULL && verify(num_records - skipped) != 0) failed = 1;
+
+    munmap((void *) records, st.st_size);
+    free(conns);
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Helper method to print a message on how to use this application
+ */
+void print_help(void) {
+    printf("Use this program as: sensor_replay [options] <sensor_data file> <server IP> <server port>\n");
+    printf("\t%-15s : parallel connections, every sensor id is sent over one of them (default 4)\n", "-c connections");
+    printf("\t%-15s : replay speed relative to the file timestamps, 0 = line rate (default 0)\n", "-x speed");
+    printf("\t%-15s : afterwards check that this data.csv holds exactly the replayed records\n", "-v data.csv");
+    printf("\t%-15s : max sec to wait for the gateway to write all records (default 30)\n", "-w wait");
+    printf("Start sensor_gateway with <max_connections> equal to the number of connections, so it stops after the replay\n");
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "state.h"
+#include "record.h"
+
+#define CACHE_LINE_SIZE 64
+#define STATE_WORDS     (sizeof(state_sensor_t) / sizeof(uint64_t))
+#define REQUEST_SIZE    256
+#define DUMP_CHUNK      8192
+
+_Static_assert(sizeof(state_sensor_t) % sizeof(uint64_t) == 0, "state_sensor_t is copied in 64-bit words");
+
+/* The payload is kept in atomic words, written and read relaxed: the seqlock orders them, and a reader racing
+ * with the writer reads a torn copy it then throws away instead of undefined behaviour. */
+typedef struct {
+    _Atomic uint32_t seq;       // odd while the datamgr writes the entry, 0 if it was never published
+    _Atomic uint64_t words[STATE_WORDS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) state_entry_t;
+
+typedef struct {
+    int fd;
+    int len;
+    char request[REQUEST_SIZE];
+} state_client_t;
+
+static state_entry_t *table = NULL;
+static _Atomic int max_id = 0;          // highest sensor id published so far, bounds a DUMP
+
+static int server_sd = -1;
+static int stop_pipe[2] = {-1, -1};
+static pthread_t server_thread;
+static char socket_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+int state_init(void) {
+    table = calloc(NUM_SENSOR_IDS, sizeof(state_entry_t));
+    return (table == NULL) ? -1 : 0;
+}
+
+void state_publish(const state_sensor_t *state) {
+    if (table == NULL) return;
+    state_entry_t *entry = &table[state->sensor_id];
+    uint64_t words[STATE_WORDS];
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    memcpy(words, state, sizeof(words));
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);     // the odd sequence is visible before any word changes
+    for (size_t i = 0; i < STATE_WORDS; i++) {
+        atomic_store_explicit(&entry->words[i], words[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+
+    if (state->sensor_id > atomic_load_explicit(&max_id, memory_order_relaxed)) {
+        atomic_store_explicit(&max_id, state->sensor_id, memory_order_release);
+    }
+}
+
+int state_get(sensor_id_t id, state_sensor_t *state) {
+    if (table == NULL) return 0;
+    state_entry_t *entry = &table[id];
+    uint64_t words[STATE_WORDS];
+    uint32_t before, after = 0;
+
+    do {
+        before = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        if (before == 0) return 0;
+        if (before & 1) continue;   // being written, a publish only takes a few ns
+        for (size_t i = 0; i < STATE_WORDS; i++) {
+            words[i] = atomic_load_explicit(&entry->words[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);  // the words are read before the sequence is checked again
+        after = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    memcpy(state, words, sizeof(words));
+    return 1;
+}
+
+int state_format(char *buf, int size, const state_sensor_t *state) {
+    char avg[32] = "-";
+    if (state->avg_ready) snprintf(avg, sizeof(avg), "%.4f", state->running_avg);
+    return snprintf(buf, size, "sensor=%hu room=%hu value=%.4f ts=%lld avg=%s count=%u silent=%d\n",
+                    state->sensor_id, state->room_id, state->last_value, (long long) state->last_ts, avg,
+                    state->count, state->silent);
+}
+
+static int send_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int send_dump(int fd) {
+    char buf[DUMP_CHUNK];
+    int len = 0, last = atomic_load_explicit(&max_id, memory_order_acquire);
+    state_sensor_t state;
+
+    for (int id = 1; id <= last; id++) {
+        if (!state_get((sensor_id_t) id, &state)) continue;
+        if (len > DUMP_CHUNK - 128) {
+            if (send_all(fd, buf, len) != 0) return -1;
+            len = 0;
+        }
+        len += state_format(buf + len, DUMP_CHUNK - len, &state);
+    }
+    len += snprintf(buf + len, DUMP_CHUNK - len, "END\n");
+    return send_all(fd, buf, len);
+}
+
+// answers one command line
+static int handle_command(int fd, char *line) {
+    char reply[128];
+    state_sensor_t state;
+    unsigned id;
+    int end = 0;
+
+    if (strcmp(line, "DUMP") == 0) return send_dump(fd);
+    if (sscanf(line, "GET sensor %u%n", &id, &end) == 1 && line[end] == '\0' && id < NUM_SENSOR_IDS) {
+        if (state_get((sensor_id_t) id, &state)) {
+            return send_all(fd, reply, state_format(reply, sizeof(reply), &state));
+        }
+        return send_all(fd, reply, snprintf(reply, sizeof(reply), "ERR unknown sensor %u\n", id));
+    }
+    return send_all(fd, reply, snprintf(reply, sizeof(reply), "ERR commands: GET sensor <id>, DUMP\n"));
+}
+
+// reads what a client sent and answers every complete line; -1 closes the connection
+static int handle_client(state_client_t *client) {
+    ssize_t got = recv(client->fd, client->request + client->len, REQUEST_SIZE - client->len, 0);
+    char *line, *newline;
+
+    if (got <= 0) return -1;
+    client->len += got;
+    line = client->request;
+    while ((newline = memchr(line, '\n', client->request + client->len - line)) != NULL) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+        if (handle_command(client->fd, line) != 0) return -1;
+        line = newline + 1;
+    }
+    client->len -= line - client->request;
+    memmove(client->request, line, client->len);
+    return (client->len == REQUEST_SIZE) ? -1 : 0;  // no command is that long
+}
+
+static void *server_run(void *arg) {
+    state_client_t clients[STATE_MAX_CLIENTS];
+    struct pollfd fds[STATE_MAX_CLIENTS + 2];
+    struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+    int num_clients = 0;
+
+    while (1) {
+        fds[0] = (struct pollfd) {.fd = stop_pipe[0], .events = POLLIN};
+        // stops accepting while full, the backlog holds further connections
+        fds[1] = (struct pollfd) {.fd = (num_clients < STATE_MAX_CLIENTS) ? server_sd : -1, .events = POLLIN};
+        for (int i = 0; i < num_clients; i++) fds[i + 2] = (struct pollfd) {.fd = clients[i].fd, .events = POLLIN};
+        if (poll(fds, num_clients + 2, -1) < 0) continue;
+        if (fds[0].revents) break;
+
+        for (int i = num_clients - 1; i >= 0; i--) {
+            if (fds[i + 2].revents == 0 || handle_client(&clients[i]) == 0) continue;
+            close(clients[i].fd);
+            clients[i] = clients[--num_clients];
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(server_sd, NULL, NULL);
+            if (fd < 0) continue;
+            // a client that doesn't read its DUMP is dropped instead of stalling the others
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            clients[num_clients++] = (state_client_t) {.fd = fd, .len = 0};
+        }
+    }
+    for (int i = 0; i < num_clients; i++) close(clients[i].fd);
+    return NULL;
+}
+
+int state_start_server(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    unlink(path);
+    server_sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_sd < 0) return -1;
+    if (pipe(stop_pipe) != 0 || bind(server_sd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(server_sd, 8) != 0 || pthread_create(&server_thread, NULL, server_run, NULL) != 0) {
+        close(server_sd);
+        server_sd = -1;
+        if (stop_pipe[0] >= 0) {
+            close(stop_pipe[0]);
+            close(stop_pipe[1]);
+            stop_pipe[0] = stop_pipe[1] = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void state_stop(void) {
+    if (server_sd >= 0) {
+        // the pipe wakes up the poll() of the server thread
+        if (write(stop_pipe[1], "", 1) != 1) perror("state_stop");
+        pthread_join(server_thread, NULL);
+        close(server_sd);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        unlink(socket_path);
+        server_sd = -1;
+        stop_pipe[0] = stop_pipe[1] = -1;
+    }
+    free(table);
+    table = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * Latest state of every sensor, published by datamgr_run and readable from any thread without disturbing it.
+ * - The table has one cache line per sensor id. Each entry is guarded by a seqlock: the datamgr (the only
+ *   writer) makes the sequence odd, writes the entry and makes it even again, so publishing takes no lock.
+ * - A reader copies the entry and retries if the sequence was odd or changed meanwhile; it never blocks the
+ *   writer and a reading is only ever seen whole.
+ * - state_start_server() answers "GET sensor <id>" and "DUMP" over a unix socket, one line per command
+ *   and per sensor ("END" closes a DUMP), so other processes can poll the state at high rates.
+ */
+
+#define STATE_MAX_CLIENTS 16    // connections served at once by the state socket
+
+typedef struct {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    uint32_t count;             // readings since the gateway started
+    double last_value;
+    int64_t last_ts;            // timestamp of the last reading
+    double running_avg;         // valid if avg_ready
+    uint8_t avg_ready;          // the running average window is full
+    uint8_t silent;             // reported silent by the datamgr and no reading since
+    uint8_t reserved[6];
+} state_sensor_t;
+
+/** Allocates the table; before this state_publish() does nothing and state_get() finds nothing
+ * \return 0 on success, -1 if out of memory
+ */
+int state_init(void);
+
+/** Publishes the state of sensor 'state->sensor_id'; only one thread may publish */
+void state_publish(const state_sensor_t *state);
+
+/** Copies the latest state of sensor 'id' to 'state'
+ * \return 1 if the sensor has published a state, 0 otherwise
+ */
+int state_get(sensor_id_t id, state_sensor_t *state);
+
+/** Formats 'state' as one line of the state socket, "sensor=<id> room=<id> value=... ts=... avg=... count=...
+ * silent=<0|1>\n" (avg is "-" while the window is not full)
+ * \return the length like snprintf
+ */
+int state_format(char *buf, int size, const state_sensor_t *state);
+
+/** Starts a thread serving the state on the unix socket 'path' (an old socket file there is replaced)
+ * \return 0 on success, -1 if the socket or thread could not be set up
+ */
+int state_start_server(const char *path);
+
+/** Stops the state server and removes its socket file, then frees the table */
+void state_stop(void);
+
+#endif /* _STATE_H_ */
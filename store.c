@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "journal.h"
+#include "latency.h"
+#include "metrics.h"
+
+#define FLUSH_INTERVAL_NS ((uint64_t) STORE_FLUSH_INTERVAL * 1000000000ull)
+
+_Static_assert(sizeof(store_index_header_t) == 64, "store_index_header_t is part of the file format");
+_Static_assert(sizeof(store_index_entry_t) == 40, "store_index_entry_t is part of the file format");
+_Static_assert(sizeof(store_value_t) == 4, "a block holds 4-byte timestamps and values");
+
+typedef struct {
+    sensor_record_t *records;   // buffered readings, in arrival order
+    int count, cap;
+    int active_index;           // position in store->active while count > 0
+    uint64_t first_ns;          // latency_now() when the oldest buffered reading came in
+} store_sensor_t;
+
+struct store {
+    char dir[PATH_MAX];
+    long segment_size;
+    int segment_seconds;
+    unsigned seq;                       // number of the current segment
+    FILE *data, *index;
+    uint64_t data_size;                 // bytes in the current .dat file
+    long segment_entries;               // index entries in the current .idx file
+    store_index_header_t header;        // of the current segment, ranges kept up to date in memory
+    store_sensor_t *sensors[NUM_SENSOR_IDS];
+    sensor_id_t *active;                // sensors with buffered readings
+    int num_active;
+    uint64_t next_check;                // when the oldest buffered reading is due, 0 if nothing is buffered
+    sensor_id_t *due;                   // scratch list of the sensors written in one pass
+    store_index_entry_t *entries;       // index entries of one pass, written after the blocks
+    int max_entries;
+    uint32_t *block;                    // scratch block: timestamps, then values
+};
+
+static void segment_path(store_t *store, char *buf, size_t size, unsigned seq, const char *ext) {
+    snprintf(buf, size, "%s/segment-%08u.%s", store->dir, seq, ext);
+}
+
+static int compare_entries(const void *x, const void *y) {
+    const store_index_entry_t *a = x, *b = y;
+    if (a->sensor != b->sensor) return (a->sensor < b->sensor) ? -1 : 1;
+    if (a->ts_min != b->ts_min) return (a->ts_min < b->ts_min) ? -1 : 1;
+    return (a->offset < b->offset) ? -1 : (a->offset > b->offset);
+}
+
+/* Rewrites the index of the current segment sorted by sensor and timestamp, with the sealed header, so a query
+ * finds the blocks of one sensor by binary search. The sorted index replaces the old one in one rename(); if
+ * anything fails the segment stays unsealed, which readers handle with a linear scan. */
+static void seal_index(store_t *store) {
+    char path[PATH_MAX + 32], tmp_path[PATH_MAX + 40];
+    store_index_entry_t *entries = malloc(store->segment_entries * sizeof(store_index_entry_t) + 1);
+    store_index_header_t header = store->header;
+    FILE *out = NULL;
+    int ok = 0;
+
+    segment_path(store, path, sizeof(path), store->seq, "idx");
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (entries != NULL && fflush(store->index) == 0 && fseek(store->index, sizeof(header), SEEK_SET) == 0 &&
+        fread(entries, sizeof(store_index_entry_t), store->segment_entries, store->index) ==
+        (size_t) store->segment_entries && (out = fopen(tmp_path, "wb")) != NULL) {
+        qsort(entries, store->segment_entries, sizeof(store_index_entry_t), compare_entries);
+        header.sealed = 1;
+        ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(entries, sizeof(store_index_entry_t), store->segment_entries, out) ==
+             (size_t) store->segment_entries &&
+             fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+    }
+    if (out != NULL) fclose(out);
+    if (ok && rename(tmp_path, path) == 0) {
+        store->header.sealed = 1;
+    } else {
+        if (out != NULL) remove(tmp_path);
+        write_to_log_process("Error: Could not seal a store segment index");
+    }
+    free(entries);
+}
+
+static void add_to_ranges(store_index_header_t *header, const store_index_entry_t *entry, int first) {
+    if (first || entry->ts_min < header->ts_min) header->ts_min = entry->ts_min;
+    if (first || entry->ts_max > header->ts_max) header->ts_max = entry->ts_max;
+    if (first || entry->sensor < header->sensor_min) header->sensor_min = entry->sensor;
+    if (first || entry->sensor > header->sensor_max) header->sensor_max = entry->sensor;
+}
+
+/* Continues segment 'seq' if it is unsealed and was written with the same value format: cuts off a torn index
+ * entry and the readings no entry points to, and recomputes the ranges
+ * \return 0 if the segment is open for appending, -1 if a new segment must be started */
+static int continue_segment(store_t *store, unsigned seq) {
+    char data_path[PATH_MAX + 32], index_path[PATH_MAX + 32];
+    store_index_header_t header;
+    store_index_entry_t entry;
+    struct stat st;
+    uint64_t data_end = 0;
+    long entries = 0;
+    FILE *index;
+
+    segment_path(store, data_path, sizeof(data_path), seq, "dat");
+    segment_path(store, index_path, sizeof(index_path), seq, "idx");
+    if ((index = fopen(index_path, "rb")) == NULL) return -1;
+    if (fread(&header, sizeof(header), 1, index) != 1 || memcmp(header.magic, STORE_INDEX_MAGIC, 8) != 0 ||
+        header.sealed || header.value_scale != RECORD_VALUE_SCALE || header.epoch_base != RECORD_EPOCH_BASE ||
+        header.entry_size != sizeof(store_index_entry_t) || stat(data_path, &st) != 0) {
+        fclose(index);
+        return -1;
+    }
+    // the index is written after the blocks: an entry may only be missing, or point past a torn .dat
+    while (fread(&entry, sizeof(entry), 1, index) == 1) {
+        uint64_t end = entry.offset + 2ull * entry.count * sizeof(uint32_t);
+        if (end > (uint64_t) st.st_size) break;
+        add_to_ranges(&header, &entry, entries == 0);
+        data_end = end;
+        entries++;
+    }
+    fclose(index);
+    if (truncate(index_path, sizeof(header) + entries * sizeof(entry)) != 0 || truncate(data_path, data_end) != 0) {
+        return -1;
+    }
+
+    store->data = fopen(data_path, "ab");
+    store->index = fopen(index_path, "r+b");
+    if (store->data == NULL || store->index == NULL || fseek(store->index, 0, SEEK_END) != 0) return -1;
+    store->seq = seq;
+    store->data_size = data_end;
+    store->segment_entries = entries;
+    store->header = header;
+    return 0;
+}
+
+static int start_segment(store_t *store, unsigned seq) {
+    char path[PATH_MAX + 32];
+
+    segment_path(store, path, sizeof(path), seq, "dat");
+    store->data = fopen(path, "wb");
+    segment_path(store, path, sizeof(path), seq, "idx");
+    store->index = fopen(path, "w+b");
+    if (store->data == NULL || store->index == NULL) return -1;
+
+    memset(&store->header, 0, sizeof(store->header));
+    memcpy(store->header.magic, STORE_INDEX_MAGIC, 8);
+    store->header.value_scale = RECORD_VALUE_SCALE;
+    store->header.entry_size = sizeof(store_index_entry_t);
+    store->header.epoch_base = RECORD_EPOCH_BASE;
+    store->header.created = time(NULL);
+    if (fwrite(&store->header, sizeof(store->header), 1, store->index) != 1 || fflush(store->index) != 0) return -1;
+    store->seq = seq;
+    store->data_size = 0;
+    store->segment_entries = 0;
+    return 0;
+}
+
+static void close_segment(store_t *store, int seal) {
+    if (store->index != NULL) {
+        if (seal) seal_index(store);
+        fclose(store->index);
+        store->index = NULL;
+    }
+    if (store->data != NULL) {
+        fclose(store->data);
+        store->data = NULL;
+    }
+}
+
+store_t *store_open(const char *dir, long segment_size, int segment_seconds) {
+    store_t *store = calloc(1, sizeof(store_t));
+    struct dirent *dirent;
+    unsigned seq, last = 0;
+    int found = 0, end;
+    char log_msg[PATH_MAX + 64];
+    DIR *d;
+
+    if (store == NULL) return NULL;
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->segment_size = (segment_size > 0) ? segment_size : STORE_SEGMENT_SIZE;
+    store->segment_seconds = (segment_seconds > 0) ? segment_seconds : 0;
+    store->active = malloc(NUM_SENSOR_IDS * sizeof(sensor_id_t));
+    store->due = malloc(NUM_SENSOR_IDS * sizeof(sensor_id_t));
+    store->entries = malloc(NUM_SENSOR_IDS * sizeof(store_index_entry_t));
+    store->max_entries = NUM_SENSOR_IDS;
+    store->block = malloc(2 * STORE_BLOCK_RECORDS * sizeof(uint32_t));
+    if (store->active == NULL || store->due == NULL || store->entries == NULL || store->block == NULL ||
+        (mkdir(dir, 0755) != 0 && errno != EEXIST) || (d = opendir(dir)) == NULL) {
+        store_close(&store);
+        return NULL;
+    }
+    while ((dirent = readdir(d)) != NULL) {
+        end = 0;
+        if (sscanf(dirent->d_name, "segment-%u.idx%n", &seq, &end) == 1 && dirent->d_name[end] == '\0' && end > 0 &&
+            (!found || seq > last)) {
+            last = seq;
+            found = 1;
+        }
+    }
+    closedir(d);
+
+    if (found && continue_segment(store, last) == 0) {
+        snprintf(log_msg, sizeof(log_msg), "Continuing store segment %u in %s", last, dir);
+    } else {
+        close_segment(store, 0);
+        if (start_segment(store, found ? last + 1 : 0) != 0) {
+            store_close(&store);
+            return NULL;
+        }
+        metrics_add(METRIC_STORE_SEGMENTS, 1);
+        snprintf(log_msg, sizeof(log_msg), "Started store segment %u in %s", store->seq, dir);
+    }
+    write_to_log_process(log_msg);
+    return store;
+}
+
+// orders valid readings before tagged ones, then by timestamp
+static int sorts_after(const sensor_record_t *a, const sensor_record_t *b) {
+    int invalid_a = a->flags & RECORD_FLAG_INVALID, invalid_b = b->flags & RECORD_FLAG_INVALID;
+    return (invalid_a != invalid_b) ? invalid_a > invalid_b : a->ts > b->ts;
+}
+
+// buffered readings arrive nearly in order and are rarely tagged, so an insertion sort is about one pass
+static void sort_by_ts(sensor_record_t *records, int count) {
+    for (int i = 1; i < count; i++) {
+        sensor_record_t record = records[i];
+        int j = i - 1;
+        while (j >= 0 && sorts_after(&records[j], &record)) {
+            records[j + 1] = records[j];
+            j--;
+        }
+        records[j + 1] = record;
+    }
+}
+
+static void rotate_if_needed(store_t *store) {
+    char log_msg[128];
+    int too_old = store->segment_seconds > 0 && time(NULL) - store->header.created >= store->segment_seconds;
+
+    if (store->data_size < (uint64_t) store->segment_size && !too_old) return;
+    fdatasync(fileno(store->data));
+    close_segment(store, 1);
+    if (start_segment(store, store->seq + 1) != 0) {
+        write_to_log_process("Error: Could not start a new store segment");
+        return;
+    }
+    metrics_add(METRIC_STORE_SEGMENTS, 1);
+    snprintf(log_msg, sizeof(log_msg), "Started store segment %u", store->seq);
+    write_to_log_process(log_msg);
+}
+
+// starts the next segment after the current one failed; without one, the readings stay buffered for the next try
+static int restart_segment(store_t *store) {
+    close_segment(store, 0);
+    if (start_segment(store, store->seq + 1) != 0) {
+        close_segment(store, 0);
+        return -1;
+    }
+    metrics_add(METRIC_STORE_SEGMENTS, 1);
+    return 0;
+}
+
+// writes 'count' readings of 'sensor', sorted by timestamp, all tagged or none and at most STORE_BLOCK_RECORDS,
+// as one block
+static int write_block(store_t *store, sensor_id_t sensor, const sensor_record_t *records, int count,
+                       store_index_entry_t *entry) {
+    store_value_t *values = (store_value_t *) &store->block[count];
+    size_t words = 2 * (size_t) count;
+
+    *entry = (store_index_entry_t) {.offset = store->data_size, .sensor = sensor, .count = count,
+                                    .flags = (records[0].flags & RECORD_FLAG_INVALID) ? STORE_BLOCK_INVALID : 0,
+                                    .ts_min = records[0].ts, .ts_max = records[count - 1].ts,
+                                    .value_min = records[0].value, .value_max = records[0].value};
+    for (int r = 0; r < count; r++) {
+        store_value_t value = records[r].value;
+        store->block[r] = records[r].ts;
+        values[r] = value;
+        entry->sum += value;
+        if (value < entry->value_min) entry->value_min = value;
+        if (value > entry->value_max) entry->value_max = value;
+    }
+    if (fwrite(store->block, sizeof(uint32_t), words, store->data) != words) return -1;
+    store->data_size += words * sizeof(uint32_t);
+    return 0;
+}
+
+/* Writes the blocks of every sensor in store->due, then their index entries, then releases the readings to the
+ * journal. A sensor has one more block if some of its readings are tagged, and more than one after a failed
+ * write: then the segment is left as it is and a new one started (or retried on the next write if that failed
+ * too), the readings stay buffered for the next try. */
+static int write_blocks(store_t *store, int num_due) {
+    int num_entries = 0, written = 0, retire = 0;
+
+    if (store->data == NULL && restart_segment(store) != 0) {
+        write_to_log_process("Error: Could not start a new store segment");
+        return -1;
+    }
+    for (int i = 0; i < num_due; i++) {
+        store_sensor_t *sensor = store->sensors[store->due[i]];
+        num_entries += (sensor->count + STORE_BLOCK_RECORDS - 1) / STORE_BLOCK_RECORDS + 1;
+    }
+    if (num_entries > store->max_entries) {
+        store_index_entry_t *entries = realloc(store->entries, num_entries * sizeof(store_index_entry_t));
+        if (entries == NULL) return -1;
+        store->entries = entries;
+        store->max_entries = num_entries;
+    }
+
+    num_entries = 0;
+    for (int i = 0; i < num_due && !written; i++) {
+        store_sensor_t *sensor = store->sensors[store->due[i]];
+        sort_by_ts(sensor->records, sensor->count);
+        for (int first = 0, count; first < sensor->count && !written; first += count) {
+            int invalid = sensor->records[first].flags & RECORD_FLAG_INVALID;
+            for (count = 1; first + count < sensor->count && count < STORE_BLOCK_RECORDS &&
+                            (sensor->records[first + count].flags & RECORD_FLAG_INVALID) == invalid; count++);
+            if (write_block(store, store->due[i], &sensor->records[first], count,
+                            &store->entries[num_entries++]) != 0) {
+                written = -1;
+            }
+        }
+    }
+    if (written == 0 && fflush(store->data) == 0 &&
+        fwrite(store->entries, sizeof(store_index_entry_t), num_entries, store->index) == (size_t) num_entries &&
+        fflush(store->index) == 0) {
+        written = 1;
+    }
+    if (written != 1) {
+        write_to_log_process("Error: Could not write to the store, starting a new segment");
+        restart_segment(store);
+        return -1;
+    }
+
+    for (int e = 0; e < num_entries; e++) {
+        add_to_ranges(&store->header, &store->entries[e], store->segment_entries++ == 0);
+    }
+    for (int i = 0; i < num_due; i++) {
+        store_sensor_t *sensor = store->sensors[store->due[i]];
+        for (int r = 0; r < sensor->count; r++) retire |= journal_release(&sensor->records[r]);
+        sensor->count = 0;
+        // swap the sensor out of the active list
+        sensor_id_t moved = store->active[--store->num_active];
+        store->active[sensor->active_index] = moved;
+        store->sensors[moved]->active_index = sensor->active_index;
+    }
+    metrics_add(METRIC_STORE_BLOCKS, num_entries);
+    if (retire) {
+        // a whole journal segment is in the store: make that durable before the segment goes
+        fdatasync(fileno(store->data));
+        fdatasync(fileno(store->index));
+        journal_retire();
+    }
+    rotate_if_needed(store);
+    return 0;
+}
+
+int store_append(store_t *store, const sensor_record_t *record) {
+    store_sensor_t *sensor = store->sensors[record->id];
+
+    if (sensor == NULL) {
+        sensor = calloc(1, sizeof(store_sensor_t));
+        if (sensor == NULL) return -1;
+        store->sensors[record->id] = sensor;
+    }
+    if (sensor->count == sensor->cap) {
+        // grows with the sensor's rate up to a full block, so slow sensors stay small
+        int cap = sensor->cap ? sensor->cap * 2 : 4;
+        sensor_record_t *records = realloc(sensor->records, cap * sizeof(sensor_record_t));
+        if (records == NULL) return -1;
+        sensor->records = records;
+        sensor->cap = cap;
+    }
+    if (sensor->count == 0) {
+        sensor->first_ns = latency_now();
+        sensor->active_index = store->num_active;
+        store->active[store->num_active++] = record->id;
+        if (store->next_check == 0) store->next_check = sensor->first_ns + FLUSH_INTERVAL_NS;
+    }
+    sensor->records[sensor->count++] = *record;
+
+    // after a failed write the next try comes one block later, or with store_tick()
+    if (sensor->count % STORE_BLOCK_RECORDS != 0) return 0;
+    store->due[0] = record->id;
+    return write_blocks(store, 1);
+}
+
+uint64_t store_next_flush(store_t *store) {
+    return (store->num_active > 0) ? store->next_check : 0;
+}
+
+int store_tick(store_t *store, uint64_t now_ns) {
+    int num_due = 0, result = 0;
+    uint64_t oldest = 0;
+
+    if (store->num_active == 0 || now_ns < store->next_check) return 0;
+    for (int i = 0; i < store->num_active; i++) {
+        store_sensor_t *sensor = store->sensors[store->active[i]];
+        if (now_ns - sensor->first_ns >= FLUSH_INTERVAL_NS) {
+            store->due[num_due++] = store->active[i];
+        } else if (oldest == 0 || sensor->first_ns < oldest) {
+            oldest = sensor->first_ns;
+        }
+    }
+    if (num_due > 0) result = write_blocks(store, num_due);
+    // after a failed write the readings stay buffered and are tried again one interval later
+    store->next_check = (result == 0 && oldest != 0) ? oldest + FLUSH_INTERVAL_NS : now_ns + FLUSH_INTERVAL_NS;
+    return result;
+}
+
+void store_close(store_t **store) {
+    if (store == NULL || *store == NULL) return;
+    store_t *s = *store;
+
+    if (s->num_active > 0) {
+        memcpy(s->due, s->active, s->num_active * sizeof(sensor_id_t));
+        write_blocks(s, s->num_active);
+    }
+    if (s->data != NULL) fdatasync(fileno(s->data));
+    close_segment(s, 0);
+    for (int i = 0; i < NUM_SENSOR_IDS; i++) {
+        if (s->sensors[i] == NULL) continue;
+        free(s->sensors[i]->records);
+        free(s->sensors[i]);
+    }
+    free(s->active);
+    free(s->due);
+    free(s->entries);
+    free(s->block);
+    free(s);
+    *store = NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <stdint.h>
+#include "config.h"
+#include "record.h"
+
+/*
+ * Segmented on-disk store of the readings, the alternative to data.csv (storage_mgr_run with a storage dir).
+ * - The store is a directory of segments. Segment n is "segment-<n>.dat" with the readings and "segment-<n>.idx"
+ *   with the sparse index; both are only appended to while the segment is written.
+ * - Readings are buffered per sensor and written as blocks of one sensor, sorted by timestamp: the timestamps as
+ *   uint32 (record ts) followed by the values as in sensor_record_t. A block is written when it holds
+ *   STORE_BLOCK_RECORDS readings or its oldest reading waited STORE_FLUSH_INTERVAL seconds.
+ * - Every block gets one index entry (offset, sensor, count, timestamp and value range, sum), so a query for one
+ *   sensor over one hour only reads the index and the few blocks it points to.
+ * - Readings tagged RECORD_FLAG_INVALID (validate.h) go to blocks of their own, marked STORE_BLOCK_INVALID in
+ *   their index entry; sensor_query leaves them out of aggregates.
+ * - A segment is sealed and the next one started when it reaches the size or age limit. Sealing rewrites the
+ *   index sorted by sensor and timestamp, with the timestamp and sensor id range of the segment in its header;
+ *   the index of the segment being written is in write order.
+ * - On start the last segment is continued; a block or index entry torn by a crash is cut off first.
+ */
+
+#ifndef STORE_SEGMENT_SIZE
+#define STORE_SEGMENT_SIZE (64L << 20)  // default bytes of readings per segment
+#endif
+
+#ifndef STORE_SEGMENT_SECONDS
+#define STORE_SEGMENT_SECONDS 0         // default segment age limit in seconds, 0 for size-based rotation only
+#endif
+
+#ifndef STORE_BLOCK_RECORDS
+#define STORE_BLOCK_RECORDS 1024        // readings per block at most
+#endif
+
+#ifndef STORE_FLUSH_INTERVAL
+#define STORE_FLUSH_INTERVAL 30         // seconds a reading waits for more of its sensor at most
+#endif
+
+#define STORE_INDEX_MAGIC "SGWSIDX1"
+#define STORE_BLOCK_INVALID 0x0001  // the readings of the block failed validation and were kept in tag mode
+
+#if RECORD_VALUE_SCALE > 0
+typedef int32_t store_value_t;
+#else
+typedef float store_value_t;
+#endif
+
+typedef struct {
+    char magic[8];                  // STORE_INDEX_MAGIC
+    int32_t value_scale;            // RECORD_VALUE_SCALE of the writer, 0 for float values
+    uint32_t entry_size;            // sizeof(store_index_entry_t)
+    int64_t epoch_base;             // RECORD_EPOCH_BASE of the writer
+    int64_t created;                // wall clock time the segment was started
+    uint32_t sealed;                // 1 once complete: the ranges below are valid, the entries sorted by sensor, ts
+    uint32_t ts_min, ts_max;        // record timestamps of the segment
+    sensor_id_t sensor_min, sensor_max;
+    uint8_t reserved[16];
+} store_index_header_t;             // 64 bytes, at the start of every .idx file
+
+typedef struct {
+    uint64_t offset;                // of the block in the .dat file
+    sensor_id_t sensor;
+    uint16_t flags;                 // STORE_BLOCK_*
+    uint32_t count;                 // readings in the block: count timestamps, then count values
+    uint32_t ts_min, ts_max;
+    store_value_t value_min, value_max;
+    double sum;                     // of the stored values
+} store_index_entry_t;              // 40 bytes
+
+typedef struct store store_t;
+
+/** Opens the store in directory 'dir' (created if needed) and continues its last segment
+ * \param segment_size bytes of readings after which a segment is sealed
+ * \param segment_seconds age after which a segment is sealed, 0 for no age limit
+ * \return the store, or NULL if the directory or the segment files can't be set up
+ */
+store_t *store_open(const char *dir, long segment_size, int segment_seconds);
+
+/** Buffers one reading; writes its sensor's block when that is full
+ * \return 0 on success, -1 if a block could not be written
+ */
+int store_append(store_t *store, const sensor_record_t *record);
+
+/** Returns the latency_now() time at which store_tick() has blocks to write, or 0 if nothing is buffered */
+uint64_t store_next_flush(store_t *store);
+
+/** Writes the blocks of which the oldest reading waited long enough; 'now_ns' is a latency_now() stamp
+ * \return 0 on success, -1 if a block could not be written
+ */
+int store_tick(store_t *store, uint64_t now_ns);
+
+/** Writes all buffered readings and closes the store; the last segment is continued by the next store_open() */
+void store_close(store_t **store);
+
+#endif /* _STORE_H_ */
@@ -0,0 +1,24 @@
+make all
+port=5678
+clients=50
+rm -rf journal_test data.csv
+echo -e "starting gateway with a journal in journal_test"
+./sensor_gateway $port $clients --journal journal_test &
+gateway=$!
+sleep 3
+echo -e 'starting load generator: 2000 sensors over 50 connections at 10 readings/s each, the gateway is killed after 5 s'
+./sensor_loadgen -s 2000 -c 50 -t 4 -r 10 -d 10 -f room_sensor.map 127.0.0.1 $port > /dev/null &
+sleep 5
+kill -9 $gateway
+wait $gateway
+killall sensor_loadgen
+before=$(wc -l < data.csv)
+head -n $before data.csv | sort -u > journal_test_before.csv
+echo -e "restarting the gateway without input: it only replays what the journal kept"
+./sensor_gateway --ingest-file /dev/null --journal journal_test
+grep "journal segments" gateway.log
+echo "data.csv: $before lines at the crash, $(wc -l < data.csv) after the restart"
+echo "replayed lines data.csv had already (at most a few journal blocks):" \
+     "$(tail -n +$((before + 1)) data.csv | sort -u | comm -12 - journal_test_before.csv | wc -l)"
+echo "journal segments left: $(ls journal_test | wc -l)"
+rm -f journal_test_before.csv
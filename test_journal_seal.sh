@@ -0,0 +1,35 @@
+make all
+port=5678
+clients=20
+rm -rf journal_seal data.csv
+echo -e "starting gateway with a journal in journal_seal"
+./sensor_gateway $port $clients --journal journal_seal &
+gateway=$!
+sleep 3
+echo -e 'starting load generator: 400 sensors over 20 connections without think time, so segments are sealed while' \
+        'the other connections are still appending'
+./sensor_loadgen -s 400 -c $clients -t 4 -r 0 -m closed -d 3 127.0.0.1 $port | grep "^records"
+wait $gateway
+echo "data.csv: $(wc -l < data.csv) lines, one per record sent"
+echo "journal segments left after a clean stop (none): $(ls journal_seal | wc -l)"
+
+rm -rf journal_seal data.csv
+echo -e "starting the gateway again, it is killed after 5 s while the segments fill"
+./sensor_gateway $port $clients --journal journal_seal &
+gateway=$!
+sleep 3
+./sensor_loadgen -s 400 -c $clients -t 4 -r 0 -m closed -d 10 127.0.0.1 $port > /dev/null &
+sleep 5
+kill -9 $gateway
+wait $gateway
+killall sensor_loadgen
+before=$(wc -l < data.csv)
+head -n $before data.csv | sort -u > journal_seal_before.csv
+echo -e "restarting the gateway without input: it only replays what the journal kept"
+./sensor_gateway --ingest-file /dev/null --journal journal_seal
+grep "journal segments" gateway.log
+echo "data.csv: $before lines at the crash, $(wc -l < data.csv) after the restart"
+echo "replayed lines data.csv had already (at most a few journal blocks):" \
+     "$(tail -n +$((before + 1)) data.csv | sort -u | comm -12 - journal_seal_before.csv | wc -l)"
+echo "journal segments left: $(ls journal_seal | wc -l)"
+rm -f journal_seal_before.csv
@@ -0,0 +1,10 @@
+make all
+port=5678
+clients=50
+echo -e "starting gateway "
+./sensor_gateway $port $clients &
+sleep 3
+echo -e 'starting load generator: 2000 sensors over 50 connections at 10 readings/s each'
+./sensor_loadgen -s 2000 -c 50 -t 4 -r 10 -d 10 -f room_sensor.map 127.0.0.1 $port
+sleep 5
+killall sensor_gateway
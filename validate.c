@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <stdatomic.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "validate.h"
+#include "metrics.h"
+
+#define CHUNK 64            // readings per kernel call, one bit each in the returned mask
+
+// the kernels read a record as three 32-bit words: id | flags << 16, ts, value
+_Static_assert(sizeof(sensor_record_t) == 12 && offsetof(sensor_record_t, flags) == 2 &&
+               offsetof(sensor_record_t, ts) == 4 && offsetof(sensor_record_t, value) == 8,
+               "the kernels depend on the layout of sensor_record_t");
+
+#define BAD_FLAGS ((uint32_t) (RECORD_FLAG_VALUE_CLAMPED | RECORD_FLAG_TS_CLAMPED) << 16)
+
+typedef struct {
+    uint32_t ts_min;
+    uint32_t ts_max;
+#if RECORD_VALUE_SCALE > 0
+    int32_t value_min;
+    int32_t value_max;
+#else
+    float value_min;
+    float value_max;
+#endif
+} bounds_t;
+
+// returns a mask with bit i set if records[i] is invalid, count <= CHUNK
+typedef uint64_t (*kernel_t)(const sensor_record_t *records, int count, const bounds_t *bounds);
+
+static validate_mode_t mode = VALIDATE_OFF;
+static double step_limit;       // in packed units
+static bounds_t value_bounds;
+static kernel_t kernel;
+static const char *kernel_name = "scalar";
+// per sensor: ts << 32 | the packed value of the last valid reading, 0 if there was none
+static _Atomic uint64_t *last = NULL;
+
+static inline int invalid(const sensor_record_t *record, const bounds_t *bounds) {
+    // negated, so a NaN float fails the range check as well
+    return (record->flags & (RECORD_FLAG_VALUE_CLAMPED | RECORD_FLAG_TS_CLAMPED)) ||
+           record->ts < bounds->ts_min || record->ts > bounds->ts_max ||
+           !(record->value >= bounds->value_min && record->value <= bounds->value_max);
+}
+
+static uint64_t kernel_scalar(const sensor_record_t *records, int count, const bounds_t *bounds) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < count; i++) mask |= (uint64_t) invalid(&records[i], bounds) << i;
+    return mask;
+}
+
+#if defined(__x86_64__)
+
+static uint64_t kernel_sse2(const sensor_record_t *records, int count, const bounds_t *bounds) {
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);     // unsigned compares are signed ones with the sign flipped
+    const __m128i ts_min = _mm_xor_si128(_mm_set1_epi32((int32_t) bounds->ts_min), sign);
+    const __m128i ts_max = _mm_xor_si128(_mm_set1_epi32((int32_t) bounds->ts_max), sign);
+    const __m128i bad_flags = _mm_set1_epi32(BAD_FLAGS);
+    const __m128i zero = _mm_setzero_si128();
+#if RECORD_VALUE_SCALE > 0
+    const __m128i value_min = _mm_set1_epi32(bounds->value_min), value_max = _mm_set1_epi32(bounds->value_max);
+#else
+    const __m128 value_min = _mm_set1_ps(bounds->value_min), value_max = _mm_set1_ps(bounds->value_max);
+#endif
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        // 4 records are 12 words w0..w11 in three loads, deinterleaved into the words of each field
+        const __m128i *p = (const __m128i *) &records[i];
+        __m128 a = _mm_castsi128_ps(_mm_loadu_si128(p));        // w0 w1 w2 w3
+        __m128 b = _mm_castsi128_ps(_mm_loadu_si128(p + 1));    // w4 w5 w6 w7
+        __m128 c = _mm_castsi128_ps(_mm_loadu_si128(p + 2));    // w8 w9 w10 w11
+        __m128 w6w9 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));
+        __m128i head = _mm_castps_si128(_mm_shuffle_ps(a, w6w9, _MM_SHUFFLE(2, 0, 3, 0)));
+        __m128i ts = _mm_castps_si128(_mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                                                     _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)),
+                                                     _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128 value = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                                      _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128i bad, tsx = _mm_xor_si128(ts, sign);
+
+        bad = _mm_or_si128(_mm_cmplt_epi32(tsx, ts_min), _mm_cmpgt_epi32(tsx, ts_max));
+        bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(head, bad_flags), zero),
+                                                 _mm_cmpeq_epi32(zero, zero)));
+#if RECORD_VALUE_SCALE > 0
+        __m128i v = _mm_castps_si128(value);
+        bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(v, value_min), _mm_cmpgt_epi32(v, value_max)));
+#else
+        bad = _mm_or_si128(bad, _mm_castps_si128(_mm_or_ps(_mm_cmpnge_ps(value, value_min),
+                                                           _mm_cmpnle_ps(value, value_max))));
+#endif
+        mask |= (uint64_t) _mm_movemask_ps(_mm_castsi128_ps(bad)) << i;
+    }
+    return mask | (kernel_scalar(records + i, count - i, bounds) << i);
+}
+
+// a field of 8 records out of their 24 words in a, b and c: blend the lanes holding it, then put them in order
+#define FIELD_AVX2(a, b, c, from_b, from_c, order) \
+    _mm256_permutevar8x32_epi32(_mm256_blend_epi32(_mm256_blend_epi32(a, b, from_b), c, from_c), order)
+
+__attribute__((target("avx2")))
+static uint64_t kernel_avx2(const sensor_record_t *records, int count, const bounds_t *bounds) {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i ts_min = _mm256_xor_si256(_mm256_set1_epi32((int32_t) bounds->ts_min), sign);
+    const __m256i ts_max = _mm256_xor_si256(_mm256_set1_epi32((int32_t) bounds->ts_max), sign);
+    const __m256i bad_flags = _mm256_set1_epi32(BAD_FLAGS);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i head_order = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i ts_order = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+    const __m256i value_order = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+#if RECORD_VALUE_SCALE > 0
+    const __m256i value_min = _mm256_set1_epi32(bounds->value_min);
+    const __m256i value_max = _mm256_set1_epi32(bounds->value_max);
+#else
+    const __m256 value_min = _mm256_set1_ps(bounds->value_min), value_max = _mm256_set1_ps(bounds->value_max);
+#endif
+    uint64_t mask = 0;
+    int i;
+
+    // gathers would do the deinterleaving as well, but are slower than this on several CPUs
+    for (i = 0; i + 8 <= count; i += 8) {
+        const __m256i *p = (const __m256i *) &records[i];
+        __m256i a = _mm256_loadu_si256(p);              // w0..w7
+        __m256i b = _mm256_loadu_si256(p + 1);          // w8..w15
+        __m256i c = _mm256_loadu_si256(p + 2);          // w16..w23
+        __m256i head = FIELD_AVX2(a, b, c, 0x92, 0x24, head_order);    // w0 w3 .. w21
+        __m256i ts = FIELD_AVX2(a, b, c, 0x24, 0x49, ts_order);        // w1 w4 .. w22
+        __m256i bad, tsx = _mm256_xor_si256(ts, sign);
+
+        bad = _mm256_or_si256(_mm256_cmpgt_epi32(ts_min, tsx), _mm256_cmpgt_epi32(tsx, ts_max));
+        bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_and_si256(head, bad_flags), zero),
+                                                    _mm256_cmpeq_epi32(zero, zero)));
+#if RECORD_VALUE_SCALE > 0
+        __m256i v = FIELD_AVX2(a, b, c, 0x49, 0x92, value_order);   // w2 w5 .. w23
+        bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpgt_epi32(value_min, v),
+                                                   _mm256_cmpgt_epi32(v, value_max)));
+#else
+        __m256 v = _mm256_castsi256_ps(FIELD_AVX2(a, b, c, 0x49, 0x92, value_order));
+        bad = _mm256_or_si256(bad, _mm256_castps_si256(_mm256_or_ps(_mm256_cmp_ps(v, value_min, _CMP_NGE_UQ),
+                                                                    _mm256_cmp_ps(v, value_max, _CMP_NLE_UQ))));
+#endif
+        mask |= (uint64_t) _mm256_movemask_ps(_mm256_castsi256_ps(bad)) << i;
+    }
+    return mask | (kernel_scalar(records + i, count - i, bounds) << i);
+}
+
+#endif /* __x86_64__ */
+
+int validate_use_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        kernel = kernel_scalar;
+        kernel_name = "scalar";
+#if defined(__x86_64__)
+    } else if (strcmp(name, "sse2") == 0) {
+        kernel = kernel_sse2;
+        kernel_name = "sse2";
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        kernel = kernel_avx2;
+        kernel_name = "avx2";
+#endif
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *validate_kernel(void) {
+    return kernel_name;
+}
+
+int validate_init(validate_mode_t new_mode, double max_step) {
+    last = calloc(NUM_SENSOR_IDS, sizeof(*last));
+    if (last == NULL) return -1;
+#if RECORD_VALUE_SCALE > 0
+    value_bounds.value_min = (int32_t) (VALIDATE_MIN_VALUE * RECORD_VALUE_SCALE);
+    value_bounds.value_max = (int32_t) (VALIDATE_MAX_VALUE * RECORD_VALUE_SCALE);
+    step_limit = max_step * RECORD_VALUE_SCALE;
+#else
+    value_bounds.value_min = (float) VALIDATE_MIN_VALUE;
+    value_bounds.value_max = (float) VALIDATE_MAX_VALUE;
+    step_limit = max_step;
+#endif
+    if (validate_use_kernel("avx2") != 0 && validate_use_kernel("sse2") != 0) validate_use_kernel("scalar");
+    mode = new_mode;
+    return 0;
+}
+
+// rate-of-change check against the last valid reading of the sensor, which it replaces if it passes
+static int step_ok(const sensor_record_t *record) {
+    _Atomic uint64_t *entry = &last[record->id];
+    uint64_t previous = atomic_load_explicit(entry, memory_order_relaxed);
+    uint32_t value, last_ts = (uint32_t) (previous >> 32), last_value = (uint32_t) previous;
+    uint64_t elapsed = (record->ts > last_ts) ? record->ts - last_ts : 1;
+
+    if (previous != 0) {
+#if RECORD_VALUE_SCALE > 0
+        int64_t change = (int64_t) record->value - (int32_t) last_value;
+        if (change < 0) change = -change;
+        if ((double) change > step_limit * (double) elapsed) return 0;
+#else
+        float before;
+        memcpy(&before, &last_value, sizeof(before));
+        double change = (double) record->value - before;
+        if (change < 0) change = -change;
+        if (change > step_limit * (double) elapsed) return 0;
+#endif
+        if (record->ts < last_ts) return 1;     // late: the newer reading stays the reference
+    }
+    memcpy(&value, &record->value, sizeof(value));
+    atomic_store_explicit(entry, (uint64_t) record->ts << 32 | value, memory_order_relaxed);
+    return 1;
+}
+
+int validate_batch(sensor_record_t *records, int count) {
+    bounds_t bounds = value_bounds;
+    int64_t now, kept = 0, rejected = 0;
+    const int check_steps = (step_limit > 0);
+
+    if (mode == VALIDATE_OFF || last == NULL) return count;
+
+    now = (int64_t) time(NULL) - RECORD_EPOCH_BASE;
+    bounds.ts_min = (now - VALIDATE_MAX_AGE < 0) ? 0 : (uint32_t) (now - VALIDATE_MAX_AGE);
+    bounds.ts_max = (now + VALIDATE_MAX_AHEAD > UINT32_MAX) ? UINT32_MAX : (uint32_t) (now + VALIDATE_MAX_AHEAD);
+
+    for (int start = 0; start < count; start += CHUNK) {
+        int n = (count - start < CHUNK) ? count - start : CHUNK;
+        uint64_t mask = kernel(records + start, n, &bounds);
+
+        if (mask == 0 && !check_steps) {
+            // the common case stays vectorized: nothing to look at one by one
+            if (kept != start) memmove(&records[kept], &records[start], n * sizeof(sensor_record_t));
+            kept += n;
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            sensor_record_t *record = &records[start + i];
+            if (!(mask & (1ull << i)) && (!check_steps || step_ok(record))) {
+                records[kept++] = *record;
+                continue;
+            }
+            rejected++;
+            if (mode == VALIDATE_TAG) {
+                record->flags |= RECORD_FLAG_INVALID;
+                records[kept++] = *record;
+            }
+        }
+    }
+    if (rejected > 0) metrics_add(METRIC_RECORDS_INVALID, rejected);
+    return (int) kept;
+}
+
+void validate_free(void) {
+    mode = VALIDATE_OFF;
+    free(last);
+    last = NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef _VALIDATE_H_
+#define _VALIDATE_H_
+
+#include "record.h"
+
+/*
+ * Optional validation of the readings at the receiving edge (--validate drop|tag), before dedup, so spikes and
+ * garbage from a faulty sensor never reach the running averages or data.csv.
+ * - A reading is invalid if its value is outside [VALIDATE_MIN_VALUE, VALIDATE_MAX_VALUE] or wasn't finite
+ *   (record_pack() flags NaN, inf and out-of-range values as clamped), if its timestamp is more than
+ *   VALIDATE_MAX_AGE seconds in the past or VALIDATE_MAX_AHEAD in the future, or if it differs more than
+ *   max_step (--validate-max-step) per second from the last valid reading of its sensor.
+ * - Batches are checked 8 readings at a time with AVX2 blends and permutes, or 4 at a time with SSE2 shuffles
+ *   on CPUs without AVX2; the scalar kernel takes the tail and other architectures. The rate-of-change check
+ *   depends on the reading before it, so it stays scalar: one relaxed 64-bit load and store per reading.
+ *   The connections, ingest and forwarded frames all pass batches: what one receive took from the socket, a
+ *   batch of the ingest file, a frame.
+ * - drop removes invalid readings from the batch, tag keeps them with RECORD_FLAG_INVALID: they still go to the
+ *   journal and to storage, as "<id>,<value>,<ts>,invalid" in data.csv or in STORE_BLOCK_INVALID blocks of the
+ *   store, but the datamgr, the rollups, sensor_query aggregates, the subscribers and an upstream gateway skip
+ *   them.
+ * Without validate_init() every reading is valid.
+ */
+
+#ifndef VALIDATE_MIN_VALUE
+#define VALIDATE_MIN_VALUE -60.0        // lowest plausible value (degrees Celsius)
+#endif
+
+#ifndef VALIDATE_MAX_VALUE
+#define VALIDATE_MAX_VALUE 100.0        // highest plausible value
+#endif
+
+#ifndef VALIDATE_MAX_AGE
+#define VALIDATE_MAX_AGE (30 * 86400)   // seconds a timestamp may lie in the past
+#endif
+
+#ifndef VALIDATE_MAX_AHEAD
+#define VALIDATE_MAX_AHEAD 3600         // seconds a timestamp may lie in the future (clock skew)
+#endif
+
+#ifndef VALIDATE_MAX_STEP
+#define VALIDATE_MAX_STEP 10.0          // default largest change per second between two readings of a sensor
+#endif
+
+typedef enum {
+    VALIDATE_OFF = 0,
+    VALIDATE_TAG,
+    VALIDATE_DROP
+} validate_mode_t;
+
+/** Allocates the per-sensor table of the rate-of-change check and picks the fastest kernel of this CPU
+ * \param max_step largest change of a sensor's value per second, 0 = no rate-of-change check
+ * \return 0 on success, -1 if out of memory
+ */
+int validate_init(validate_mode_t mode, double max_step);
+
+/** Checks 'count' readings against the limits, with timestamps relative to the current time
+ * - Invalid readings are tagged or removed, keeping the order of the others, and counted in
+ *   METRIC_RECORDS_INVALID.
+ * \return the number of records left
+ */
+int validate_batch(sensor_record_t *records, int count);
+
+/** Selects a kernel by name, for benchmarks: "avx2", "sse2" or "scalar"
+ * \return 0 on success, -1 if this CPU or build doesn't have it
+ */
+int validate_use_kernel(const char *name);
+
+/** \return the name of the kernel in use */
+const char *validate_kernel(void);
+
+/** Frees the table, after which every reading is valid again */
+void validate_free(void);
+
+#endif /* _VALIDATE_H_ */